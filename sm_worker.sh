@@ -0,0 +1,23 @@
+#!/bin/bash
+# Long-lived bridge worker started by toxbot (see src/bridge.h).
+# Reads batches of length-prefixed records from stdin and hands each message to sm.sh.
+
+export LC_ALL=C    # read -N counts bytes, not characters
+dir="$(dirname "$0")"
+
+read_field() {
+  local len
+  IFS= read -r len || return 1
+  if [[ "$len" -eq 0 ]]; then
+    printf -v "$1" ''
+    return 0
+  fi
+  IFS= read -r -d '' -N "$len" "$1"
+}
+
+while IFS= read -r count; do
+  for ((i = 0; i < count; i++)); do
+    read_field sender && read_field group && read_field text || exit 1
+    bash "$dir/sm.sh" "$sender" "$text"
+  done
+done
@@ -0,0 +1,573 @@
+/*  acl.c
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L    /* pthread_rwlock_t */
+
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <tox/tox.h>
+
+#include "acl.h"
+#include "blocklist.h"
+#include "hex.h"
+#include "misc.h"
+#include "toxbot.h"
+#include "log.h"
+
+#define KEY_SET_MIN_CAPACITY 64
+
+/* Open addressing hash set of Tox public keys. Capacity is always a power of two
+ * and kept at most half full so probe sequences stay short. */
+struct Key_Set {
+    const char *path;
+    uint8_t    (*keys)[TOX_PUBLIC_KEY_SIZE];
+    uint8_t    *used;
+    size_t     capacity;
+    size_t     count;
+    struct timespec mtime;    // modification time of path when it was last loaded
+    off_t      size;     // size of path when it was last loaded
+};
+
+static struct Key_Set masters = { MASTERLIST_FILE };
+static struct Key_Set blocked = { BLOCKLIST_FILE };
+
+/* Compiled form of the blockedkeys file. Used instead of the text file whenever it was
+ * compiled from the text file as it is now, so startup doesn't need to parse any hex. */
+static struct Blocklist blocked_bin;
+static struct timespec blocked_bin_mtime;  // modification time of the compiled file when we last looked at it
+static off_t blocked_bin_size;
+
+/* The key lists are shared by every profile thread; reloading them takes the write lock */
+static pthread_rwlock_t lists_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* Bumped whenever a key list changes, so each friend cache knows to refresh its bits */
+static atomic_uint lists_generation;
+
+struct Friend_Auth {
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+    bool    active;
+    bool    master;
+    bool    blocked;
+};
+
+/* Public keys are uniformly distributed, so the first eight bytes make a good hash
+ * once mixed to protect against crafted keys sharing a prefix. */
+static size_t key_hash(const uint8_t *key)
+{
+    uint64_t h;
+    memcpy(&h, key, sizeof(h));
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (size_t) h;
+}
+
+/* Returns the slot holding key, or the empty slot where it would be inserted. */
+static size_t key_set_slot(const struct Key_Set *set, const uint8_t *key)
+{
+    size_t mask = set->capacity - 1;
+    size_t i = key_hash(key) & mask;
+
+    while (set->used[i] && memcmp(set->keys[i], key, TOX_PUBLIC_KEY_SIZE) != 0) {
+        i = (i + 1) & mask;
+    }
+
+    return i;
+}
+
+static bool key_set_contains(const struct Key_Set *set, const uint8_t *key)
+{
+    if (set->count == 0) {
+        return false;
+    }
+
+    return set->used[key_set_slot(set, key)];
+}
+
+static int key_set_resize(struct Key_Set *set, size_t capacity)
+{
+    uint8_t (*keys)[TOX_PUBLIC_KEY_SIZE] = malloc(capacity * TOX_PUBLIC_KEY_SIZE);
+    uint8_t *used = calloc(capacity, 1);
+
+    if (keys == NULL || used == NULL) {
+        free(keys);
+        free(used);
+        return -1;
+    }
+
+    struct Key_Set old = *set;
+    set->keys = keys;
+    set->used = used;
+    set->capacity = capacity;
+
+    for (size_t i = 0; i < old.capacity; ++i) {
+        if (old.used[i]) {
+            size_t slot = key_set_slot(set, old.keys[i]);
+            memcpy(set->keys[slot], old.keys[i], TOX_PUBLIC_KEY_SIZE);
+            set->used[slot] = 1;
+        }
+    }
+
+    free(old.keys);
+    free(old.used);
+    return 0;
+}
+
+static int key_set_add(struct Key_Set *set, const uint8_t *key)
+{
+    if ((set->count + 1) * 2 > set->capacity) {
+        size_t capacity = set->capacity ? set->capacity * 2 : KEY_SET_MIN_CAPACITY;
+
+        if (key_set_resize(set, capacity) == -1) {
+            return -1;
+        }
+    }
+
+    size_t slot = key_set_slot(set, key);
+
+    if (!set->used[slot]) {
+        memcpy(set->keys[slot], key, TOX_PUBLIC_KEY_SIZE);
+        set->used[slot] = 1;
+        ++set->count;
+    }
+
+    return 0;
+}
+
+static void key_set_clear(struct Key_Set *set)
+{
+    free(set->keys);
+    free(set->used);
+    set->keys = NULL;
+    set->used = NULL;
+    set->capacity = 0;
+    set->count = 0;
+}
+
+/* Decodes the public key at the start of a hex encoded Tox ID or public key.
+ * Returns 0 on success, -1 if the string does not begin with a valid key. */
+static int parse_public_key(const char *id, uint8_t *key)
+{
+    if (strlen(id) < TOX_PUBLIC_KEY_SIZE * 2) {
+        return -1;
+    }
+
+    return hex_decode(key, id, TOX_PUBLIC_KEY_SIZE);
+}
+
+/* Compares modification times to the nanosecond, so edits within a second are noticed */
+static bool same_mtime(const struct timespec *a, const struct timespec *b)
+{
+    return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+static void key_set_stat(struct Key_Set *set)
+{
+    struct stat st;
+
+    if (stat(set->path, &st) == 0) {
+        set->mtime = st.st_mtim;
+        set->size = st.st_size;
+    }
+}
+
+static int key_set_load(struct Key_Set *set)
+{
+    struct stat st;
+
+    if (stat(set->path, &st) != 0) {
+        FILE *fp = fopen(set->path, "w");
+
+        if (fp == NULL) {
+            fprintf(stderr, "Warning: failed to create '%s' file\n", set->path);
+            return -1;
+        }
+
+        fprintf(stderr, "Warning: creating new '%s' file. Did you lose the old one?\n", set->path);
+        fclose(fp);
+        key_set_clear(set);
+        key_set_stat(set);
+        return 0;
+    }
+
+    FILE *fp = fopen(set->path, "r");
+
+    if (fp == NULL) {
+        fprintf(stderr, "Warning: failed to read '%s' file\n", set->path);
+        return -1;
+    }
+
+    key_set_clear(set);
+
+    char id[256];
+    uint8_t key[TOX_PUBLIC_KEY_SIZE];
+
+    while (fgets(id, sizeof(id), fp)) {
+        if (parse_public_key(id, key) != 0) {
+            continue;
+        }
+
+        if (key_set_add(set, key) == -1) {
+            fclose(fp);
+            return -1;
+        }
+    }
+
+    fclose(fp);
+
+    set->mtime = st.st_mtim;
+    set->size = st.st_size;
+
+    log_timestamp("Loaded %zu keys from '%s'", set->count, set->path);
+    return 0;
+}
+
+static bool blocked_contains(const uint8_t *key)
+{
+    if (blocklist_is_open(&blocked_bin)) {
+        return blocklist_contains(&blocked_bin, key);
+    }
+
+    return key_set_contains(&blocked, key);
+}
+
+/* Maps the compiled blocklist if it is up to date, otherwise loads the text file. */
+static int blocked_load(void)
+{
+    struct stat text_st;
+    struct stat bin_st;
+    bool have_text = stat(BLOCKLIST_FILE, &text_st) == 0;
+
+    blocklist_close(&blocked_bin);
+    blocked_bin_mtime = (struct timespec) {
+        0
+    };
+    blocked_bin_size = 0;
+
+    if (stat(BLOCKLIST_BIN_FILE, &bin_st) == 0) {
+        blocked_bin_mtime = bin_st.st_mtim;
+        blocked_bin_size = bin_st.st_size;
+
+        if (blocklist_open(&blocked_bin, BLOCKLIST_BIN_FILE) != 0) {
+            fprintf(stderr, "Warning: failed to map '%s'\n", BLOCKLIST_BIN_FILE);
+        } else if (have_text && !blocklist_is_current(&blocked_bin, &text_st)) {
+            fprintf(stderr, "Warning: '%s' has changed since '%s' was compiled; run toxbot --compile-blocklist\n",
+                    BLOCKLIST_FILE, BLOCKLIST_BIN_FILE);
+            blocklist_close(&blocked_bin);
+        } else {
+            key_set_clear(&blocked);
+            key_set_stat(&blocked);
+            log_timestamp("Mapped %"PRIu64" keys from '%s'", blocked_bin.num_keys, BLOCKLIST_BIN_FILE);
+            return 0;
+        }
+    }
+
+    return key_set_load(&blocked);
+}
+
+static bool blocked_reload_if_changed(void)
+{
+    struct stat st;
+    struct timespec bin_mtime = { 0 };
+    off_t bin_size = 0;
+
+    if (stat(BLOCKLIST_BIN_FILE, &st) == 0) {
+        bin_mtime = st.st_mtim;
+        bin_size = st.st_size;
+    }
+
+    if (!same_mtime(&bin_mtime, &blocked_bin_mtime) || bin_size != blocked_bin_size) {
+        return blocked_load() == 0;
+    }
+
+    if (stat(BLOCKLIST_FILE, &st) != 0) {
+        return false;
+    }
+
+    if (same_mtime(&st.st_mtim, &blocked.mtime) && st.st_size == blocked.size) {
+        return false;
+    }
+
+    return blocked_load() == 0;
+}
+
+/* Recomputes the cached master and blocked bits if a key list changed since they were. */
+static void friends_refresh(struct Acl_Friends *friends)
+{
+    unsigned int generation = atomic_load(&lists_generation);
+
+    if (friends->generation == generation) {
+        return;
+    }
+
+    pthread_rwlock_rdlock(&lists_lock);
+
+    for (uint32_t i = 0; i < friends->len; ++i) {
+        struct Friend_Auth *f = &friends->list[i];
+
+        if (!f->active) {
+            continue;
+        }
+
+        f->master = key_set_contains(&masters, f->public_key);
+        f->blocked = blocked_contains(f->public_key);
+    }
+
+    pthread_rwlock_unlock(&lists_lock);
+
+    friends->generation = generation;
+}
+
+static bool key_set_reload_if_changed(struct Key_Set *set)
+{
+    struct stat st;
+
+    if (stat(set->path, &st) != 0) {
+        return false;
+    }
+
+    if (same_mtime(&st.st_mtim, &set->mtime) && st.st_size == set->size) {
+        return false;
+    }
+
+    return key_set_load(set) == 0;
+}
+
+int acl_init(void)
+{
+    int ret = 0;
+
+    if (key_set_load(&masters) != 0) {
+        ret = -1;
+    }
+
+    if (blocked_load() != 0) {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+void acl_free(void)
+{
+    key_set_clear(&masters);
+    key_set_clear(&blocked);
+    blocklist_close(&blocked_bin);
+}
+
+void acl_reload_if_changed(void)
+{
+    pthread_rwlock_wrlock(&lists_lock);
+
+    bool changed = key_set_reload_if_changed(&masters);
+    changed |= blocked_reload_if_changed();
+
+    if (changed) {
+        atomic_fetch_add(&lists_generation, 1);
+    }
+
+    pthread_rwlock_unlock(&lists_lock);
+}
+
+bool acl_is_master(const uint8_t *public_key)
+{
+    pthread_rwlock_rdlock(&lists_lock);
+    bool ret = key_set_contains(&masters, public_key);
+    pthread_rwlock_unlock(&lists_lock);
+
+    return ret;
+}
+
+bool acl_is_blocked(const uint8_t *public_key)
+{
+    pthread_rwlock_rdlock(&lists_lock);
+    bool ret = blocked_contains(public_key);
+    pthread_rwlock_unlock(&lists_lock);
+
+    return ret;
+}
+
+int acl_compile_blocklist(void)
+{
+    /* taken before reading, so that an edit made while we read leaves the result stale */
+    struct stat st;
+    bool have_text = stat(BLOCKLIST_FILE, &st) == 0;
+
+    if (key_set_load(&blocked) != 0 || (!have_text && stat(BLOCKLIST_FILE, &st) != 0)) {
+        return -1;
+    }
+
+    uint8_t (*keys)[TOX_PUBLIC_KEY_SIZE] = malloc(MAX(blocked.count, 1) * TOX_PUBLIC_KEY_SIZE);
+
+    if (keys == NULL) {
+        return -1;
+    }
+
+    size_t n = 0;
+
+    for (size_t i = 0; i < blocked.capacity; ++i) {
+        if (blocked.used[i]) {
+            memcpy(keys[n++], blocked.keys[i], TOX_PUBLIC_KEY_SIZE);
+        }
+    }
+
+    int ret = blocklist_write(BLOCKLIST_BIN_FILE, keys, n, &st);
+    free(keys);
+
+    if (ret == 0) {
+        printf("Compiled %zu keys from '%s' into '%s'\n", n, BLOCKLIST_FILE, BLOCKLIST_BIN_FILE);
+    }
+
+    return ret;
+}
+
+int acl_add_master(const char *id)
+{
+    uint8_t key[TOX_PUBLIC_KEY_SIZE];
+
+    if (parse_public_key(id, key) != 0) {
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&lists_lock);
+
+    FILE *fp = fopen(masters.path, "a");
+
+    if (fp == NULL) {
+        pthread_rwlock_unlock(&lists_lock);
+        return -2;
+    }
+
+    fprintf(fp, "%s\n", id);
+    fclose(fp);
+
+    int ret = key_set_add(&masters, key) == -1 ? -2 : 0;
+
+    /* we already know what changed, so don't let the next reload check re-read the file */
+    key_set_stat(&masters);
+    atomic_fetch_add(&lists_generation, 1);
+
+    pthread_rwlock_unlock(&lists_lock);
+
+    return ret;
+}
+
+int acl_friend_add(struct Acl_Friends *friends, Tox *m, uint32_t friendnumber)
+{
+    if (friendnumber == UINT32_MAX) {
+        return -1;
+    }
+
+    /* bring the other entries up to date first, as this one is about to be */
+    friends_refresh(friends);
+
+    if (friendnumber >= friends->len) {
+        uint32_t len = MAX(friendnumber + 1, friends->len * 2);
+        struct Friend_Auth *f = realloc(friends->list, len * sizeof(struct Friend_Auth));
+
+        if (f == NULL) {
+            return -1;
+        }
+
+        memset(&f[friends->len], 0, (len - friends->len) * sizeof(struct Friend_Auth));
+        friends->list = f;
+        friends->len = len;
+    }
+
+    struct Friend_Auth *f = &friends->list[friendnumber];
+
+    if (!tox_friend_get_public_key(m, friendnumber, f->public_key, NULL)) {
+        memset(f, 0, sizeof(struct Friend_Auth));
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(&lists_lock);
+
+    f->active = true;
+    f->master = key_set_contains(&masters, f->public_key);
+    f->blocked = blocked_contains(f->public_key);
+
+    pthread_rwlock_unlock(&lists_lock);
+
+    return 0;
+}
+
+void acl_friend_remove(struct Acl_Friends *friends, uint32_t friendnumber)
+{
+    if (friendnumber < friends->len) {
+        memset(&friends->list[friendnumber], 0, sizeof(struct Friend_Auth));
+    }
+}
+
+void acl_friends_free(struct Acl_Friends *friends)
+{
+    free(friends->list);
+    *friends = (struct Acl_Friends) {
+        0
+    };
+}
+
+void acl_friends_load(struct Acl_Friends *friends, Tox *m)
+{
+    size_t size = tox_self_get_friend_list_size(m);
+
+    if (size == 0) {
+        return;
+    }
+
+    uint32_t *list = malloc(size * sizeof(uint32_t));
+
+    if (list == NULL) {
+        fprintf(stderr, "malloc() failed in acl_friends_load()\n");
+        return;
+    }
+
+    tox_self_get_friend_list(m, list);
+
+    for (size_t i = 0; i < size; ++i) {
+        acl_friend_add(friends, m, list[i]);
+    }
+
+    free(list);
+}
+
+bool acl_friend_is_cached(const struct Acl_Friends *friends, uint32_t friendnumber)
+{
+    return friendnumber < friends->len && friends->list[friendnumber].active;
+}
+
+bool acl_friend_is_master(struct Acl_Friends *friends, uint32_t friendnumber)
+{
+    friends_refresh(friends);
+    return friendnumber < friends->len && friends->list[friendnumber].master;
+}
+
+bool acl_friend_is_blocked(struct Acl_Friends *friends, uint32_t friendnumber)
+{
+    friends_refresh(friends);
+    return friendnumber < friends->len && friends->list[friendnumber].blocked;
+}
@@ -0,0 +1,119 @@
+/*  acl.h
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef ACL_H
+#define ACL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <tox/tox.h>
+
+/* How often we check the masterkeys and blockedkeys files for changes */
+#define ACL_RELOAD_INTERVAL 5
+
+/*
+ * The key lists are loaded once and shared by every profile; they may be checked from
+ * any thread. Friend numbers belong to one Tox instance, so each profile keeps its own
+ * friend cache, which catches up with a reloaded key list the next time it is checked.
+ */
+struct Acl_Friends {
+    struct Friend_Auth  *list;    // indexed by friend number
+    uint32_t            len;
+    unsigned int        generation;
+};
+
+/*
+ * Loads the masterkeys and blockedkeys files into memory.
+ *
+ * Returns 0 on success.
+ * Returns -1 if either list could not be loaded.
+ */
+int acl_init(void);
+
+/* Frees all memory used by the in-memory key lists. */
+void acl_free(void);
+
+/* Reloads any list whose file has been modified since it was last loaded. */
+void acl_reload_if_changed(void);
+
+/*
+ * Returns true if public_key is in the masterkeys list.
+ *
+ * public_key must be a binary representation of a Tox public key.
+ */
+bool acl_is_master(const uint8_t *public_key);
+
+/*
+ * Returns true if public_key is in the blockedkeys list.
+ *
+ * public_key must be a binary representation of a Tox public key.
+ */
+bool acl_is_blocked(const uint8_t *public_key);
+
+/*
+ * Compiles the blockedkeys file into the binary blockedkeys.bin format, which is
+ * memory mapped on startup instead of parsing the text file.
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */
+int acl_compile_blocklist(void);
+
+/*
+ * Appends the hex encoded Tox ID or public key `id` to the masterkeys file and
+ * adds it to the in-memory list without reloading the file.
+ *
+ * Returns 0 on success.
+ * Returns -1 if `id` is not a valid hex encoded key.
+ * Returns -2 if the masterkeys file could not be written.
+ */
+int acl_add_master(const char *id);
+
+/*
+ * Caches friendnumber's public key along with its master and blocked status in m's
+ * friend cache. Must be called whenever a friend is added or loaded.
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */
+int acl_friend_add(struct Acl_Friends *friends, Tox *m, uint32_t friendnumber);
+
+/* Clears the cached entry for friendnumber. Must be called whenever a friend is deleted. */
+void acl_friend_remove(struct Acl_Friends *friends, uint32_t friendnumber);
+
+/* Caches every friend in m's friend list. */
+void acl_friends_load(struct Acl_Friends *friends, Tox *m);
+
+/* Frees a friend cache. */
+void acl_friends_free(struct Acl_Friends *friends);
+
+/* Returns true if friendnumber has a cached entry. */
+bool acl_friend_is_cached(const struct Acl_Friends *friends, uint32_t friendnumber);
+
+/* Returns true if friendnumber's cached public key is in the masterkeys list. */
+bool acl_friend_is_master(struct Acl_Friends *friends, uint32_t friendnumber);
+
+/* Returns true if friendnumber's cached public key is in the blockedkeys list. */
+bool acl_friend_is_blocked(struct Acl_Friends *friends, uint32_t friendnumber);
+
+#endif /* ACL_H */
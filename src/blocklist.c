@@ -0,0 +1,255 @@
+/*  blocklist.c
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L    /* st_mtim */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "blocklist.h"
+
+#define BLOCKLIST_MAGIC "TBBLKv2"
+#define BLOCKLIST_BYTE_ORDER_MARK 0x01020304
+#define BLOCKLIST_HEADER_SIZE 64
+
+/* Bloom filter sizing: 16 bits per key and 7 hashes give roughly a 0.1% false positive rate */
+#define BLOOM_BITS_PER_KEY 16
+#define BLOOM_HASHES 7
+
+/* Each hash needs 9 bits to address a bit inside a 512 bit block */
+#define BLOOM_BLOCK_BITS (BLOCKLIST_BLOOM_BLOCK_SIZE * 8)
+#define BLOOM_HASH_BITS 9
+
+struct Blocklist_Header {
+    char      magic[8];
+    uint32_t  byte_order;
+    uint32_t  bloom_hashes;
+    uint64_t  num_keys;
+    uint64_t  bloom_blocks;
+    uint64_t  source_size;
+    int64_t   source_mtime_sec;
+    int64_t   source_mtime_nsec;
+    uint8_t   reserved[BLOCKLIST_HEADER_SIZE - 56];
+};
+
+static uint64_t mix64(const uint8_t *p)
+{
+    uint64_t h;
+    memcpy(&h, p, sizeof(h));
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/* Returns the block for key and fills bits with the bit positions inside that block. */
+static uint64_t bloom_hash(const uint8_t *key, uint64_t mask, uint32_t num_hashes, uint16_t *bits)
+{
+    uint64_t h = mix64(key + 8);
+
+    for (uint32_t i = 0; i < num_hashes; ++i) {
+        bits[i] = (h >> (i * BLOOM_HASH_BITS)) & (BLOOM_BLOCK_BITS - 1);
+    }
+
+    return mix64(key) & mask;
+}
+
+static int key_cmp(const void *a, const void *b)
+{
+    return memcmp(a, b, TOX_PUBLIC_KEY_SIZE);
+}
+
+int blocklist_open(struct Blocklist *bl, const char *path)
+{
+    memset(bl, 0, sizeof(struct Blocklist));
+
+    int fd = open(path, O_RDONLY);
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    struct stat st;
+
+    if (fstat(fd, &st) != 0 || st.st_size < BLOCKLIST_HEADER_SIZE) {
+        close(fd);
+        return -2;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    struct Blocklist_Header hdr;
+    memcpy(&hdr, map, sizeof(hdr));
+
+    uint64_t bloom_size = hdr.bloom_blocks * BLOCKLIST_BLOOM_BLOCK_SIZE;
+    uint64_t keys_size = hdr.num_keys * TOX_PUBLIC_KEY_SIZE;
+
+    if (memcmp(hdr.magic, BLOCKLIST_MAGIC, sizeof(hdr.magic)) != 0
+            || hdr.byte_order != BLOCKLIST_BYTE_ORDER_MARK
+            || hdr.bloom_hashes == 0 || hdr.bloom_hashes > BLOOM_HASHES
+            || hdr.bloom_blocks == 0 || (hdr.bloom_blocks & (hdr.bloom_blocks - 1)) != 0
+            || BLOCKLIST_HEADER_SIZE + bloom_size + keys_size != (uint64_t) st.st_size) {
+        munmap(map, st.st_size);
+        return -2;
+    }
+
+    bl->map = map;
+    bl->map_size = st.st_size;
+    bl->bloom = bl->map + BLOCKLIST_HEADER_SIZE;
+    bl->keys = bl->bloom + bloom_size;
+    bl->num_keys = hdr.num_keys;
+    bl->bloom_mask = hdr.bloom_blocks - 1;
+    bl->bloom_hashes = hdr.bloom_hashes;
+    bl->mtime = st.st_mtime;
+    bl->size = st.st_size;
+    bl->source_size = hdr.source_size;
+    bl->source_mtime.tv_sec = hdr.source_mtime_sec;
+    bl->source_mtime.tv_nsec = hdr.source_mtime_nsec;
+
+    return 0;
+}
+
+void blocklist_close(struct Blocklist *bl)
+{
+    if (bl->map != NULL) {
+        munmap(bl->map, bl->map_size);
+    }
+
+    memset(bl, 0, sizeof(struct Blocklist));
+}
+
+bool blocklist_is_open(const struct Blocklist *bl)
+{
+    return bl->map != NULL;
+}
+
+bool blocklist_is_current(const struct Blocklist *bl, const struct stat *source)
+{
+    return bl->source_size == (uint64_t) source->st_size
+           && bl->source_mtime.tv_sec == source->st_mtim.tv_sec
+           && bl->source_mtime.tv_nsec == source->st_mtim.tv_nsec;
+}
+
+bool blocklist_contains(const struct Blocklist *bl, const uint8_t *public_key)
+{
+    if (bl->num_keys == 0) {
+        return false;
+    }
+
+    uint16_t bits[BLOOM_HASHES];
+    uint64_t block = bloom_hash(public_key, bl->bloom_mask, bl->bloom_hashes, bits);
+    const uint8_t *b = bl->bloom + block * BLOCKLIST_BLOOM_BLOCK_SIZE;
+
+    for (uint32_t i = 0; i < bl->bloom_hashes; ++i) {
+        if (!(b[bits[i] / 8] & (1 << (bits[i] % 8)))) {
+            return false;
+        }
+    }
+
+    return bsearch(public_key, bl->keys, bl->num_keys, TOX_PUBLIC_KEY_SIZE, key_cmp) != NULL;
+}
+
+int blocklist_write(const char *path, uint8_t (*keys)[TOX_PUBLIC_KEY_SIZE], size_t num_keys,
+                    const struct stat *source)
+{
+    qsort(keys, num_keys, TOX_PUBLIC_KEY_SIZE, key_cmp);
+
+    /* drop duplicates so the key count in the header matches what bsearch sees */
+    size_t n = 0;
+
+    for (size_t i = 0; i < num_keys; ++i) {
+        if (n == 0 || memcmp(keys[n - 1], keys[i], TOX_PUBLIC_KEY_SIZE) != 0) {
+            memmove(keys[n++], keys[i], TOX_PUBLIC_KEY_SIZE);
+        }
+    }
+
+    uint64_t bloom_blocks = 1;
+
+    while (bloom_blocks * BLOOM_BLOCK_BITS < n * BLOOM_BITS_PER_KEY) {
+        bloom_blocks *= 2;
+    }
+
+    uint8_t *bloom = calloc(bloom_blocks, BLOCKLIST_BLOOM_BLOCK_SIZE);
+
+    if (bloom == NULL) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        uint16_t bits[BLOOM_HASHES];
+        uint64_t block = bloom_hash(keys[i], bloom_blocks - 1, BLOOM_HASHES, bits);
+        uint8_t *b = bloom + block * BLOCKLIST_BLOOM_BLOCK_SIZE;
+
+        for (size_t j = 0; j < BLOOM_HASHES; ++j) {
+            b[bits[j] / 8] |= 1 << (bits[j] % 8);
+        }
+    }
+
+    struct Blocklist_Header hdr = {
+        BLOCKLIST_MAGIC,
+        BLOCKLIST_BYTE_ORDER_MARK,
+        BLOOM_HASHES,
+        n,
+        bloom_blocks,
+        source->st_size,
+        source->st_mtim.tv_sec,
+        source->st_mtim.tv_nsec,
+    };
+
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    FILE *fp = fopen(tmp_path, "wb");
+
+    if (fp == NULL) {
+        free(bloom);
+        return -1;
+    }
+
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1
+              && fwrite(bloom, BLOCKLIST_BLOOM_BLOCK_SIZE, bloom_blocks, fp) == bloom_blocks
+              && (n == 0 || fwrite(keys, TOX_PUBLIC_KEY_SIZE, n, fp) == n)
+              && fflush(fp) == 0
+              && fsync(fileno(fp)) == 0;
+
+    free(bloom);
+
+    if (fclose(fp) != 0 || !ok || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,100 @@
+/*  blocklist.h
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef BLOCKLIST_H
+#define BLOCKLIST_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include <tox/tox.h>
+
+/*
+ * Compiled blocklist file layout (native byte order):
+ *
+ *   header   64 bytes: magic "TBBLKv2", byte order mark, key count,
+ *            Bloom filter block count, hashes per key, and the size and
+ *            modification time (seconds and nanoseconds) of the text file the
+ *            keys were compiled from
+ *   bloom    bloom_blocks * 64 bytes; each key sets all of its bits inside a single
+ *            64-byte block, so a lookup that misses touches one cache line
+ *   keys     key count * TOX_PUBLIC_KEY_SIZE bytes, sorted with memcmp()
+ */
+#define BLOCKLIST_BLOOM_BLOCK_SIZE 64
+
+struct Blocklist {
+    uint8_t        *map;
+    size_t         map_size;
+    const uint8_t  *bloom;
+    const uint8_t  *keys;
+    uint64_t       num_keys;
+    uint64_t       bloom_mask;  // number of Bloom filter blocks minus one
+    uint32_t       bloom_hashes;
+    time_t         mtime;       // modification time of the file when it was mapped
+    off_t          size;        // size of the file when it was mapped
+    uint64_t       source_size;     // of the text file it was compiled from
+    struct timespec source_mtime;
+};
+
+/*
+ * Maps the compiled blocklist at path read-only.
+ *
+ * Returns 0 on success.
+ * Returns -1 if the file cannot be opened or mapped.
+ * Returns -2 if the file is not a valid compiled blocklist.
+ */
+int blocklist_open(struct Blocklist *bl, const char *path);
+
+/* Unmaps bl. It is safe to call this on a blocklist that was never opened. */
+void blocklist_close(struct Blocklist *bl);
+
+/* Returns true if bl is mapped. */
+bool blocklist_is_open(const struct Blocklist *bl);
+
+/*
+ * Returns true if bl was compiled from the text file that source describes as it is now,
+ * judged by its size and its modification time to the nanosecond.
+ */
+bool blocklist_is_current(const struct Blocklist *bl, const struct stat *source);
+
+/*
+ * Returns true if public_key is in bl.
+ *
+ * public_key must be a binary representation of a Tox public key.
+ */
+bool blocklist_contains(const struct Blocklist *bl, const uint8_t *public_key);
+
+/*
+ * Writes num_keys public keys to path as a compiled blocklist. keys is sorted in place.
+ * source is the text file the keys were read from, as it was before reading them. The
+ * file is written to a temporary path and renamed over path once complete.
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */
+int blocklist_write(const char *path, uint8_t (*keys)[TOX_PUBLIC_KEY_SIZE], size_t num_keys,
+                    const struct stat *source);
+
+#endif /* BLOCKLIST_H */
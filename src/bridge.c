@@ -0,0 +1,592 @@
+/*  bridge.c
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE                /* pipe2() */
+#define _POSIX_C_SOURCE 200809L    /* clock_gettime() */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <tox/tox.h>
+
+#include "bridge.h"
+#include "bridge_socket.h"
+#include "spool.h"
+#include "toxbot.h"
+#include "log.h"
+
+/* Largest record we can build: three length prefixes plus name, title and message */
+#define BRIDGE_RECORD_SIZE (3 * 12 + TOX_MAX_NAME_LENGTH * 2 + TOX_MAX_MESSAGE_LENGTH)
+
+static struct Bridge_Worker {
+    pid_t pid;
+    int   fd;    // write end of the worker's stdin
+    bool  enabled;
+} worker = { -1, -1, false };
+
+struct Bridge_Record {
+    size_t    len;
+    uint64_t  seq;    // spool sequence number, or zero if not spooled
+    char      data[BRIDGE_RECORD_SIZE];
+};
+
+/* Ring buffer of encoded records waiting for the delivery thread */
+static struct Bridge_Queue {
+    struct Bridge_Record  *records;
+    size_t                capacity;
+    size_t                head;      // index of the oldest record
+    size_t                count;
+    Bridge_Overflow       overflow;
+    bool                  stopping;
+
+    uint64_t              enqueued;
+    uint64_t              delivered;
+    uint64_t              dropped;
+
+    pthread_mutex_t       lock;
+    pthread_cond_t        not_empty;
+    pthread_cond_t        not_full;
+    pthread_cond_t        sink_ready;
+    pthread_t             thread;
+    bool                  running;
+    bool                  stalled;    // a batch is waiting for a worker or client to take it
+    bool                  retry;      // set by bridge_sink_ready() to cut the backoff short
+
+    struct Spool          spool;
+    bool                  spooled;
+} queue = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .not_empty = PTHREAD_COND_INITIALIZER,
+    .not_full = PTHREAD_COND_INITIALIZER,
+    .sink_ready = PTHREAD_COND_INITIALIZER,
+};
+
+static void worker_reap(void)
+{
+    if (worker.fd != -1) {
+        close(worker.fd);
+        worker.fd = -1;
+    }
+
+    if (worker.pid > 0) {
+        waitpid(worker.pid, NULL, 0);
+        worker.pid = -1;
+    }
+}
+
+static int worker_start(void)
+{
+    int fds[2];
+
+    /* close-on-exec from the start: the sources thread forks too, and must not inherit our end */
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        log_error_timestamp(errno, "Bridge worker pipe() failed");
+        return -1;
+    }
+
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        log_error_timestamp(errno, "Bridge worker fork() failed");
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        dup2(fds[0], STDIN_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execl("/bin/sh", "sh", "-c", SM_WORKER_PATH, (char *) NULL);
+        _exit(127);
+    }
+
+    close(fds[0]);
+
+    worker.pid = pid;
+    worker.fd = fds[1];
+
+    log_timestamp("Bridge worker started (pid %d)", (int) pid);
+    return 0;
+}
+
+/* Returns true if the worker is still running; reaps it otherwise. */
+static bool worker_alive(void)
+{
+    if (worker.pid <= 0) {
+        return false;
+    }
+
+    int status;
+    pid_t ret = waitpid(worker.pid, &status, WNOHANG);
+
+    if (ret == 0) {
+        return true;
+    }
+
+    log_timestamp("Bridge worker exited (status %d)", ret == worker.pid ? status : -1);
+    worker.pid = -1;
+    worker_reap();
+    return false;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return -1;
+        }
+
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/* Writes one record to the worker, restarting it if it has died. Only called by the delivery thread. */
+static int worker_deliver(const char *record, size_t len)
+{
+    /* one retry so a worker that died since the last message is restarted transparently */
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        if (!worker_alive() && worker_start() != 0) {
+            return -1;
+        }
+
+        if (write_all(worker.fd, record, len) == 0) {
+            return 0;
+        }
+
+        log_error_timestamp(errno, "Bridge worker write failed");
+        worker_reap();
+    }
+
+    return -1;
+}
+
+/* Batch buffer: room for the "<count>\n" header followed by up to BRIDGE_BATCH_MAX_BYTES of records */
+#define BATCH_HEADER_ROOM 16
+
+_Static_assert(BRIDGE_BATCH_MAX_BYTES >= BRIDGE_RECORD_SIZE, "a batch must hold at least one record");
+
+struct Bridge_Batch {
+    char      buf[BATCH_HEADER_ROOM + BRIDGE_BATCH_MAX_BYTES];
+    size_t    len;      // bytes of records after the header room
+    size_t    count;
+    uint64_t  last_seq;
+};
+
+/*
+ * Moves records from the front of the queue into batch until the queue is empty or
+ * the batch is full. Must be called with the queue locked.
+ *
+ * Returns true if the batch is full.
+ */
+static bool batch_fill(struct Bridge_Batch *batch)
+{
+    while (queue.count > 0) {
+        if (batch->count == BRIDGE_BATCH_MAX_RECORDS) {
+            return true;
+        }
+
+        struct Bridge_Record *head = &queue.records[queue.head];
+
+        if (batch->len + head->len > BRIDGE_BATCH_MAX_BYTES) {
+            return true;
+        }
+
+        memcpy(batch->buf + BATCH_HEADER_ROOM + batch->len, head->data, head->len);
+        batch->len += head->len;
+        ++batch->count;
+
+        if (head->seq != 0) {
+            batch->last_seq = head->seq;
+        }
+
+        queue.head = (queue.head + 1) % queue.capacity;
+        --queue.count;
+        pthread_cond_signal(&queue.not_full);
+    }
+
+    return batch->count == BRIDGE_BATCH_MAX_RECORDS;
+}
+
+/*
+ * Prepends the record count to batch and hands it to the worker and to every bridge
+ * socket client, each as a single write.
+ *
+ * Returns 0 if at least one of them took the batch.
+ */
+static int batch_flush(struct Bridge_Batch *batch)
+{
+    char header[BATCH_HEADER_ROOM];
+    int header_len = snprintf(header, sizeof(header), "%zu\n", batch->count);
+    char *start = batch->buf + BATCH_HEADER_ROOM - header_len;
+
+    memcpy(start, header, header_len);
+
+    int ret = -1;
+
+    if (worker.enabled && worker_deliver(start, header_len + batch->len) == 0) {
+        ret = 0;
+    }
+
+    if (bridge_socket_broadcast(start, header_len + batch->len) > 0) {
+        ret = 0;
+    }
+
+    return ret;
+}
+
+static void deadline_after(struct timespec *ts, long ms)
+{
+    clock_gettime(CLOCK_REALTIME, ts);
+
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000L;
+
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec += ts->tv_nsec / 1000000000L;
+        ts->tv_nsec %= 1000000000L;
+    }
+}
+
+static void *delivery_thread(void *arg)
+{
+    (void) arg;
+
+    struct Bridge_Batch *batch = malloc(sizeof(struct Bridge_Batch));
+
+    if (batch == NULL) {
+        log_error_timestamp(-1, "Bridge delivery thread failed to allocate batch buffer");
+        return NULL;
+    }
+
+    pthread_mutex_lock(&queue.lock);
+
+    while (true) {
+        while (queue.count == 0 && !queue.stopping) {
+            pthread_cond_wait(&queue.not_empty, &queue.lock);
+        }
+
+        if (queue.count == 0) {
+            break;
+        }
+
+        batch->len = 0;
+        batch->count = 0;
+        batch->last_seq = 0;
+
+        /* the first record starts the clock; keep collecting until the batch fills or the delay expires */
+        struct timespec deadline;
+        deadline_after(&deadline, BRIDGE_BATCH_DELAY_MS);
+
+        while (!batch_fill(batch) && !queue.stopping) {
+            if (pthread_cond_timedwait(&queue.not_empty, &queue.lock, &deadline) == ETIMEDOUT) {
+                batch_fill(batch);
+                break;
+            }
+        }
+
+        pthread_mutex_unlock(&queue.lock);
+
+        /* group commit: one sync makes the whole batch durable before anyone sees it */
+        if (queue.spooled) {
+            spool_sync(&queue.spool);
+        }
+
+        int ret = batch_flush(batch);
+        long backoff = BRIDGE_RETRY_MIN_MS;
+
+        /* nobody took the batch: hold on to it, uncommitted, until a worker or client does */
+        while (ret != 0) {
+            pthread_mutex_lock(&queue.lock);
+
+            if (!queue.stalled && !queue.stopping) {
+                log_timestamp("No bridge worker or client took %zu messages, retrying", batch->count);
+            }
+
+            queue.stalled = true;
+            pthread_cond_broadcast(&queue.not_full);
+
+            struct timespec retry_at;
+            deadline_after(&retry_at, backoff);
+
+            while (!queue.retry && !queue.stopping) {
+                if (pthread_cond_timedwait(&queue.sink_ready, &queue.lock, &retry_at) == ETIMEDOUT) {
+                    break;
+                }
+            }
+
+            queue.retry = false;
+            bool stopping = queue.stopping;
+            pthread_mutex_unlock(&queue.lock);
+
+            if (stopping) {
+                break;
+            }
+
+            backoff = backoff * 2 > BRIDGE_RETRY_MAX_MS ? BRIDGE_RETRY_MAX_MS : backoff * 2;
+            ret = batch_flush(batch);
+        }
+
+        /* a batch left undelivered at shutdown stays in the spool and is replayed on the next start */
+        if (ret == 0 && batch->last_seq != 0) {
+            spool_commit(&queue.spool, batch->last_seq);
+        }
+
+        pthread_mutex_lock(&queue.lock);
+
+        if (ret == 0 && queue.stalled) {
+            log_timestamp("Bridge delivery resumed");
+            queue.stalled = false;
+        }
+
+        if (ret == 0) {
+            queue.delivered += batch->count;
+        } else {
+            queue.dropped += batch->count;
+        }
+    }
+
+    pthread_mutex_unlock(&queue.lock);
+    free(batch);
+    return NULL;
+}
+
+/* Adds a record at the back of the queue, which must not be full. Call with the queue locked. */
+static void queue_push(const char *record, size_t len, uint64_t seq)
+{
+    struct Bridge_Record *rec = &queue.records[(queue.head + queue.count) % queue.capacity];
+    rec->len = len;
+    rec->seq = seq;
+    memcpy(rec->data, record, len);
+
+    ++queue.count;
+    ++queue.enqueued;
+}
+
+static void replay_record(void *userdata, uint64_t seq, const uint8_t *data, size_t length)
+{
+    (void) userdata;
+
+    if (length > BRIDGE_RECORD_SIZE) {
+        return;
+    }
+
+    if (queue.count == queue.capacity) {
+        queue.head = (queue.head + 1) % queue.capacity;
+        --queue.count;
+        ++queue.dropped;
+    }
+
+    queue_push((const char *) data, length, seq);
+}
+
+int bridge_init(size_t queue_size, Bridge_Overflow overflow, bool use_worker, const char *spool_dir)
+{
+    if (queue_size == 0) {
+        queue_size = BRIDGE_DEFAULT_QUEUE_SIZE;
+    }
+
+    queue.records = malloc(queue_size * sizeof(struct Bridge_Record));
+
+    if (queue.records == NULL) {
+        log_error_timestamp(-1, "Failed to allocate bridge queue of %zu records", queue_size);
+        return -1;
+    }
+
+    queue.capacity = queue_size;
+    queue.head = 0;
+    queue.count = 0;
+    queue.overflow = overflow;
+    queue.stopping = false;
+    queue.stalled = false;
+    queue.retry = false;
+    worker.enabled = use_worker;
+
+    if (spool_dir != NULL) {
+        if (spool_open(&queue.spool, spool_dir) == 0) {
+            queue.spooled = true;
+
+            int replayed = spool_replay(&queue.spool, replay_record, NULL);
+
+            if (replayed > 0) {
+                log_timestamp("Replaying %d undelivered outbound bridge messages", replayed);
+            }
+        } else {
+            log_error_timestamp(-1, "Failed to open bridge spool %s, messages will not survive a restart", spool_dir);
+        }
+    }
+
+    if (use_worker && worker_start() != 0) {
+        log_timestamp("Bridge worker will be started on the next delivery");
+    }
+
+    if (pthread_create(&queue.thread, NULL, delivery_thread, NULL) != 0) {
+        log_error_timestamp(-1, "Failed to create bridge delivery thread");
+        worker_reap();
+
+        if (queue.spooled) {
+            spool_close(&queue.spool);
+            queue.spooled = false;
+        }
+
+        free(queue.records);
+        queue.records = NULL;
+        return -1;
+    }
+
+    queue.running = true;
+    return 0;
+}
+
+void bridge_kill(void)
+{
+    if (queue.running) {
+        pthread_mutex_lock(&queue.lock);
+        queue.stopping = true;
+        pthread_cond_broadcast(&queue.not_empty);
+        pthread_cond_broadcast(&queue.not_full);
+        pthread_cond_broadcast(&queue.sink_ready);
+        pthread_mutex_unlock(&queue.lock);
+
+        pthread_join(queue.thread, NULL);
+        queue.running = false;
+    }
+
+    worker_reap();
+
+    if (queue.spooled) {
+        spool_close(&queue.spool);
+        queue.spooled = false;
+    }
+
+    free(queue.records);
+    queue.records = NULL;
+}
+
+int bridge_send(const char *sender, const char *group, const char *text)
+{
+    char record[BRIDGE_RECORD_SIZE];
+    int len = snprintf(record, sizeof(record), "%zu\n%s%zu\n%s%zu\n%s",
+                       strlen(sender), sender, strlen(group), group, strlen(text), text);
+
+    if (len < 0 || len >= sizeof(record)) {
+        log_error_timestamp(-1, "Bridge record too large (%d bytes)", len);
+        return -1;
+    }
+
+    pthread_mutex_lock(&queue.lock);
+
+    if (!queue.running || queue.stopping) {
+        ++queue.dropped;
+        pthread_mutex_unlock(&queue.lock);
+        return -1;
+    }
+
+    if (queue.count == queue.capacity) {
+        switch (queue.overflow) {
+            case BRIDGE_OVERFLOW_BLOCK:
+                /* don't stall the caller while there is nobody to deliver to */
+                while (queue.count == queue.capacity && !queue.stopping && !queue.stalled) {
+                    pthread_cond_wait(&queue.not_full, &queue.lock);
+                }
+
+                if (queue.stopping || queue.count == queue.capacity) {
+                    ++queue.dropped;
+                    pthread_mutex_unlock(&queue.lock);
+                    return -1;
+                }
+
+                break;
+
+            case BRIDGE_OVERFLOW_DROP_OLDEST:
+                queue.head = (queue.head + 1) % queue.capacity;
+                --queue.count;
+                ++queue.dropped;
+                break;
+
+            case BRIDGE_OVERFLOW_DROP_NEWEST:
+                ++queue.dropped;
+                pthread_mutex_unlock(&queue.lock);
+                return -1;
+        }
+    }
+
+    /* appending under the queue lock keeps spool order and delivery order the same */
+    uint64_t seq = queue.spooled ? spool_append(&queue.spool, record, len) : 0;
+
+    queue_push(record, len, seq);
+    pthread_cond_signal(&queue.not_empty);
+    pthread_mutex_unlock(&queue.lock);
+
+    return 0;
+}
+
+void bridge_sink_ready(void)
+{
+    pthread_mutex_lock(&queue.lock);
+    queue.retry = true;
+    pthread_cond_signal(&queue.sink_ready);
+    pthread_mutex_unlock(&queue.lock);
+}
+
+void bridge_get_stats(struct Bridge_Stats *stats)
+{
+    pthread_mutex_lock(&queue.lock);
+    stats->enqueued = queue.enqueued;
+    stats->delivered = queue.delivered;
+    stats->dropped = queue.dropped;
+    stats->queued = queue.count;
+    pthread_mutex_unlock(&queue.lock);
+}
+
+int bridge_overflow_from_string(const char *name, Bridge_Overflow *overflow)
+{
+    if (strcmp(name, "block") == 0) {
+        *overflow = BRIDGE_OVERFLOW_BLOCK;
+    } else if (strcmp(name, "drop-oldest") == 0) {
+        *overflow = BRIDGE_OVERFLOW_DROP_OLDEST;
+    } else if (strcmp(name, "drop-newest") == 0) {
+        *overflow = BRIDGE_OVERFLOW_DROP_NEWEST;
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
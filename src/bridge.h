@@ -0,0 +1,122 @@
+/*  bridge.h
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef BRIDGE_H
+#define BRIDGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Outbound bridge records are written to every client of the bridge socket (see
+ * bridge_socket.h) and, when enabled, to the stdin of a long-lived worker process
+ * (SM_WORKER_PATH). Each record is three fields: sender, group and text. Every
+ * field is its length in bytes as a decimal number followed by a newline, then
+ * exactly that many bytes of data:
+ *
+ *   5\nalice7\nwtfipfs5\nhello
+ *
+ * Records are queued by bridge_send() and delivered by a dedicated thread, so a
+ * slow peer never stalls the Tox event loop. If the worker exits it is restarted
+ * before the next delivery.
+ *
+ * The delivery thread coalesces queued records into batches. A batch is the number
+ * of records it contains followed by a newline, then the records themselves:
+ *
+ *   2\n5\nalice7\nwtfipfs5\nhello3\nbob7\nwtfipfs2\nhi
+ *
+ * A batch is written as soon as it holds BRIDGE_BATCH_MAX_RECORDS records or the next
+ * record would take it past BRIDGE_BATCH_MAX_BYTES, and at most BRIDGE_BATCH_DELAY_MS
+ * after its first record was taken from the queue.
+ *
+ * A batch that neither the worker nor any socket client takes is kept and retried,
+ * after BRIDGE_RETRY_MIN_MS at first and backing off to BRIDGE_RETRY_MAX_MS, or as
+ * soon as a client connects. Records keep queueing behind it in the meantime; while
+ * delivery is stalled like this, a full queue drops new records even under
+ * BRIDGE_OVERFLOW_BLOCK rather than blocking the caller indefinitely.
+ */
+
+#define BRIDGE_DEFAULT_QUEUE_SIZE 1024
+
+#define BRIDGE_BATCH_MAX_RECORDS 64
+#define BRIDGE_BATCH_MAX_BYTES   (64 * 1024)
+#define BRIDGE_BATCH_DELAY_MS    20
+
+#define BRIDGE_RETRY_MIN_MS 1000
+#define BRIDGE_RETRY_MAX_MS (60 * 1000)
+
+/* What bridge_send() does when the queue is full */
+typedef enum Bridge_Overflow {
+    BRIDGE_OVERFLOW_BLOCK,          // wait for the delivery thread to make room
+    BRIDGE_OVERFLOW_DROP_OLDEST,    // discard the oldest queued record
+    BRIDGE_OVERFLOW_DROP_NEWEST,    // discard the record being sent
+} Bridge_Overflow;
+
+struct Bridge_Stats {
+    uint64_t enqueued;
+    uint64_t delivered;    // records taken by the worker or at least one socket client
+    uint64_t dropped;
+    size_t   queued;    // records currently waiting for delivery
+};
+
+/*
+ * Starts the delivery thread, and the bridge worker if use_worker is true. queue_size
+ * is the maximum number of undelivered records.
+ *
+ * If spool_dir is not NULL, queued records are also appended to the spool there (see
+ * spool.h), and records that were still queued when toxbot last stopped are queued
+ * again. Each batch is synced to the spool before it is delivered and committed once
+ * the worker or a client has taken it, so records replayed at startup wait for one to
+ * appear.
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */
+int bridge_init(size_t queue_size, Bridge_Overflow overflow, bool use_worker, const char *spool_dir);
+
+/* Delivers any queued records, stops the delivery thread and waits for the worker to exit. */
+void bridge_kill(void);
+
+/*
+ * Queues a message record for delivery to the bridge worker.
+ *
+ * Returns 0 on success.
+ * Returns -1 if the record was dropped.
+ */
+int bridge_send(const char *sender, const char *group, const char *text);
+
+/* Tells the delivery thread a new client can take batches, so a stalled batch is retried now. */
+void bridge_sink_ready(void);
+
+/* Copies the bridge queue counters to stats. */
+void bridge_get_stats(struct Bridge_Stats *stats);
+
+/*
+ * Parses an overflow policy name: "block", "drop-oldest" or "drop-newest".
+ *
+ * Returns 0 on success.
+ * Returns -1 if name is not a valid policy.
+ */
+int bridge_overflow_from_string(const char *name, Bridge_Overflow *overflow);
+
+#endif /* BRIDGE_H */
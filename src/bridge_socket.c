@@ -0,0 +1,440 @@
+/*  bridge_socket.c
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE                /* accept4() */
+#define _POSIX_C_SOURCE 200809L    /* MSG_NOSIGNAL */
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bridge.h"
+#include "bridge_socket.h"
+#include "event_loop.h"
+#include "inbound.h"
+#include "log.h"
+
+/* A client that cannot take a batch within this many seconds is disconnected */
+#define CLIENT_SEND_TIMEOUT 1
+
+#define READ_BUFFER_SIZE 16384
+
+typedef enum Parse_State {
+    PARSE_COUNT,     // reading the record count of a batch
+    PARSE_LENGTH,    // reading the length of the next field
+    PARSE_DATA,      // reading the bytes of a field
+} Parse_State;
+
+/* Incremental parser for the batch framing; input may be split at any byte */
+struct Bridge_Parser {
+    Parse_State  state;
+    size_t       number;      // value of the count or length line read so far
+    bool         have_digit;
+    size_t       records;     // records left in the current batch
+    int          field;       // index of the field being read
+    size_t       offsets[3];  // start of each field in data
+    size_t       lengths[3];
+    size_t       filled;      // bytes of the current field read so far
+    char         *data;       // fields of the current record, each null terminated
+    size_t       data_size;
+};
+
+struct Bridge_Client {
+    int                   fd;
+    struct Bridge_Parser  parser;
+};
+
+static struct Bridge_Server {
+    char                  path[PATH_MAX];
+    int                   listen_fd;
+
+    /*
+     * Clients are only opened and closed by the main thread, which holds the lock to do
+     * so. The delivery thread only holds it to duplicate their descriptors.
+     */
+    pthread_mutex_t       lock;
+    struct Bridge_Client  clients[BRIDGE_SOCKET_MAX_CLIENTS];
+} server = {
+    .listen_fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* Starts reading a field of the current record. Returns -1 if the field is too large. */
+static int parser_begin_field(struct Bridge_Parser *p, size_t length)
+{
+    if (length > BRIDGE_MAX_FIELD_LENGTH) {
+        return -1;
+    }
+
+    size_t offset = p->field == 0 ? 0 : p->offsets[p->field - 1] + p->lengths[p->field - 1] + 1;
+
+    if (offset + length + 1 > p->data_size) {
+        size_t size = offset + length + 1;
+        char *data = realloc(p->data, size);
+
+        if (data == NULL) {
+            return -1;
+        }
+
+        p->data = data;
+        p->data_size = size;
+    }
+
+    p->offsets[p->field] = offset;
+    p->lengths[p->field] = length;
+    p->filled = 0;
+    return 0;
+}
+
+/* Called once the current field is complete. */
+static void parser_end_field(struct Bridge_Parser *p)
+{
+    p->data[p->offsets[p->field] + p->lengths[p->field]] = '\0';
+
+    if (++p->field < 3) {
+        p->state = PARSE_LENGTH;
+        return;
+    }
+
+    inbound_post(p->data + p->offsets[0], p->data + p->offsets[1], p->data + p->offsets[2], p->lengths[2]);
+    p->field = 0;
+    p->state = --p->records > 0 ? PARSE_LENGTH : PARSE_COUNT;
+}
+
+/*
+ * Feeds len bytes of buf to p, queueing every record it completes.
+ *
+ * Returns 0 on success.
+ * Returns -1 if the input is not valid framing.
+ */
+static int parser_feed(struct Bridge_Parser *p, const char *buf, size_t len)
+{
+    size_t i = 0;
+
+    while (i < len) {
+        if (p->state == PARSE_DATA) {
+            size_t n = p->lengths[p->field] - p->filled;
+
+            if (n > len - i) {
+                n = len - i;
+            }
+
+            memcpy(p->data + p->offsets[p->field] + p->filled, buf + i, n);
+            p->filled += n;
+            i += n;
+
+            if (p->filled == p->lengths[p->field]) {
+                parser_end_field(p);
+            }
+
+            continue;
+        }
+
+        char c = buf[i++];
+
+        if (c >= '0' && c <= '9') {
+            if (p->number > BRIDGE_MAX_FIELD_LENGTH) {
+                return -1;
+            }
+
+            p->number = p->number * 10 + (c - '0');
+            p->have_digit = true;
+            continue;
+        }
+
+        if (c != '\n' || !p->have_digit) {
+            return -1;
+        }
+
+        size_t number = p->number;
+        p->number = 0;
+        p->have_digit = false;
+
+        if (p->state == PARSE_COUNT) {
+            p->records = number;
+            p->field = 0;
+            p->state = number > 0 ? PARSE_LENGTH : PARSE_COUNT;
+            continue;
+        }
+
+        if (parser_begin_field(p, number) != 0) {
+            return -1;
+        }
+
+        p->state = PARSE_DATA;
+
+        if (number == 0) {
+            parser_end_field(p);
+        }
+    }
+
+    return 0;
+}
+
+static void client_close(struct Bridge_Client *client)
+{
+    event_loop_del(client->fd);
+
+    pthread_mutex_lock(&server.lock);
+    close(client->fd);
+    client->fd = -1;
+    pthread_mutex_unlock(&server.lock);
+
+    free(client->parser.data);
+    memset(&client->parser, 0, sizeof(struct Bridge_Parser));
+}
+
+/* Reads whatever client has sent. Returns -1 if the client should be disconnected. */
+static int client_read(struct Bridge_Client *client)
+{
+    char buf[READ_BUFFER_SIZE];
+    ssize_t n = recv(client->fd, buf, sizeof(buf), MSG_DONTWAIT);
+
+    if (n == -1 && (errno == EINTR || errno == EAGAIN)) {
+        return 0;
+    }
+
+    if (n <= 0) {
+        return -1;
+    }
+
+    if (parser_feed(&client->parser, buf, n) != 0) {
+        log_timestamp("Bridge client sent malformed data");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void client_event(void *userdata, int fd, uint32_t events)
+{
+    (void) fd;
+    (void) events;
+
+    struct Bridge_Client *client = userdata;
+
+    if (client_read(client) != 0) {
+        log_timestamp("Bridge client %td disconnected", client - server.clients);
+        client_close(client);
+    }
+
+    /* one sync covers everything read from the client in this call */
+    inbound_sync();
+}
+
+static void client_accept(void)
+{
+    int fd = accept4(server.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+    if (fd == -1) {
+        if (errno != EINTR && errno != EAGAIN) {
+            log_error_timestamp(errno, "Bridge socket accept() failed");
+        }
+
+        return;
+    }
+
+    struct timeval timeout = { CLIENT_SEND_TIMEOUT, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    for (size_t i = 0; i < BRIDGE_SOCKET_MAX_CLIENTS; ++i) {
+        struct Bridge_Client *client = &server.clients[i];
+
+        if (client->fd != -1) {
+            continue;
+        }
+
+        if (event_loop_add(fd, EPOLLIN, client_event, client) != 0) {
+            close(fd);
+            return;
+        }
+
+        pthread_mutex_lock(&server.lock);
+        client->fd = fd;
+        pthread_mutex_unlock(&server.lock);
+
+        log_timestamp("Bridge client %zu connected", i);
+        bridge_sink_ready();
+        return;
+    }
+
+    log_timestamp("Too many bridge clients, rejecting connection");
+    close(fd);
+}
+
+static void listen_event(void *userdata, int fd, uint32_t events)
+{
+    (void) userdata;
+    (void) fd;
+    (void) events;
+
+    client_accept();
+}
+
+int bridge_socket_init(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        log_error_timestamp(-1, "Bridge socket path too long: %s", path);
+        return -1;
+    }
+
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    snprintf(server.path, sizeof(server.path), "%s", path);
+
+    for (size_t i = 0; i < BRIDGE_SOCKET_MAX_CLIENTS; ++i) {
+        server.clients[i].fd = -1;
+    }
+
+    struct stat st;
+
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+
+    server.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (server.listen_fd == -1) {
+        log_error_timestamp(errno, "Bridge socket() failed");
+        return -1;
+    }
+
+    if (bind(server.listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0
+            || chmod(path, 0660) != 0
+            || listen(server.listen_fd, BRIDGE_SOCKET_MAX_CLIENTS) != 0) {
+        log_error_timestamp(errno, "Failed to listen on bridge socket %s", path);
+        close(server.listen_fd);
+        server.listen_fd = -1;
+        return -1;
+    }
+
+    if (event_loop_add(server.listen_fd, EPOLLIN, listen_event, NULL) != 0) {
+        bridge_socket_kill();
+        return -1;
+    }
+
+    log_timestamp("Bridge listening on %s", path);
+    return 0;
+}
+
+void bridge_socket_kill(void)
+{
+    /* the client table is only initialised once the path has been accepted */
+    if (server.listen_fd != -1) {
+        for (size_t i = 0; i < BRIDGE_SOCKET_MAX_CLIENTS; ++i) {
+            if (server.clients[i].fd != -1) {
+                client_close(&server.clients[i]);
+            }
+        }
+
+        event_loop_del(server.listen_fd);
+
+        pthread_mutex_lock(&server.lock);
+        close(server.listen_fd);
+        server.listen_fd = -1;
+        pthread_mutex_unlock(&server.lock);
+
+        unlink(server.path);
+    }
+}
+
+int bridge_socket_broadcast(const char *buf, size_t len)
+{
+    int fds[BRIDGE_SOCKET_MAX_CLIENTS];
+    size_t slots[BRIDGE_SOCKET_MAX_CLIENTS];
+    size_t count = 0;
+
+    /*
+     * The sends below may block for CLIENT_SEND_TIMEOUT, so they work on duplicates taken
+     * under the lock: the main thread is never kept waiting, and a client it closes in
+     * the meantime cannot have its descriptor reused under us.
+     */
+    pthread_mutex_lock(&server.lock);
+
+    /* the client table is only valid while listening */
+    if (server.listen_fd != -1) {
+        for (size_t i = 0; i < BRIDGE_SOCKET_MAX_CLIENTS; ++i) {
+            if (server.clients[i].fd == -1) {
+                continue;
+            }
+
+            int fd = dup(server.clients[i].fd);
+
+            if (fd == -1) {
+                log_error_timestamp(errno, "Bridge socket dup() failed");
+                continue;
+            }
+
+            fds[count] = fd;
+            slots[count] = i;
+            ++count;
+        }
+    }
+
+    pthread_mutex_unlock(&server.lock);
+
+    int sent = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        int fd = fds[i];
+        const char *p = buf;
+        size_t left = len;
+
+        while (left > 0) {
+            ssize_t n = send(fd, p, left, MSG_NOSIGNAL);
+
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+
+            if (n <= 0) {
+                break;
+            }
+
+            p += n;
+            left -= n;
+        }
+
+        if (left > 0) {
+            /* the main loop sees the hangup and closes the client */
+            log_timestamp("Bridge client %zu is not reading, disconnecting", slots[i]);
+            shutdown(fd, SHUT_RDWR);
+        } else {
+            ++sent;
+        }
+
+        close(fd);
+    }
+
+    return sent;
+}
@@ -0,0 +1,73 @@
+/*  bridge_socket.h
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef BRIDGE_SOCKET_H
+#define BRIDGE_SOCKET_H
+
+#include <stddef.h>
+
+/*
+ * Bridge peers connect to a Unix domain stream socket (BRIDGE_SOCKET_PATH by default)
+ * and exchange batches of records in both directions, using the framing described in
+ * bridge.h:
+ *
+ *   batch   <record count>\n followed by that many records
+ *   record  three fields: sender, group, text
+ *   field   <length in bytes>\n followed by exactly that many bytes
+ *
+ * Batches sent by the bot carry the messages seen in bridged groups. Every connected
+ * client receives every batch.
+ *
+ * Batches sent by a client are messages to post to Tox, and are queued with
+ * inbound_post(). The group field is a list of targets as described in sources.h;
+ * when it is empty the text goes to the public NGC group and the default conference.
+ * When sender is not empty the text is prefixed with "sender: ".
+ *
+ * A client that sends a malformed batch or a field longer than BRIDGE_MAX_FIELD_LENGTH
+ * is disconnected.
+ */
+
+#define BRIDGE_SOCKET_MAX_CLIENTS 16
+#define BRIDGE_MAX_FIELD_LENGTH   (64 * 1024)
+
+/*
+ * Listens on the Unix domain socket at path, replacing a stale socket file. Clients are
+ * accepted and their batches read by the main thread, from event_loop_wait(), so the
+ * event loop must be initialised first.
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */
+int bridge_socket_init(const char *path);
+
+/* Disconnects all clients, stops listening and removes the socket file. */
+void bridge_socket_kill(void);
+
+/*
+ * Writes len bytes of buf, which must be one complete batch, to every connected client.
+ * Clients that cannot keep up are disconnected.
+ *
+ * Returns the number of clients the batch was written to.
+ */
+int bridge_socket_broadcast(const char *buf, size_t len);
+
+#endif /* BRIDGE_SOCKET_H */
@@ -20,6 +20,7 @@
  *
  */
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -28,31 +29,32 @@
 #include <tox/tox.h>
 #include <tox/toxav.h>
 
+#include "acl.h"
+#include "bridge.h"
+#include "outbox.h"
+#include "hex.h"
 #include "toxbot.h"
 #include "misc.h"
 #include "groupchats.h"
 #include "log.h"
+#include "snapshot.h"
+#include "workers.h"
 
 #define MAX_COMMAND_LENGTH TOX_MAX_MESSAGE_LENGTH
 #define MAX_NUM_ARGS 4
 
-extern struct Tox_Bot Tox_Bot;
-
 /** static struct { */
 /**     const char *name; */
 /**     void (*func)(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH]); */
 /** } commands[] = { */
 struct CF {
     const char *name;
-    void (*func)(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH]);
+    void (*func)(struct Tox_Bot *bot, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH]);
     bool admin_only;
 };
 // add by liqsliu
 /* #define MAX_NUM_ARGS 16 //测试结果: 重复定义会以第二次定义的为准 */
 #define MAX_GROUPS 64
-extern uint32_t PUBLIC_GROUP_NUM;
-extern uint32_t MY_NUM;
-extern bool joined_group;
 
 // add by liqsliu
 
@@ -69,11 +71,58 @@ static void send_error(Tox *m, uint32_t friendnumber, const char *message, int e
     tox_friend_send_message(m, friendnumber, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
 }
 
-static void cmd_default(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+/*
+ * A command whose file I/O runs on a worker. The command fills in what the worker needs
+ * before queueing it, and the finish callback sends the replies from the Tox thread.
+ */
+struct Command_Job {
+    struct Tox_Bot  *bot;
+    uint32_t        friendnumber;
+    char            arg[MAX_COMMAND_LENGTH];
+    char            name[TOX_MAX_NAME_LENGTH];    // the friend who sent the command
+    char            *text;
+    size_t          length;
+    uint64_t        seq;    // orders jobs that write the same file
+    int             result;
+};
+
+static struct Command_Job *command_job_new(struct Tox_Bot *bot, uint32_t friendnumber)
 {
+    struct Command_Job *job = calloc(1, sizeof(struct Command_Job));
+
+    if (job == NULL) {
+        log_error_timestamp(-1, "Failed to allocate command job");
+        return NULL;
+    }
+
+    job->bot = bot;
+    job->friendnumber = friendnumber;
+
+    return job;
+}
+
+static void command_job_free(struct Command_Job *job)
+{
+    free(job->text);
+    free(job);
+}
+
+static void command_job_queue(struct Command_Job *job, work_cb *work, work_cb *finish)
+{
+    if (workers_queue(&job->bot->results, work, finish, job) != 0) {
+        const char *outmsg = "Error: the command could not be run";
+        tox_friend_send_message(job->bot->m, job->friendnumber, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg,
+                                strlen(outmsg), NULL);
+        command_job_free(job);
+    }
+}
+
+static void cmd_default(struct Tox_Bot *bot, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    Tox *m = bot->m;
     const char *outmsg = NULL;
 
-    if (!friend_is_master(m, friendnumber)) {
+    if (!friend_is_master(bot, friendnumber)) {
         authent_failed(m, friendnumber);
         return;
     }
@@ -92,7 +141,7 @@ static void cmd_default(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MA
         return;
     }
 
-    Tox_Bot.default_groupnum = groupnum;
+    bot->default_groupnum = groupnum;
 
     char msg[MAX_COMMAND_LENGTH];
     snprintf(msg, sizeof(msg), "Default room number set to %d", groupnum);
@@ -106,11 +155,12 @@ static void cmd_default(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MA
     log_timestamp("Default room number set to %d by %s", groupnum, name);
 }
 
-static void cmd_gmessage(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+static void cmd_gmessage(struct Tox_Bot *bot, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
+    Tox *m = bot->m;
     const char *outmsg = NULL;
 
-    if (!friend_is_master(m, friendnumber)) {
+    if (!friend_is_master(bot, friendnumber)) {
         authent_failed(m, friendnumber);
         return;
     }
@@ -135,7 +185,7 @@ static void cmd_gmessage(Tox *m, uint32_t friendnumber, int argc, char (*argv)[M
         return;
     }
 
-    if (group_index(groupnum) == -1) {
+    if (group_index(bot, groupnum) == -1) {
         outmsg = "Error: Invalid group number";
         tox_friend_send_message(m, friendnumber, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
         return;
@@ -171,8 +221,9 @@ static void cmd_gmessage(Tox *m, uint32_t friendnumber, int argc, char (*argv)[M
     log_timestamp("<%s> message to group %d: %s", name, groupnum, msg);
 }
 
-static void cmd_group(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+static void cmd_group(struct Tox_Bot *bot, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
+    Tox *m = bot->m;
     const char *outmsg = NULL;
 
     if (argc < 1) {
@@ -220,7 +271,7 @@ static void cmd_group(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX_
         return;
     }
 
-    if (group_add(groupnum, type, password) == -1) {
+    if (group_add(bot, groupnum, type, password) == -1) {
         log_error_timestamp(-1, "Group chat creation by %s failed", name);
         outmsg = "Group chat creation failed";
         tox_friend_send_message(m, friendnumber, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
@@ -237,17 +288,76 @@ static void cmd_group(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX_
 }
 
 
-static void sendme(Tox *m, const char *outmsg)
+static void sendme(struct Tox_Bot *bot, const char *outmsg)
 {
-    if (MY_NUM != UINT32_MAX) {
-        tox_friend_send_message(m, MY_NUM, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+    Tox *m = bot->m;
+
+    if (bot->my_num != UINT32_MAX) {
+        tox_friend_send_message(m, bot->my_num, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
     } else {
         log_timestamp("MY_NUM is not set");
     }
 }
 
-static void cmd_help(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+/* Reads commands.txt; result is -1 if it does not exist, -2 if it could not be read */
+static void help_admin_work(void *arg)
+{
+    struct Command_Job *job = arg;
+
+    log_timestamp("opening txt...");
+    char path[1024]=SH_PATH;
+    strcat(path, "/commands.txt");
+    if (file_exists(path) != true)
+    {
+        job->result = -1;
+        return;
+    }
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Warning: failed to read '%s' file\n", path);
+        job->result = -2;
+        return;
+    }
+    log_timestamp("reading txt...");
+    char line[TOX_MAX_MESSAGE_LENGTH];
+    while (fgets(line, TOX_MAX_MESSAGE_LENGTH, fp)) {
+        size_t len = strlen(line);
+        char *text = realloc(job->text, job->length + len + 1);
+        if (text == NULL) {
+            break;
+        }
+        memcpy(text + job->length, line, len + 1);
+        job->text = text;
+        job->length += len;
+    }
+    fclose(fp);
+}
+
+/* Sends commands.txt a line at a time, as it was read */
+static void help_admin_finish(void *arg)
 {
+    struct Command_Job *job = arg;
+    Tox *m = job->bot->m;
+
+    if (job->result == -1) {
+        const char *outmsg = "not found commands.txt file";
+        tox_friend_send_message(m, job->friendnumber, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+    }
+
+    for (size_t off = 0; off < job->length;) {
+        const char *nl = memchr(job->text + off, '\n', job->length - off);
+        size_t len = nl != NULL ? (size_t) (nl - (job->text + off)) + 1 : job->length - off;
+        len = MIN(len, TOX_MAX_MESSAGE_LENGTH - 1);
+        tox_friend_send_message(m, job->friendnumber, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) job->text + off, len, NULL);
+        off += len;
+    }
+
+    command_job_free(job);
+}
+
+static void cmd_help(struct Tox_Bot *bot, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    Tox *m = bot->m;
     log_timestamp("argc: %d", argc+1);
     printf("argv:");
     int i;
@@ -274,7 +384,7 @@ static void cmd_help(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX_C
         outmsg = ".group <type> <pass> : Creates a new groupchat with type: text | audio (optional password)";
         tox_friend_send_message(m, friendnumber, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
 
-        if (friend_is_master(m, friendnumber)) {
+        if (friend_is_master(bot, friendnumber)) {
             outmsg = "For a list of master commands see the commands.txt file";
             tox_friend_send_message(m, friendnumber, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
         }
@@ -282,31 +392,12 @@ static void cmd_help(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX_C
     }
     if (argc == 1) {
         if (strcmp(argv[1], "admin") == 0) {
-            log_timestamp("opening txt...");
-            FILE *fp = NULL;
-            char path[1024]=SH_PATH;
-            strcat(path, "/commands.txt");
-            if (file_exists(path) != true)
-            {
-                outmsg = "not found commands.txt file";
-                tox_friend_send_message(m, friendnumber, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
-                return;
-            }
-            fp = fopen(path, "r");
-            if (fp == NULL) {
-                fprintf(stderr, "Warning: failed to read '%s' file\n", path);
-                return;
-            }
-            char line[TOX_MAX_MESSAGE_LENGTH];
-            line[0] = '\0';
-            log_timestamp("reading txt...");
-            while (fgets(line, TOX_MAX_MESSAGE_LENGTH, fp)) {
-                /** log_timestamp("got: %s", line); */
-                outmsg = line;
-                tox_friend_send_message(m, friendnumber, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
-                line[0] = '\0';
+            struct Command_Job *job = command_job_new(bot, friendnumber);
+
+            if (job != NULL) {
+                command_job_queue(job, help_admin_work, help_admin_finish);
             }
-            fclose(fp);
+
             return;
         }
     }
@@ -330,53 +421,81 @@ int String2Int(char *str)//字符串转数字
     }
     return (int)res;
 }
-static void cmd_exit(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+static void cmd_exit(struct Tox_Bot *bot, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
+    Tox *m = bot->m;
     if (argc == 0) {
-        sendme(m, ".exit number");
+        sendme(bot, ".exit number");
         return;
     }
     int gn = String2Int(argv[1]);
     if(tox_group_is_connected(m, gn, NULL) == true)
     {
         log_timestamp("connected, really?");
-        sendme(m, "connected?");
+        sendme(bot, "connected?");
     }
     else
-        sendme(m, "not connect");
+        sendme(bot, "not connect");
     if (tox_group_disconnect(m, gn, NULL) == true)
     {
         log_timestamp("disconnected");
-        sendme(m, "ok");
+        sendme(bot, "ok");
     }
     else
-        sendme(m, "failed");
+        sendme(bot, "failed");
 }
+/* written with snapshot_write_file(), so the rejoin path never reads a half written list */
 int save_chat_ids(char *chat_ids)
 {
     char * path="group_chat_ids";
-    if (path == NULL) {
-        goto on_error;
-    }
-    FILE *fp = fopen(path, "wb");
-    if (fp == NULL) {
-        goto on_error;
-    }
-    if (fwrite(chat_ids, strlen(chat_ids), 1, fp) != 1) {
-        fclose(fp);
-        goto on_error;
+    if (snapshot_write_file(path, (const uint8_t *) chat_ids, strlen(chat_ids)) != 0) {
+        log_error_timestamp(-1, "Warning: save failed");
+        return -1;
     }
-    fclose(fp);
     log_timestamp("saved chat_ids");
     return 0;
+}
 
-on_error:
-    log_error_timestamp(-1, "Warning: save failed");
-    return -1;
+/*
+ * .save jobs can run on several workers at once. They share the temporary file, so they
+ * take turns, and a job that finds a later .save already written has nothing to do.
+ */
+static struct {
+    pthread_mutex_t lock;
+    uint64_t        queued;     // main thread only
+    uint64_t        written;
+} chat_ids_saves = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void save_chat_ids_work(void *arg)
+{
+    struct Command_Job *job = arg;
+
+    pthread_mutex_lock(&chat_ids_saves.lock);
+
+    if (job->seq > chat_ids_saves.written) {
+        job->result = save_chat_ids(job->text);
+
+        if (job->result == 0) {
+            chat_ids_saves.written = job->seq;
+        }
+    }
+
+    pthread_mutex_unlock(&chat_ids_saves.lock);
 }
 
-static void cmd_save(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+static void save_chat_ids_finish(void *arg)
 {
+    struct Command_Job *job = arg;
+
+    const char *outmsg = job->result == 0 ? "ok" : "failed to save chat_ids";
+    tox_friend_send_message(job->bot->m, job->friendnumber, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+
+    command_job_free(job);
+}
+
+static void cmd_save(struct Tox_Bot *bot, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    Tox *m = bot->m;
     int n = tox_group_get_number_groups(m);
     log_timestamp("现在群数量: %d", n);
     if (n == 0)
@@ -391,10 +510,16 @@ static void cmd_save(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX_C
         sprintf(outmsg+strlen(outmsg), "%d", n);
         tox_friend_send_message(m, friendnumber, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
         outmsg[0] = '\0';
-        int i, j;
+        int i;
         char chat_ids[TOX_GROUP_CHAT_ID_SIZE*MAX_GROUPS*2+MAX_GROUPS+1]={0};
+        size_t pos = 0;
         for (i=0; i<n; ++i)
         {
+            if (i >= MAX_GROUPS) {
+                sprintf(outmsg+strlen(outmsg), "群数量已达到上限: %d/%d", MAX_GROUPS, n);
+                tox_friend_send_message(m, friendnumber, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+                break;
+            }
             sprintf(outmsg+strlen(outmsg), "%d", i);
 
             char public_key[TOX_PUBLIC_KEY_SIZE];
@@ -405,31 +530,29 @@ static void cmd_save(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX_C
                 outmsg[0] = '\0';
                 break;
             }
-            if (strlen(chat_ids) != 0)
-                chat_ids[strlen(chat_ids)] = '\n';
-            for (j=0; j<sizeof(public_key); j++)
-            {
-                /* printf("%hhX", public_key[i]); */
-                sprintf(chat_ids+strlen(chat_ids), "%hhX", public_key[j]);
-            }
-            if (i >= MAX_GROUPS) {
-                sprintf(outmsg+strlen(outmsg), "群数量已达到上限: %d/%d", MAX_GROUPS, n);
-                tox_friend_send_message(m, friendnumber, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
-                break;
-            }
+            hex_encode(chat_ids + pos, (uint8_t *) public_key, sizeof(public_key));
+            pos += sizeof(public_key) * 2;
+            chat_ids[pos++] = '\n';
+        }
+        chat_ids[pos] = '\0';
 
+        struct Command_Job *job = command_job_new(bot, friendnumber);
+
+        if (job == NULL || (job->text = strdup(chat_ids)) == NULL) {
+            free(job);
+            return;
         }
-        chat_ids[strlen(chat_ids)+1] = '\0';
-        chat_ids[strlen(chat_ids)] = '\n';
-        save_chat_ids(chat_ids);
-        tox_friend_send_message(m, friendnumber, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) "ok", strlen(outmsg), NULL);
+
+        job->seq = ++chat_ids_saves.queued;
+        command_job_queue(job, save_chat_ids_work, save_chat_ids_finish);
     }
 
 }
 
 
-static void cmd_list(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+static void cmd_list(struct Tox_Bot *bot, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
+    Tox *m = bot->m;
     int n = tox_group_get_number_groups(m);
     log_timestamp("现在public群数量: %d", n);
     if (n == 0)
@@ -447,7 +570,7 @@ static void cmd_list(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX_C
 
         char title[TOX_MAX_NAME_LENGTH];
         int len;
-        int i, j;
+        int i;
         for (i=0; i<n; ++i)
         {
             sprintf(outmsg+strlen(outmsg), "%d", i);
@@ -467,11 +590,7 @@ static void cmd_list(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX_C
                 outmsg[0] = '\0';
                 break;
             }
-            for (j=0; j<sizeof(public_key); j++)
-            {
-                /* printf("%hhX", public_key[i]); */
-                sprintf(outmsg+strlen(outmsg), "%hhX", public_key[j]);
-            }
+            hex_encode(outmsg + strlen(outmsg), (uint8_t *) public_key, sizeof(public_key));
             tox_friend_send_message(m, friendnumber, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
             outmsg[0] = '\0';
             if (i >= MAX_GROUPS) {
@@ -483,10 +602,11 @@ static void cmd_list(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX_C
         }
     }
 }
-static void cmd_rejoin(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+static void cmd_rejoin(struct Tox_Bot *bot, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
+    Tox *m = bot->m;
     if (argc == 0) {
-        sendme(m, ".rejoin number");
+        sendme(bot, ".rejoin number");
         return;
     }
     int gn = String2Int(argv[1]);
@@ -494,10 +614,10 @@ static void cmd_rejoin(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX
     if(tox_group_is_connected(m, gn, NULL) == true)
     {
         log_timestamp("connected, really?");
-        sendme(m, "connected?");
+        sendme(bot, "connected?");
     }
     else
-        sendme(m, "not connected");
+        sendme(bot, "not connected");
     /* if (tox_group_disconnect(m, gn, NULL) == true) */
     /* { */
     /*     sendme(m, "disconnected"); */
@@ -509,17 +629,18 @@ static void cmd_rejoin(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX
     bool res = tox_group_reconnect(m, gn, &err);
     if (res == true && err == TOX_ERR_GROUP_RECONNECT_OK)
     {
-        sendme(m, "reconnect ok");
+        sendme(bot, "reconnect ok");
     } else {
-        sendme(m, "reconnect failed");
+        sendme(bot, "reconnect failed");
     }
     /* sleep(1); */
     int n = tox_group_get_number_groups(m);
     log_timestamp("现在群数量: %d", n);
 
 }
-static void cmd_join(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+static void cmd_join(struct Tox_Bot *bot, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
+    Tox *m = bot->m;
     char * chat_id;
     if (argc == 0) {
         chat_id = CHAT_ID;
@@ -531,7 +652,7 @@ static void cmd_join(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX_C
         tox_friend_send_message(m, friendnumber, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
         return;
     }
-    if (join_public_group_by_chat_id(m, chat_id) == 0) {
+    if (join_public_group_by_chat_id(bot, chat_id) == 0) {
         char *outmsg="ok";
         tox_friend_send_message(m, friendnumber, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
     } else {
@@ -539,59 +660,64 @@ static void cmd_join(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX_C
         tox_friend_send_message(m, friendnumber, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
     }
 }
-static void cmd_init(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+static void cmd_init(struct Tox_Bot *bot, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
+    Tox *m = bot->m;
     /* if (!friend_is_master(m, friendnumber)) { */
     /*     authent_failed(m, friendnumber); */
     /*     log_timestamp("已忽略命令: %d %s", friendnumber, argv[0]); */
     /*     return; */
     /* } */
     /** if (PUBLIC_GROUP_NUM == UINT32_MAX) */
-    join_public_group(m);
+    join_public_group(bot);
     /** log_timestamp("join: %s", CHAT_ID); */
     /** } else { */
     /**     rejoin_public_group(m, PUBLIC_GROUP_NUM); */
     /**     log_timestamp("rejoin: %d", PUBLIC_GROUP_NUM); */
     const char *outmsg =NULL;
-    if (joined_group == true)
+    if (bot->joined_group == true)
         outmsg = "ok";
     else
         outmsg = "failed";
     tox_friend_send_message(m, friendnumber, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
 }
 
-static void cmd_id(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+static void cmd_id(struct Tox_Bot *bot, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
+    Tox *m = bot->m;
     char outmsg[TOX_ADDRESS_SIZE * 2 + 1];
-    char address[TOX_ADDRESS_SIZE];
-    tox_self_get_address(m, (uint8_t *) address);
-
-    for (size_t i = 0; i < TOX_ADDRESS_SIZE; ++i) {
-        char d[3];
-        sprintf(d, "%02X", address[i] & 0xff);
-        memcpy(outmsg + i * 2, d, 2);
-    }
-
-    outmsg[TOX_ADDRESS_SIZE * 2] = '\0';
+    uint8_t address[TOX_ADDRESS_SIZE];
+    tox_self_get_address(m, address);
+    hex_encode(outmsg, address, sizeof(address));
     tox_friend_send_message(m, friendnumber, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
 }
 
-static void cmd_info(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+static void cmd_info(struct Tox_Bot *bot, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
+    Tox *m = bot->m;
     char outmsg[MAX_COMMAND_LENGTH];
     char timestr[64];
 
     time_t curtime = get_time();
-    get_elapsed_time_str(timestr, sizeof(timestr), curtime - Tox_Bot.start_time);
+    get_elapsed_time_str(timestr, sizeof(timestr), curtime - bot->start_time);
     snprintf(outmsg, sizeof(outmsg), "Uptime: %s", timestr);
     tox_friend_send_message(m, friendnumber, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
 
     uint32_t numfriends = tox_self_get_friend_list_size(m);
-    snprintf(outmsg, sizeof(outmsg), "Friends: %d (%d online)", numfriends, Tox_Bot.num_online_friends);
+    snprintf(outmsg, sizeof(outmsg), "Friends: %d (%d online)", numfriends, bot->num_online_friends);
     tox_friend_send_message(m, friendnumber, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
 
     snprintf(outmsg, sizeof(outmsg), "Inactive friends are purged after %"PRIu64" days",
-             Tox_Bot.inactive_limit / SECONDS_IN_DAY);
+             bot->inactive_limit / SECONDS_IN_DAY);
+    tox_friend_send_message(m, friendnumber, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+
+    struct Bridge_Stats stats;
+    bridge_get_stats(&stats);
+    snprintf(outmsg, sizeof(outmsg), "Bridge: %"PRIu64" enqueued, %"PRIu64" delivered, %"PRIu64" dropped, %zu queued",
+             stats.enqueued, stats.delivered, stats.dropped, stats.queued);
+    tox_friend_send_message(m, friendnumber, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+
+    snprintf(outmsg, sizeof(outmsg), "Outbox: %zu messages waiting", outbox_pending());
     tox_friend_send_message(m, friendnumber, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
 
     /* List active group chats and number of peers in each */
@@ -612,22 +738,23 @@ static void cmd_info(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX_C
         uint32_t num_peers = tox_conference_peer_count(m, groupnum, &err);
 
         if (err == TOX_ERR_CONFERENCE_PEER_QUERY_OK) {
-            int idx = group_index(groupnum);
-            const char *title = Tox_Bot.g_chats[idx].title_len
-                                ? Tox_Bot.g_chats[idx].title : "None";
+            int idx = group_index(bot, groupnum);
+            const char *title = bot->g_chats[idx].title_len
+                                ? bot->g_chats[idx].title : "None";
             const char *type = tox_conference_get_type(m, groupnum, NULL) == TOX_CONFERENCE_TYPE_AV ? "Audio" : "Text";
             snprintf(outmsg, sizeof(outmsg), "Group %d | %s | peers: %d | Title: %s", groupnum, type,
                      num_peers, title);
             tox_friend_send_message(m, friendnumber, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
         }
     }
-    cmd_list(m, friendnumber, argc, argv);
+    cmd_list(bot, friendnumber, argc, argv);
 }
 
-static void cmd_invite(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+static void cmd_invite(struct Tox_Bot *bot, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
+    Tox *m = bot->m;
     const char *outmsg = NULL;
-    int groupnum = Tox_Bot.default_groupnum;
+    int groupnum = bot->default_groupnum;
 
     if (argc >= 1) {
         groupnum = atoi(argv[1]);
@@ -639,7 +766,7 @@ static void cmd_invite(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX
         }
     }
 
-    int idx = group_index(groupnum);
+    int idx = group_index(bot, groupnum);
 
     if (idx == -1) {
         outmsg = "Group doesn't exist.";
@@ -647,7 +774,7 @@ static void cmd_invite(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX
         return;
     }
 
-    int has_pass = Tox_Bot.g_chats[idx].has_pass;
+    int has_pass = bot->g_chats[idx].has_pass;
 
     char name[TOX_MAX_NAME_LENGTH];
     tox_friend_get_name(m, friendnumber, (uint8_t *) name, NULL);
@@ -660,7 +787,7 @@ static void cmd_invite(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX
         passwd = argv[2];
     }
 
-    if (has_pass && (!passwd || strcmp(argv[2], Tox_Bot.g_chats[idx].password) != 0)) {
+    if (has_pass && (!passwd || strcmp(argv[2], bot->g_chats[idx].password) != 0)) {
         log_error_timestamp(-1, "Failed to invite %s to group %d (invalid password)", name, groupnum);
         outmsg = "Invalid password.";
         tox_friend_send_message(m, friendnumber, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
@@ -680,11 +807,12 @@ static void cmd_invite(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX
     log_timestamp("Invited %s to group %d", name, groupnum);
 }
 
-static void cmd_leave(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+static void cmd_leave(struct Tox_Bot *bot, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
+    Tox *m = bot->m;
     const char *outmsg = NULL;
 
-    if (!friend_is_master(m, friendnumber)) {
+    if (!friend_is_master(bot, friendnumber)) {
         authent_failed(m, friendnumber);
         return;
     }
@@ -716,18 +844,46 @@ static void cmd_leave(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX_
     size_t len = tox_friend_get_name_size(m, friendnumber, NULL);
     name[len] = '\0';
 
-    group_leave(groupnum);
+    group_leave(bot, groupnum);
 
     log_timestamp("Left group %d (%s)", groupnum, name);
     snprintf(msg, sizeof(msg), "Left group %d", groupnum);
     tox_friend_send_message(m, friendnumber, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) msg, strlen(msg), NULL);
 }
 
-static void cmd_master(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+/* Appends to the masterkeys file */
+static void master_work(void *arg)
+{
+    struct Command_Job *job = arg;
+
+    job->result = acl_add_master(job->arg);
+}
+
+static void master_finish(void *arg)
+{
+    struct Command_Job *job = arg;
+    const char *outmsg = NULL;
+
+    if (job->result == -1) {
+        outmsg = "Error: Invalid Tox ID";
+    } else if (job->result == -2) {
+        outmsg = "Error: could not find masterkeys file";
+    } else {
+        log_timestamp("%s added master: %s", job->name, job->arg);
+        outmsg = "ID added to masterkeys list";
+    }
+
+    tox_friend_send_message(job->bot->m, job->friendnumber, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+
+    command_job_free(job);
+}
+
+static void cmd_master(struct Tox_Bot *bot, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
+    Tox *m = bot->m;
     const char *outmsg = NULL;
 
-    if (!friend_is_master(m, friendnumber)) {
+    if (!friend_is_master(bot, friendnumber)) {
         authent_failed(m, friendnumber);
         return;
     }
@@ -746,32 +902,27 @@ static void cmd_master(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX
         return;
     }
 
-    FILE *fp = fopen(MASTERLIST_FILE, "a");
+    struct Command_Job *job = command_job_new(bot, friendnumber);
 
-    if (fp == NULL) {
-        outmsg = "Error: could not find masterkeys file";
-        tox_friend_send_message(m, friendnumber, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+    if (job == NULL) {
         return;
     }
 
-    fprintf(fp, "%s\n", id);
-    fclose(fp);
+    snprintf(job->arg, sizeof(job->arg), "%s", id);
 
-    char name[TOX_MAX_NAME_LENGTH];
-    tox_friend_get_name(m, friendnumber, (uint8_t *) name, NULL);
+    tox_friend_get_name(m, friendnumber, (uint8_t *) job->name, NULL);
     size_t len = tox_friend_get_name_size(m, friendnumber, NULL);
-    name[len] = '\0';
+    job->name[len] = '\0';
 
-    log_timestamp("%s added master: %s", name, id);
-    outmsg = "ID added to masterkeys list";
-    tox_friend_send_message(m, friendnumber, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+    command_job_queue(job, master_work, master_finish);
 }
 
-static void cmd_name(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+static void cmd_name(struct Tox_Bot *bot, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
+    Tox *m = bot->m;
     const char *outmsg = NULL;
 
-    if (!friend_is_master(m, friendnumber)) {
+    if (!friend_is_master(bot, friendnumber)) {
         authent_failed(m, friendnumber);
         return;
     }
@@ -810,14 +961,15 @@ static void cmd_name(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX_C
     m_name[nlen] = '\0';
 
     log_timestamp("%s set name to %s", m_name, name);
-    save_data(m, DATA_FILE);
+    save_data_later(bot);
 }
 
-static void cmd_passwd(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+static void cmd_passwd(struct Tox_Bot *bot, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
+    Tox *m = bot->m;
     const char *outmsg = NULL;
 
-    if (!friend_is_master(m, friendnumber)) {
+    if (!friend_is_master(bot, friendnumber)) {
         authent_failed(m, friendnumber);
         return;
     }
@@ -836,7 +988,7 @@ static void cmd_passwd(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX
         return;
     }
 
-    int idx = group_index(groupnum);
+    int idx = group_index(bot, groupnum);
 
     if (idx == -1) {
         outmsg = "Error: Invalid group number";
@@ -852,8 +1004,8 @@ static void cmd_passwd(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX
 
     /* no password */
     if (argc < 2) {
-        Tox_Bot.g_chats[idx].has_pass = false;
-        memset(Tox_Bot.g_chats[idx].password, 0, MAX_PASSWORD_SIZE);
+        bot->g_chats[idx].has_pass = false;
+        memset(bot->g_chats[idx].password, 0, MAX_PASSWORD_SIZE);
 
         outmsg = "No password set";
         tox_friend_send_message(m, friendnumber, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
@@ -867,8 +1019,8 @@ static void cmd_passwd(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX
         return;
     }
 
-    Tox_Bot.g_chats[idx].has_pass = true;
-    snprintf(Tox_Bot.g_chats[idx].password, sizeof(Tox_Bot.g_chats[idx].password), "%s", argv[2]);
+    bot->g_chats[idx].has_pass = true;
+    snprintf(bot->g_chats[idx].password, sizeof(bot->g_chats[idx].password), "%s", argv[2]);
 
     outmsg = "Password set";
     tox_friend_send_message(m, friendnumber, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
@@ -876,11 +1028,12 @@ static void cmd_passwd(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX
 
 }
 
-static void cmd_purge(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+static void cmd_purge(struct Tox_Bot *bot, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
+    Tox *m = bot->m;
     const char *outmsg = NULL;
 
-    if (!friend_is_master(m, friendnumber)) {
+    if (!friend_is_master(bot, friendnumber)) {
         authent_failed(m, friendnumber);
         return;
     }
@@ -900,7 +1053,7 @@ static void cmd_purge(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX_
     }
 
     uint64_t seconds = days * SECONDS_IN_DAY;
-    Tox_Bot.inactive_limit = seconds;
+    bot->inactive_limit = seconds;
 
     char name[TOX_MAX_NAME_LENGTH];
     tox_friend_get_name(m, friendnumber, (uint8_t *) name, NULL);
@@ -914,11 +1067,12 @@ static void cmd_purge(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX_
     log_timestamp("Purge time set to %"PRIu64" days by %s", days, name);
 }
 
-static void cmd_status(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+static void cmd_status(struct Tox_Bot *bot, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
+    Tox *m = bot->m;
     const char *outmsg = NULL;
 
-    if (!friend_is_master(m, friendnumber)) {
+    if (!friend_is_master(bot, friendnumber)) {
         authent_failed(m, friendnumber);
         return;
     }
@@ -952,14 +1106,15 @@ static void cmd_status(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX
     name[nlen] = '\0';
 
     log_timestamp("%s set status to %s", name, status);
-    save_data(m, DATA_FILE);
+    save_data_later(bot);
 }
 
-static void cmd_statusmessage(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+static void cmd_statusmessage(struct Tox_Bot *bot, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
+    Tox *m = bot->m;
     const char *outmsg = NULL;
 
-    if (!friend_is_master(m, friendnumber)) {
+    if (!friend_is_master(bot, friendnumber)) {
         authent_failed(m, friendnumber);
         return;
     }
@@ -990,14 +1145,15 @@ static void cmd_statusmessage(Tox *m, uint32_t friendnumber, int argc, char (*ar
     name[nlen] = '\0';
 
     log_timestamp("%s set status message to \"%s\"", name, msg);
-    save_data(m, DATA_FILE);
+    save_data_later(bot);
 }
 
-static void cmd_title_set(Tox *m, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+static void cmd_title_set(struct Tox_Bot *bot, uint32_t friendnumber, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
+    Tox *m = bot->m;
     const char *outmsg = NULL;
 
-    if (!friend_is_master(m, friendnumber)) {
+    if (!friend_is_master(bot, friendnumber)) {
         authent_failed(m, friendnumber);
         return;
     }
@@ -1042,9 +1198,9 @@ static void cmd_title_set(Tox *m, uint32_t friendnumber, int argc, char (*argv)[
         return;
     }
 
-    int idx = group_index(groupnum);
-    memcpy(Tox_Bot.g_chats[idx].title, title, len + 1);
-    Tox_Bot.g_chats[idx].title_len = len;
+    int idx = group_index(bot, groupnum);
+    memcpy(bot->g_chats[idx].title, title, len + 1);
+    bot->g_chats[idx].title_len = len;
 
     outmsg = "Group title set";
     tox_friend_send_message(m, friendnumber, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
@@ -1295,7 +1451,9 @@ struct CF commands[] = {
 
 
 static const uint8_t commands_len = sizeof(commands)/sizeof(commands[0]);
-static struct CF last_command;
+/* Each profile thread keeps its own place in the command table */
+static _Thread_local struct CF last_command;
+static _Thread_local int last_index;
 void commands_init(void)
 {
     static bool commands_sorted = false;
@@ -1310,12 +1468,17 @@ void commands_init(void)
         }
         printf("\n\ncommands_len: %d\n", commands_len);
     }
-    last_command = commands[commands_len/2];
+    last_index = commands_len/2;
+    last_command = commands[last_index];
 }
-static int do_command(Tox *m, uint32_t friendnumber, int num_args, char (*args)[MAX_COMMAND_LENGTH])
+static int do_command(struct Tox_Bot *bot, uint32_t friendnumber, int num_args, char (*args)[MAX_COMMAND_LENGTH])
 {
     // static 可以做到保存上次查找到的位置，下次查找直接从该位置检查。如果命令相同，可以节省查找时间
-    static int i=commands_len/2;
+    if (last_command.name == NULL) {
+        last_index = commands_len/2;
+        last_command = commands[last_index];
+    }
+    int i = last_index;
     uint8_t left=0, right=commands_len-1;
     int r;
     while (left <= right)
@@ -1327,17 +1490,17 @@ static int do_command(Tox *m, uint32_t friendnumber, int num_args, char (*args)[
             /* log_timestamp("hit cmd: %d %s", i, commands[i].name); */
             /* if (commands[i].admin_only == true) { */
             if (last_command.admin_only == true) {
-                if (!friend_is_master(m, friendnumber)) {
-                    authent_failed(m, friendnumber);
+                if (!friend_is_master(bot, friendnumber)) {
+                    authent_failed(bot->m, friendnumber);
                     log_timestamp("已忽略命令: %d: %s", friendnumber, args[0]);
                     /* return -2; */
                     return 0;
                 }
                 /* if (MY_NUM == UINT32_MAX) { */
-                MY_NUM = friendnumber;
+                bot->my_num = friendnumber;
             }
             /* (commands[i].func)(m, friendnumber, num_args - 1, args); */
-            (last_command.func)(m, friendnumber, num_args - 1, args);
+            (last_command.func)(bot, friendnumber, num_args - 1, args);
             return 0;
             
         }
@@ -1349,6 +1512,7 @@ static int do_command(Tox *m, uint32_t friendnumber, int num_args, char (*args)[
             i = (left+i-1)/2;
         }
         last_command = commands[i];
+        last_index = i;
     }
     log_timestamp("not found: %s, %d %d", args[0], left, right);
     /** for (size_t i = 0; commands[i].name; ++i) { */
@@ -1362,7 +1526,7 @@ static int do_command(Tox *m, uint32_t friendnumber, int num_args, char (*args)[
 }
 
 
-int execute(Tox *m, uint32_t friendnumber, const char *input, int length)
+int execute(struct Tox_Bot *bot, uint32_t friendnumber, const char *input, int length)
 {
     if (length >= MAX_COMMAND_LENGTH) {
         return -1;
@@ -1378,7 +1542,7 @@ int execute(Tox *m, uint32_t friendnumber, const char *input, int length)
             return -1;
         }
         log_timestamp("run cmd: %s", input);
-        return do_command(m, friendnumber, num_args, args);
+        return do_command(bot, friendnumber, num_args, args);
     } else if (strcmp(input, "invite") == 0) {
         /** char args[MAX_NUM_ARGS][MAX_COMMAND_LENGTH]; */
         /** int num_args = parse_command(input, args); */
@@ -1390,7 +1554,7 @@ int execute(Tox *m, uint32_t friendnumber, const char *input, int length)
             "invite",
         };
         int num_args = 1;
-        return do_command(m, friendnumber, num_args, args);
+        return do_command(bot, friendnumber, num_args, args);
     /* } else if (strcmp(input, "help") == 0) { */
     /*     [> char * args[]={ <] */
     /*     [> char * args[TOX_MAX_MESSAGE_LENGTH]={ <] */
@@ -23,7 +23,11 @@
 #ifndef COMMANDS_H
 #define COMMANDS_H
 
-int execute(Tox *m, int friendnumber, const char *input, int length);
+#include <stdint.h>
+
+struct Tox_Bot;
+
+int execute(struct Tox_Bot *bot, uint32_t friendnumber, const char *input, int length);
 void commands_init(void);
 
 #endif    /* COMMANDS_H */
@@ -0,0 +1,300 @@
+/*  event_loop.c
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L    /* pthread_condattr_setclock(), CLOCK_MONOTONIC */
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "event_loop.h"
+#include "log.h"
+
+/* epoll data of the two internal file descriptors; handlers use their index */
+#define WAKE_TOKEN  UINT32_MAX
+#define TIMER_TOKEN (UINT32_MAX - 1)
+
+#define MAX_EVENTS 32
+
+struct Event_Handler {
+    int       fd;    // -1 if the slot is free
+    event_cb  *cb;
+    void      *userdata;
+};
+
+static struct Event_Loop {
+    int                   epoll_fd;
+    int                   wake_fd;
+    int                   timer_fd;
+    atomic_bool           wake_pending;
+
+    /* if epoll could not be set up, the loop waits on a condition variable instead */
+    pthread_mutex_t       lock;
+    pthread_cond_t        wake_cond;
+    clockid_t             clock;          // the clock wake_cond waits on
+    struct timespec       deadline;
+    bool                  woken;
+
+    struct Event_Handler  handlers[EVENT_LOOP_MAX_HANDLERS];
+} loop = {
+    .epoll_fd = -1,
+    .wake_fd = -1,
+    .timer_fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake_cond = PTHREAD_COND_INITIALIZER,
+    .clock = CLOCK_REALTIME,
+};
+
+static int watch(int fd, uint32_t events, uint64_t token)
+{
+    struct epoll_event ev = {
+        .events = events,
+        .data.u64 = token,
+    };
+
+    return epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/* Makes the condition variable wait on CLOCK_MONOTONIC if it can, so clock changes do not upset it */
+static void fallback_init(void)
+{
+    pthread_condattr_t attr;
+
+    if (pthread_condattr_init(&attr) != 0) {
+        return;
+    }
+
+    if (pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) == 0) {
+        pthread_cond_destroy(&loop.wake_cond);
+
+        if (pthread_cond_init(&loop.wake_cond, &attr) == 0) {
+            loop.clock = CLOCK_MONOTONIC;
+        } else {
+            pthread_cond_init(&loop.wake_cond, NULL);
+        }
+    }
+
+    pthread_condattr_destroy(&attr);
+}
+
+/* Waits for event_loop_wake() or the deadline without epoll. Returns true if the deadline passed. */
+static bool fallback_wait(void)
+{
+    pthread_mutex_lock(&loop.lock);
+
+    int ret = 0;
+
+    while (!loop.woken && ret != ETIMEDOUT) {
+        ret = pthread_cond_timedwait(&loop.wake_cond, &loop.lock, &loop.deadline);
+    }
+
+    bool expired = !loop.woken;
+    loop.woken = false;
+
+    pthread_mutex_unlock(&loop.lock);
+
+    return expired;
+}
+
+int event_loop_init(void)
+{
+    for (size_t i = 0; i < EVENT_LOOP_MAX_HANDLERS; ++i) {
+        loop.handlers[i].fd = -1;
+    }
+
+    fallback_init();
+
+    loop.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    loop.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    loop.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if (loop.epoll_fd == -1 || loop.wake_fd == -1 || loop.timer_fd == -1
+            || watch(loop.wake_fd, EPOLLIN, WAKE_TOKEN) != 0
+            || watch(loop.timer_fd, EPOLLIN, TIMER_TOKEN) != 0) {
+        log_error_timestamp(errno, "Failed to create event loop");
+        event_loop_free();
+        return -1;
+    }
+
+    return 0;
+}
+
+void event_loop_free(void)
+{
+    int *fds[] = { &loop.epoll_fd, &loop.wake_fd, &loop.timer_fd };
+
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); ++i) {
+        if (*fds[i] != -1) {
+            close(*fds[i]);
+            *fds[i] = -1;
+        }
+    }
+}
+
+int event_loop_add(int fd, uint32_t events, event_cb *cb, void *userdata)
+{
+    if (loop.epoll_fd == -1) {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < EVENT_LOOP_MAX_HANDLERS; ++i) {
+        struct Event_Handler *h = &loop.handlers[i];
+
+        if (h->fd != -1) {
+            continue;
+        }
+
+        if (watch(fd, events, i) != 0) {
+            log_error_timestamp(errno, "Failed to watch fd %d", fd);
+            return -1;
+        }
+
+        h->fd = fd;
+        h->cb = cb;
+        h->userdata = userdata;
+        return 0;
+    }
+
+    log_error_timestamp(-1, "Too many event loop handlers");
+    return -1;
+}
+
+void event_loop_del(int fd)
+{
+    for (size_t i = 0; i < EVENT_LOOP_MAX_HANDLERS; ++i) {
+        struct Event_Handler *h = &loop.handlers[i];
+
+        if (h->fd == fd) {
+            epoll_ctl(loop.epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+            h->fd = -1;
+            h->cb = NULL;
+            h->userdata = NULL;
+            return;
+        }
+    }
+}
+
+void event_loop_wake(void)
+{
+    if (loop.wake_fd == -1) {
+        pthread_mutex_lock(&loop.lock);
+        loop.woken = true;
+        pthread_cond_signal(&loop.wake_cond);
+        pthread_mutex_unlock(&loop.lock);
+        return;
+    }
+
+    if (atomic_exchange(&loop.wake_pending, true)) {
+        return;
+    }
+
+    uint64_t one = 1;
+
+    if (write(loop.wake_fd, &one, sizeof(one)) != sizeof(one)) {
+        log_error_timestamp(errno, "Failed to wake event loop");
+    }
+}
+
+void event_loop_set_timer(uint32_t timeout_ms)
+{
+    if (loop.timer_fd == -1) {
+        pthread_mutex_lock(&loop.lock);
+
+        clock_gettime(loop.clock, &loop.deadline);
+        loop.deadline.tv_sec += timeout_ms / 1000;
+        loop.deadline.tv_nsec += timeout_ms % 1000 * 1000000;
+
+        if (loop.deadline.tv_nsec >= 1000000000) {
+            ++loop.deadline.tv_sec;
+            loop.deadline.tv_nsec -= 1000000000;
+        }
+
+        pthread_mutex_unlock(&loop.lock);
+        return;
+    }
+
+    /* a zero it_value would disarm the timer */
+    struct itimerspec its = {
+        .it_value = {
+            .tv_sec = timeout_ms / 1000,
+            .tv_nsec = timeout_ms % 1000 * 1000000 + (timeout_ms == 0),
+        },
+    };
+
+    timerfd_settime(loop.timer_fd, 0, &its, NULL);
+}
+
+bool event_loop_wait(void)
+{
+    if (loop.epoll_fd == -1) {
+        return fallback_wait();
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(loop.epoll_fd, events, MAX_EVENTS, -1);
+
+    if (n == -1) {
+        if (errno != EINTR) {
+            log_error_timestamp(errno, "epoll_wait() failed");
+        }
+
+        return false;
+    }
+
+    bool expired = false;
+
+    for (int i = 0; i < n; ++i) {
+        uint64_t token = events[i].data.u64;
+        uint64_t count;
+
+        if (token == TIMER_TOKEN) {
+            expired = read(loop.timer_fd, &count, sizeof(count)) == sizeof(count);
+            continue;
+        }
+
+        if (token == WAKE_TOKEN) {
+            /* clear the flag first, so a wakeup after this point writes the eventfd again */
+            atomic_store(&loop.wake_pending, false);
+
+            if (read(loop.wake_fd, &count, sizeof(count)) != sizeof(count)) {
+                log_error_timestamp(errno, "Failed to read event loop wakeup");
+            }
+
+            continue;
+        }
+
+        struct Event_Handler *h = &loop.handlers[token];
+
+        /* an earlier callback in this round may have removed the handler */
+        if (h->fd != -1) {
+            h->cb(h->userdata, h->fd, events[i].events);
+        }
+    }
+
+    return expired;
+}
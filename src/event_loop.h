@@ -0,0 +1,87 @@
+/*  event_loop.h
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * The main loop sleeps in epoll until a registered file descriptor is ready, another
+ * thread calls event_loop_wake(), or the timer for the next tox_iterate() expires.
+ * Toxcore does not expose its sockets, so it is driven by the timer alone, using the
+ * interval it asks for. A wakeup never cuts that interval short: event_loop_wait()
+ * returns so the caller can handle the work that was posted, and the timer keeps
+ * running for the next tox_iterate().
+ *
+ * If epoll could not be set up, the loop waits on a condition variable instead, so
+ * event_loop_wake() still works, but no file descriptors can be watched.
+ *
+ * Everything except event_loop_wake() must be called from the main thread.
+ */
+
+#define EVENT_LOOP_MAX_HANDLERS 64
+
+/* events is the mask of EPOLLIN, EPOLLHUP etc. that the file descriptor reported */
+typedef void event_cb(void *userdata, int fd, uint32_t events);
+
+/*
+ * Creates the epoll instance, the wakeup eventfd and the timerfd.
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */
+int event_loop_init(void);
+
+void event_loop_free(void);
+
+/*
+ * Calls cb from event_loop_wait() whenever fd reports any of events (EPOLLIN etc).
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */
+int event_loop_add(int fd, uint32_t events, event_cb *cb, void *userdata);
+
+/* Stops watching fd. Call before closing it. */
+void event_loop_del(int fd);
+
+/*
+ * Makes the main thread return from event_loop_wait() as soon as possible. Safe to call
+ * from any thread; calls made before the main thread gets round to it are coalesced.
+ */
+void event_loop_wake(void);
+
+/* Sets the timer to expire timeout_ms milliseconds from now. */
+void event_loop_set_timer(uint32_t timeout_ms);
+
+/*
+ * Waits for at least one event and runs the callbacks of the ready file descriptors.
+ *
+ * Returns true if the timer has expired.
+ * Returns false if it returned for any other reason: a callback ran, event_loop_wake()
+ * was called, or a signal arrived.
+ */
+bool event_loop_wait(void);
+
+#endif /* EVENT_LOOP_H */
@@ -27,47 +27,45 @@
 #include "toxbot.h"
 #include "groupchats.h"
 
-extern struct Tox_Bot Tox_Bot;
-
-void realloc_groupchats(int n)
+void realloc_groupchats(struct Tox_Bot *bot, int n)
 {
     if (n <= 0) {
-        free(Tox_Bot.g_chats);
-        Tox_Bot.g_chats = NULL;
+        free(bot->g_chats);
+        bot->g_chats = NULL;
         return;
     }
 
-    struct Group_Chat *g = realloc(Tox_Bot.g_chats, n * sizeof(struct Group_Chat));
+    struct Group_Chat *g = realloc(bot->g_chats, n * sizeof(struct Group_Chat));
 
     if (g == NULL) {
         exit(EXIT_FAILURE);
     }
 
-    Tox_Bot.g_chats = g;
+    bot->g_chats = g;
 }
 
-int group_add(uint32_t groupnum, uint8_t type, const char *password)
+int group_add(struct Tox_Bot *bot, uint32_t groupnum, uint8_t type, const char *password)
 {
-    realloc_groupchats(Tox_Bot.chats_idx + 1);
-    memset(&Tox_Bot.g_chats[Tox_Bot.chats_idx], 0, sizeof(struct Group_Chat));
+    realloc_groupchats(bot, bot->chats_idx + 1);
+    memset(&bot->g_chats[bot->chats_idx], 0, sizeof(struct Group_Chat));
 
-    for (int i = 0; i <= Tox_Bot.chats_idx && i < MAX_NUM_GROUPS; ++i) {
-        if (Tox_Bot.g_chats[i].active) {
+    for (int i = 0; i <= bot->chats_idx && i < MAX_NUM_GROUPS; ++i) {
+        if (bot->g_chats[i].active) {
             continue;
         }
 
-        memset(&Tox_Bot.g_chats[i], 0, sizeof(struct Group_Chat));
-        Tox_Bot.g_chats[i].groupnum = groupnum;
-        Tox_Bot.g_chats[i].active = true;
-        Tox_Bot.g_chats[i].type = type;
+        memset(&bot->g_chats[i], 0, sizeof(struct Group_Chat));
+        bot->g_chats[i].groupnum = groupnum;
+        bot->g_chats[i].active = true;
+        bot->g_chats[i].type = type;
 
         if (password) {
-            Tox_Bot.g_chats[i].has_pass = true;
-            snprintf(Tox_Bot.g_chats[i].password, sizeof(Tox_Bot.g_chats[i].password), "%s", password);
+            bot->g_chats[i].has_pass = true;
+            snprintf(bot->g_chats[i].password, sizeof(bot->g_chats[i].password), "%s", password);
         }
 
-        if (Tox_Bot.chats_idx == i) {
-            ++Tox_Bot.chats_idx;
+        if (bot->chats_idx == i) {
+            ++bot->chats_idx;
         }
 
         return 0;
@@ -76,31 +74,31 @@ int group_add(uint32_t groupnum, uint8_t type, const char *password)
     return -1;
 }
 
-void group_leave(uint32_t groupnum)
+void group_leave(struct Tox_Bot *bot, uint32_t groupnum)
 {
     int i;
 
-    for (i = 0; i < Tox_Bot.chats_idx; ++i) {
-        if (Tox_Bot.g_chats[i].active && Tox_Bot.g_chats[i].groupnum == groupnum) {
-            memset(&Tox_Bot.g_chats[i], 0, sizeof(struct Group_Chat));
+    for (i = 0; i < bot->chats_idx; ++i) {
+        if (bot->g_chats[i].active && bot->g_chats[i].groupnum == groupnum) {
+            memset(&bot->g_chats[i], 0, sizeof(struct Group_Chat));
             break;
         }
     }
 
-    for (i = Tox_Bot.chats_idx; i > 0; --i) {
-        if (Tox_Bot.g_chats[i - 1].active) {
+    for (i = bot->chats_idx; i > 0; --i) {
+        if (bot->g_chats[i - 1].active) {
             break;
         }
     }
 
-    Tox_Bot.chats_idx = i;
-    realloc_groupchats(i);
+    bot->chats_idx = i;
+    realloc_groupchats(bot, i);
 }
 
-int group_index(uint32_t groupnum)
+int group_index(const struct Tox_Bot *bot, uint32_t groupnum)
 {
-    for (int i = 0; i < Tox_Bot.chats_idx; ++i) {
-        if (Tox_Bot.g_chats[i].active && Tox_Bot.g_chats[i].groupnum == groupnum) {
+    for (int i = 0; i < bot->chats_idx; ++i) {
+        if (bot->g_chats[i].active && bot->g_chats[i].groupnum == groupnum) {
             return i;
         }
     }
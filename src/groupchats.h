@@ -36,10 +36,12 @@ struct Group_Chat {
     char password[MAX_PASSWORD_SIZE];
 };
 
-int group_add(uint32_t groupnum, uint8_t type, const char *password);
-void group_leave(uint32_t groupnum);
-int group_index(uint32_t groupnum);
-void realloc_groupchats(int n);
+struct Tox_Bot;
+
+int group_add(struct Tox_Bot *bot, uint32_t groupnum, uint8_t type, const char *password);
+void group_leave(struct Tox_Bot *bot, uint32_t groupnum);
+int group_index(const struct Tox_Bot *bot, uint32_t groupnum);
+void realloc_groupchats(struct Tox_Bot *bot, int n);
 
 #endif  /* GROUPCHATS_H */
 
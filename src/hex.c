@@ -0,0 +1,298 @@
+/*  hex.c
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <string.h>
+
+#include "hex.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define HEX_HAVE_SSE2 1
+#endif
+
+/* AVX2 is selected at runtime so the binary still runs on CPUs without it */
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define HEX_HAVE_AVX2 1
+#endif
+
+static const char hex_digits[] = "0123456789ABCDEF";
+
+/* Value of each hex digit plus one, so that zero marks an invalid character */
+static const uint8_t hex_values[256] = {
+    ['0'] = 1,  ['1'] = 2,  ['2'] = 3,  ['3'] = 4,  ['4'] = 5,
+    ['5'] = 6,  ['6'] = 7,  ['7'] = 8,  ['8'] = 9,  ['9'] = 10,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+};
+
+static void hex_encode_scalar(char *hex, const uint8_t *bin, size_t len)
+{
+    for (size_t i = 0; i < len; ++i) {
+        hex[i * 2] = hex_digits[bin[i] >> 4];
+        hex[i * 2 + 1] = hex_digits[bin[i] & 0x0f];
+    }
+}
+
+static int hex_decode_scalar(uint8_t *bin, const char *hex, size_t len)
+{
+    for (size_t i = 0; i < len; ++i) {
+        uint8_t hi = hex_values[(uint8_t) hex[i * 2]];
+        uint8_t lo = hex_values[(uint8_t) hex[i * 2 + 1]];
+
+        if (hi == 0 || lo == 0) {
+            return -1;
+        }
+
+        bin[i] = ((hi - 1) << 4) | (lo - 1);
+    }
+
+    return 0;
+}
+
+#ifdef HEX_HAVE_SSE2
+
+/* Converts 16 nibbles to ASCII: '0' + x, plus 7 more for x > 9 to reach 'A' */
+static inline __m128i nibbles_to_ascii_sse2(__m128i x)
+{
+    __m128i letters = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8(9)), _mm_set1_epi8(7));
+    return _mm_add_epi8(_mm_add_epi8(x, _mm_set1_epi8('0')), letters);
+}
+
+/* Returns the nibble values of 16 hex digits in *out, or false if any character is invalid */
+static inline int ascii_to_nibbles_sse2(__m128i c, __m128i *out)
+{
+    /* bytes >= 0x80 are negative as signed chars so never fall inside these ranges */
+    __m128i is_digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+                                     _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+    __m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+    __m128i is_alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                                     _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+
+    if (_mm_movemask_epi8(_mm_or_si128(is_digit, is_alpha)) != 0xffff) {
+        return 0;
+    }
+
+    __m128i digits = _mm_and_si128(is_digit, _mm_sub_epi8(c, _mm_set1_epi8('0')));
+    __m128i alphas = _mm_and_si128(is_alpha, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10)));
+    *out = _mm_or_si128(digits, alphas);
+    return 1;
+}
+
+/* Joins each pair of nibbles (high nibble first in memory) into one byte per 16-bit lane */
+static inline __m128i join_nibbles_sse2(__m128i n)
+{
+    __m128i hi = _mm_and_si128(n, _mm_set1_epi16(0x00ff));
+    __m128i lo = _mm_srli_epi16(n, 8);
+    return _mm_or_si128(_mm_slli_epi16(hi, 4), lo);
+}
+
+static size_t hex_encode_sse2(char *hex, const uint8_t *bin, size_t len)
+{
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i b = _mm_loadu_si128((const __m128i *) (bin + i));
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(b, 4), _mm_set1_epi8(0x0f));
+        __m128i lo = _mm_and_si128(b, _mm_set1_epi8(0x0f));
+
+        _mm_storeu_si128((__m128i *) (hex + i * 2), nibbles_to_ascii_sse2(_mm_unpacklo_epi8(hi, lo)));
+        _mm_storeu_si128((__m128i *) (hex + i * 2 + 16), nibbles_to_ascii_sse2(_mm_unpackhi_epi8(hi, lo)));
+    }
+
+    return i;
+}
+
+/* Returns the number of bytes decoded, or (size_t) -1 on invalid input */
+static size_t hex_decode_sse2(uint8_t *bin, const char *hex, size_t len)
+{
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i a;
+        __m128i b;
+
+        if (!ascii_to_nibbles_sse2(_mm_loadu_si128((const __m128i *) (hex + i * 2)), &a)
+                || !ascii_to_nibbles_sse2(_mm_loadu_si128((const __m128i *) (hex + i * 2 + 16)), &b)) {
+            return (size_t) -1;
+        }
+
+        _mm_storeu_si128((__m128i *) (bin + i), _mm_packus_epi16(join_nibbles_sse2(a), join_nibbles_sse2(b)));
+    }
+
+    return i;
+}
+
+#endif /* HEX_HAVE_SSE2 */
+
+#ifdef HEX_HAVE_AVX2
+
+static int cpu_has_avx2(void)
+{
+    static int has_avx2 = -1;
+
+    if (has_avx2 == -1) {
+        __builtin_cpu_init();
+        has_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+
+    return has_avx2;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i nibbles_to_ascii_avx2(__m256i x)
+{
+    __m256i letters = _mm256_and_si256(_mm256_cmpgt_epi8(x, _mm256_set1_epi8(9)), _mm256_set1_epi8(7));
+    return _mm256_add_epi8(_mm256_add_epi8(x, _mm256_set1_epi8('0')), letters);
+}
+
+__attribute__((target("avx2")))
+static inline int ascii_to_nibbles_avx2(__m256i c, __m256i *out)
+{
+    __m256i is_digit = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('0' - 1)),
+                                        _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), c));
+    __m256i lower = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+    __m256i is_alpha = _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)),
+                                        _mm256_cmpgt_epi8(_mm256_set1_epi8('f' + 1), lower));
+
+    if (_mm256_movemask_epi8(_mm256_or_si256(is_digit, is_alpha)) != -1) {
+        return 0;
+    }
+
+    __m256i digits = _mm256_and_si256(is_digit, _mm256_sub_epi8(c, _mm256_set1_epi8('0')));
+    __m256i alphas = _mm256_and_si256(is_alpha, _mm256_sub_epi8(lower, _mm256_set1_epi8('a' - 10)));
+    *out = _mm256_or_si256(digits, alphas);
+    return 1;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i join_nibbles_avx2(__m256i n)
+{
+    __m256i hi = _mm256_and_si256(n, _mm256_set1_epi16(0x00ff));
+    __m256i lo = _mm256_srli_epi16(n, 8);
+    return _mm256_or_si256(_mm256_slli_epi16(hi, 4), lo);
+}
+
+__attribute__((target("avx2")))
+static size_t hex_encode_avx2(char *hex, const uint8_t *bin, size_t len)
+{
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i b = _mm256_loadu_si256((const __m256i *) (bin + i));
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(b, 4), _mm256_set1_epi8(0x0f));
+        __m256i lo = _mm256_and_si256(b, _mm256_set1_epi8(0x0f));
+
+        /* unpack works within 128-bit lanes: lo_half holds bytes 0-7 and 16-23, hi_half 8-15 and 24-31 */
+        __m256i lo_half = nibbles_to_ascii_avx2(_mm256_unpacklo_epi8(hi, lo));
+        __m256i hi_half = nibbles_to_ascii_avx2(_mm256_unpackhi_epi8(hi, lo));
+
+        _mm256_storeu_si256((__m256i *) (hex + i * 2), _mm256_permute2x128_si256(lo_half, hi_half, 0x20));
+        _mm256_storeu_si256((__m256i *) (hex + i * 2 + 32), _mm256_permute2x128_si256(lo_half, hi_half, 0x31));
+    }
+
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t hex_decode_avx2(uint8_t *bin, const char *hex, size_t len)
+{
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i a;
+        __m256i b;
+
+        if (!ascii_to_nibbles_avx2(_mm256_loadu_si256((const __m256i *) (hex + i * 2)), &a)
+                || !ascii_to_nibbles_avx2(_mm256_loadu_si256((const __m256i *) (hex + i * 2 + 32)), &b)) {
+            return (size_t) -1;
+        }
+
+        /* packus interleaves the 128-bit lanes of a and b; put the quadwords back in order */
+        __m256i packed = _mm256_packus_epi16(join_nibbles_avx2(a), join_nibbles_avx2(b));
+        _mm256_storeu_si256((__m256i *) (bin + i), _mm256_permute4x64_epi64(packed, 0xd8));
+    }
+
+    return i;
+}
+
+#endif /* HEX_HAVE_AVX2 */
+
+void hex_encode(char *hex, const uint8_t *bin, size_t len)
+{
+    size_t done = 0;
+
+#ifdef HEX_HAVE_AVX2
+
+    if (len >= 32 && cpu_has_avx2()) {
+        done = hex_encode_avx2(hex, bin, len);
+    }
+
+#endif
+#ifdef HEX_HAVE_SSE2
+    done += hex_encode_sse2(hex + done * 2, bin + done, len - done);
+#endif
+
+    hex_encode_scalar(hex + done * 2, bin + done, len - done);
+    hex[len * 2] = '\0';
+}
+
+int hex_decode(uint8_t *bin, const char *hex, size_t len)
+{
+    size_t done = 0;
+    size_t n;
+
+#ifdef HEX_HAVE_AVX2
+
+    if (len >= 32 && cpu_has_avx2()) {
+        n = hex_decode_avx2(bin, hex, len);
+
+        if (n == (size_t) -1) {
+            return -1;
+        }
+
+        done = n;
+    }
+
+#endif
+#ifdef HEX_HAVE_SSE2
+    n = hex_decode_sse2(bin + done, hex + done * 2, len - done);
+
+    if (n == (size_t) -1) {
+        return -1;
+    }
+
+    done += n;
+#endif
+
+    (void) n;
+    return hex_decode_scalar(bin + done, hex + done * 2, len - done);
+}
+
+int hex_decode_str(uint8_t *bin, const char *hex, size_t len)
+{
+    if (strlen(hex) != len * 2) {
+        return -1;
+    }
+
+    return hex_decode(bin, hex, len);
+}
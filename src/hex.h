@@ -0,0 +1,53 @@
+/*  hex.h
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef HEX_H
+#define HEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Encodes len bytes of bin as exactly len * 2 uppercase hex digits followed by a
+ * null terminator. hex must have room for len * 2 + 1 bytes.
+ */
+void hex_encode(char *hex, const uint8_t *bin, size_t len);
+
+/*
+ * Decodes exactly len * 2 hex digits (either case) from hex into len bytes of bin.
+ * hex must point to at least len * 2 readable bytes.
+ *
+ * Returns 0 on success.
+ * Returns -1 if any of the len * 2 characters is not a hex digit. bin is left in an
+ * unspecified state.
+ */
+int hex_decode(uint8_t *bin, const char *hex, size_t len);
+
+/*
+ * Decodes the null terminated string hex, which must be exactly len * 2 hex digits long.
+ *
+ * Returns 0 on success.
+ * Returns -1 if hex has the wrong length or contains a character that is not a hex digit.
+ */
+int hex_decode_str(uint8_t *bin, const char *hex, size_t len);
+
+#endif /* HEX_H */
@@ -0,0 +1,300 @@
+/*  inbound.c
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L    /* strnlen() */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "event_loop.h"
+#include "inbound.h"
+#include "spool.h"
+#include "log.h"
+
+/*
+ * The queue is an intrusive multi-producer single-consumer list (Vyukov's algorithm):
+ * a producer links a node in with one atomic exchange, and the consumer, the thread
+ * that owns the Tox instance, unlinks nodes without ever taking a lock or waiting for a
+ * producer.
+ */
+struct Inbound_Node {
+    _Atomic(struct Inbound_Node *) next;
+};
+
+struct Inbound_Message {
+    struct Inbound_Node     node;      // must be first
+    uint64_t                seq;       // spool sequence number, or zero if not spooled
+    const char              *sender;
+    const char              *group;
+    const char              *text;
+    size_t                  length;
+    char                    data[];    // sender, group and text, each null terminated
+};
+
+static struct Inbound {
+    _Atomic(struct Inbound_Node *) head;   // last node pushed, shared by producers
+    struct Inbound_Node     *tail;         // next node to pop, consumer only
+    struct Inbound_Node     stub;
+    atomic_size_t           count;
+
+    /* only serialises producers, so that spool order and dispatch order are the same */
+    pthread_mutex_t         spool_lock;
+    struct Spool            spool;
+    bool                    spooled;
+
+    uint64_t                dispatched_seq;    // consumer only
+    uint64_t                committed_seq;
+} inbound = {
+    .head = &inbound.stub,
+    .tail = &inbound.stub,
+    .spool_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static struct Inbound_Message *message_new(const char *sender, size_t sender_len, const char *group,
+        size_t group_len, const char *text, size_t length)
+{
+    struct Inbound_Message *msg = malloc(sizeof(struct Inbound_Message) + sender_len + 1 + group_len + 1
+                                         + length + 1);
+
+    if (msg == NULL) {
+        return NULL;
+    }
+
+    char *s = msg->data;
+    memcpy(s, sender, sender_len);
+    s[sender_len] = '\0';
+    msg->sender = s;
+    s += sender_len + 1;
+
+    memcpy(s, group, group_len);
+    s[group_len] = '\0';
+    msg->group = s;
+    s += group_len + 1;
+
+    memcpy(s, text, length);
+    s[length] = '\0';
+    msg->text = s;
+
+    msg->length = length;
+    msg->seq = 0;
+
+    return msg;
+}
+
+static void queue_push(struct Inbound_Node *node)
+{
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    struct Inbound_Node *prev = atomic_exchange_explicit(&inbound.head, node, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+/*
+ * Unlinks the oldest node. Returns NULL if the queue is empty, or if the producer of the
+ * next node has not finished linking it in yet; that node is then popped on a later call.
+ * Only the consumer may call this.
+ */
+static struct Inbound_Node *queue_pop(void)
+{
+    struct Inbound_Node *tail = inbound.tail;
+    struct Inbound_Node *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    if (tail == &inbound.stub) {
+        if (next == NULL) {
+            return NULL;
+        }
+
+        inbound.tail = next;
+        tail = next;
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    }
+
+    if (next != NULL) {
+        inbound.tail = next;
+        return tail;
+    }
+
+    if (tail != atomic_load_explicit(&inbound.head, memory_order_acquire)) {
+        return NULL;
+    }
+
+    /* tail is the last node; push the stub behind it so that tail can be unlinked */
+    queue_push(&inbound.stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    if (next != NULL) {
+        inbound.tail = next;
+        return tail;
+    }
+
+    return NULL;
+}
+
+/* Spool records are the data of a message: sender and group, each null terminated, then the text */
+static void replay_record(void *userdata, uint64_t seq, const uint8_t *data, size_t length)
+{
+    (void) userdata;
+
+    const char *sender = (const char *) data;
+    size_t sender_len = strnlen(sender, length);
+
+    if (sender_len == length) {
+        return;
+    }
+
+    const char *group = sender + sender_len + 1;
+    size_t group_len = strnlen(group, length - sender_len - 1);
+
+    if (sender_len + 1 + group_len == length) {
+        return;
+    }
+
+    const char *text = group + group_len + 1;
+    size_t text_len = length - sender_len - 1 - group_len - 1;
+
+    struct Inbound_Message *msg = message_new(sender, sender_len, group, group_len, text, text_len);
+
+    if (msg == NULL) {
+        return;
+    }
+
+    msg->seq = seq;
+    atomic_fetch_add(&inbound.count, 1);
+    queue_push(&msg->node);
+}
+
+int inbound_init(const char *spool_dir)
+{
+    if (spool_dir == NULL) {
+        return 0;
+    }
+
+    if (spool_open(&inbound.spool, spool_dir) != 0) {
+        log_error_timestamp(-1, "Failed to open inbound spool %s, messages will not survive a restart", spool_dir);
+        return -1;
+    }
+
+    inbound.spooled = true;
+
+    int replayed = spool_replay(&inbound.spool, replay_record, NULL);
+
+    if (replayed > 0) {
+        log_timestamp("Replaying %d undelivered inbound bridge messages", replayed);
+    }
+
+    return 0;
+}
+
+void inbound_free(void)
+{
+    struct Inbound_Node *node;
+
+    while ((node = queue_pop()) != NULL) {
+        atomic_fetch_sub(&inbound.count, 1);
+        free(node);
+    }
+
+    if (inbound.spooled) {
+        spool_close(&inbound.spool);
+        inbound.spooled = false;
+    }
+
+    inbound.dispatched_seq = 0;
+    inbound.committed_seq = 0;
+}
+
+int inbound_post(const char *sender, const char *group, const char *text, size_t length)
+{
+    if (atomic_fetch_add(&inbound.count, 1) >= INBOUND_QUEUE_SIZE) {
+        atomic_fetch_sub(&inbound.count, 1);
+        log_timestamp("Inbound bridge queue full, dropping message");
+        return -1;
+    }
+
+    size_t sender_len = strlen(sender);
+    size_t group_len = strlen(group);
+    struct Inbound_Message *msg = message_new(sender, sender_len, group, group_len, text, length);
+
+    if (msg == NULL) {
+        atomic_fetch_sub(&inbound.count, 1);
+        log_error_timestamp(-1, "Failed to allocate inbound bridge message");
+        return -1;
+    }
+
+    if (inbound.spooled) {
+        pthread_mutex_lock(&inbound.spool_lock);
+        msg->seq = spool_append(&inbound.spool, msg->data, sender_len + 1 + group_len + 1 + length);
+        queue_push(&msg->node);
+        pthread_mutex_unlock(&inbound.spool_lock);
+    } else {
+        queue_push(&msg->node);
+    }
+
+    event_loop_wake();
+
+    return 0;
+}
+
+void inbound_sync(void)
+{
+    if (inbound.spooled) {
+        spool_sync(&inbound.spool);
+    }
+}
+
+void inbound_dispatch(inbound_cb *cb, void *userdata)
+{
+    struct Inbound_Node *node;
+
+    /* messages posted while dispatching wait for the next call, so busy producers cannot stall the caller */
+    size_t pending = atomic_load(&inbound.count);
+
+    while (pending-- > 0 && (node = queue_pop()) != NULL) {
+        struct Inbound_Message *msg = (struct Inbound_Message *) node;
+        atomic_fetch_sub(&inbound.count, 1);
+
+        cb(userdata, msg->seq, msg->sender, msg->group, msg->text, msg->length);
+
+        if (msg->seq != 0) {
+            inbound.dispatched_seq = msg->seq;
+        }
+
+        free(msg);
+    }
+}
+
+void inbound_commit(uint64_t held_seq)
+{
+    uint64_t seq = inbound.dispatched_seq;
+
+    if (held_seq != 0 && held_seq - 1 < seq) {
+        seq = held_seq - 1;
+    }
+
+    if (seq > inbound.committed_seq) {
+        spool_commit(&inbound.spool, seq);
+        inbound.committed_seq = seq;
+    }
+}
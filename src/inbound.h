@@ -0,0 +1,88 @@
+/*  inbound.h
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef INBOUND_H
+#define INBOUND_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Messages from bridge peers and scripts on their way to Tox. Toxcore is not thread
+ * safe, so threads other than the one that owns the Tox instance never call it: they
+ * post messages here instead, and the owning thread dispatches them in order. Posting
+ * wakes the event loop, so messages are dispatched as soon as they arrive rather than
+ * at the next tox_iterate(). The queue is lock-free for the dispatching thread.
+ *
+ * Posted messages are appended to a spool (see spool.h) and only committed once they
+ * have been dispatched and nothing queued for them is still held by the outbox (see
+ * inbound_commit()), so messages still waiting when toxbot is killed are dispatched
+ * again on the next start.
+ */
+
+/* Messages that have not been dispatched yet; further messages are dropped */
+#define INBOUND_QUEUE_SIZE 4096
+
+/* seq is the message's spool sequence number, or zero if it is not spooled */
+typedef void inbound_cb(void *userdata, uint64_t seq, const char *sender, const char *group, const char *text,
+                        size_t length);
+
+/*
+ * Opens the spool in spool_dir and queues any messages that were never dispatched.
+ * If spool_dir is NULL, or the spool cannot be opened, messages are only kept in memory.
+ *
+ * Returns 0 on success.
+ * Returns -1 if the spool could not be opened.
+ */
+int inbound_init(const char *spool_dir);
+
+/* Drops undispatched messages from memory and closes the spool. */
+void inbound_free(void);
+
+/*
+ * Queues a copy of a message for dispatch. text need not be null terminated.
+ *
+ * Returns 0 on success.
+ * Returns -1 if the message was dropped.
+ */
+int inbound_post(const char *sender, const char *group, const char *text, size_t length);
+
+/*
+ * Makes every message posted so far durable. Producers call this once after posting a
+ * burst of messages rather than after each one.
+ */
+void inbound_sync(void);
+
+/*
+ * Calls cb for each message queued before the call, in the order they were posted. Must
+ * only be called from the thread that owns the Tox instance.
+ */
+void inbound_dispatch(inbound_cb *cb, void *userdata);
+
+/*
+ * Commits every dispatched message whose sequence number is below held_seq, the oldest
+ * message that still has output waiting to be sent, or every dispatched message if
+ * held_seq is zero. Call from the dispatching thread after each outbox_flush().
+ */
+void inbound_commit(uint64_t held_seq);
+
+#endif /* INBOUND_H */
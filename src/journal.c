@@ -0,0 +1,220 @@
+/*  journal.c
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#define _POSIX_C_SOURCE 200809L    /* getline(), O_CLOEXEC */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "journal.h"
+#include "hex.h"
+#include "log.h"
+
+/* op, space, up to 20 digits of timestamp, space, key, newline */
+#define JOURNAL_LINE_MAX (1 + 1 + 20 + 1 + TOX_PUBLIC_KEY_SIZE * 2 + 1)
+
+int journal_init(struct Journal *j, const char *profile_path)
+{
+    *j = (struct Journal) {
+        .fd = -1,
+    };
+
+    if (snprintf(j->path, sizeof(j->path), "%s%s", profile_path, JOURNAL_SUFFIX) >= sizeof(j->path)
+            || snprintf(j->old_path, sizeof(j->old_path), "%s%s", profile_path, JOURNAL_OLD_SUFFIX) >= sizeof(j->old_path)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Parses one line. Returns false if it is not a complete, well formed entry. */
+static bool parse_line(const char *line, Journal_Op *op, uint8_t *public_key)
+{
+    char key[TOX_PUBLIC_KEY_SIZE * 2 + 1];
+    long long timestamp;
+    char c;
+
+    if (sscanf(line, "%c %lld %64s", &c, &timestamp, key) != 3 || strchr(line, '\n') == NULL) {
+        return false;
+    }
+
+    if (c != JOURNAL_FRIEND_ADD && c != JOURNAL_FRIEND_DELETE) {
+        return false;
+    }
+
+    *op = (Journal_Op) c;
+
+    return hex_decode_str(public_key, key, TOX_PUBLIC_KEY_SIZE) == 0;
+}
+
+static bool apply(Tox *m, Journal_Op op, const uint8_t *public_key)
+{
+    TOX_ERR_FRIEND_BY_PUBLIC_KEY err;
+    uint32_t friendnumber = tox_friend_by_public_key(m, public_key, &err);
+    bool exists = err == TOX_ERR_FRIEND_BY_PUBLIC_KEY_OK;
+
+    if (op == JOURNAL_FRIEND_ADD && !exists) {
+        TOX_ERR_FRIEND_ADD add_err;
+        tox_friend_add_norequest(m, public_key, &add_err);
+        return add_err == TOX_ERR_FRIEND_ADD_OK;
+    }
+
+    if (op == JOURNAL_FRIEND_DELETE && exists) {
+        return tox_friend_delete(m, friendnumber, NULL);
+    }
+
+    return false;
+}
+
+/* Replays the file at path. Returns the number of entries read and adds the changes made to changed. */
+static size_t replay_file(const char *path, Tox *m, size_t *changed)
+{
+    FILE *fp = fopen(path, "r");
+
+    if (fp == NULL) {
+        return 0;
+    }
+
+    char *line = NULL;
+    size_t size = 0;
+    size_t entries = 0;
+
+    while (getline(&line, &size, fp) != -1) {
+        Journal_Op op;
+        uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+
+        if (!parse_line(line, &op, public_key)) {
+            log_timestamp("Skipping malformed friend journal entry in %s", path);
+            continue;
+        }
+
+        ++entries;
+
+        if (apply(m, op, public_key)) {
+            ++*changed;
+        }
+    }
+
+    free(line);
+    fclose(fp);
+
+    return entries;
+}
+
+size_t journal_replay(struct Journal *j, Tox *m)
+{
+    size_t changed = 0;
+
+    replay_file(j->old_path, m, &changed);
+    j->entries = replay_file(j->path, m, &changed);
+
+    return changed;
+}
+
+static int journal_open(struct Journal *j)
+{
+    if (j->fd != -1) {
+        return 0;
+    }
+
+    j->fd = open(j->path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+
+    if (j->fd == -1) {
+        log_error_timestamp(errno, "Failed to open friend journal %s", j->path);
+        return -1;
+    }
+
+    /* end a line that a crash cut short, so that the next entry does not run into it */
+    off_t end = lseek(j->fd, 0, SEEK_END);
+    char last;
+
+    if (end > 0 && pread(j->fd, &last, 1, end - 1) == 1 && last != '\n' && write(j->fd, "\n", 1) != 1) {
+        log_error_timestamp(errno, "Failed to append to friend journal %s", j->path);
+        journal_close(j);
+        return -1;
+    }
+
+    return 0;
+}
+
+int journal_append(struct Journal *j, Journal_Op op, const uint8_t *public_key)
+{
+    if (journal_open(j) != 0) {
+        return -1;
+    }
+
+    char key[TOX_PUBLIC_KEY_SIZE * 2 + 1];
+    hex_encode(key, public_key, TOX_PUBLIC_KEY_SIZE);
+
+    char line[JOURNAL_LINE_MAX + 1];
+    int length = snprintf(line, sizeof(line), "%c %lld %s\n", (char) op, (long long) time(NULL), key);
+
+    if (write(j->fd, line, length) != length) {
+        log_error_timestamp(errno, "Failed to append to friend journal %s", j->path);
+        return -1;
+    }
+
+    ++j->entries;
+    return 0;
+}
+
+int journal_rotate(struct Journal *j)
+{
+    journal_close(j);
+
+    if (unlink(j->old_path) != 0 && errno != ENOENT) {
+        log_error_timestamp(errno, "Failed to remove friend journal %s", j->old_path);
+        return -1;
+    }
+
+    if (rename(j->path, j->old_path) != 0 && errno != ENOENT) {
+        log_error_timestamp(errno, "Failed to rotate friend journal %s", j->path);
+        return -1;
+    }
+
+    j->entries = 0;
+    return 0;
+}
+
+void journal_discard(struct Journal *j)
+{
+    journal_close(j);
+
+    unlink(j->path);
+    unlink(j->old_path);
+    j->entries = 0;
+}
+
+void journal_close(struct Journal *j)
+{
+    if (j->fd != -1) {
+        close(j->fd);
+        j->fd = -1;
+    }
+}
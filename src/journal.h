@@ -0,0 +1,101 @@
+/*  journal.h
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <tox/tox.h>
+
+/*
+ * An append-only log of friend list changes, kept next to the profile so that adding or
+ * deleting a friend costs one short line instead of a full profile save. Each line is
+ * the operation, a unix timestamp and the friend's public key in hex.
+ *
+ * Compaction moves the journal aside with journal_rotate() and takes a full snapshot.
+ * The rotated journal is only deleted by the next rotation, once the caller knows that
+ * snapshot is on disk. Replaying is idempotent, since each key ends up as its last entry
+ * left it, so a journal that the saved profile already covers can be replayed onto it
+ * without harm.
+ */
+
+#define JOURNAL_SUFFIX      ".journal"
+#define JOURNAL_OLD_SUFFIX  ".journal.old"
+
+typedef enum Journal_Op {
+    JOURNAL_FRIEND_ADD = 'A',
+    JOURNAL_FRIEND_DELETE = 'D',
+} Journal_Op;
+
+struct Journal {
+    char      path[PATH_MAX];
+    char      old_path[PATH_MAX];    // the journal set aside by the last rotation
+    int       fd;                    // -1 if closed
+    size_t    entries;               // lines in path
+};
+
+/*
+ * Sets up j for the profile saved in profile_path. Does not touch the files.
+ *
+ * Returns 0 on success.
+ * Returns -1 if the journal's paths are too long.
+ */
+int journal_init(struct Journal *j, const char *profile_path);
+
+/*
+ * Applies the rotated journal and then the current one to m. Lines that are cut short
+ * or malformed, e.g. by a crash in the middle of an append, are skipped.
+ *
+ * Returns the number of friends added or deleted.
+ */
+size_t journal_replay(struct Journal *j, Tox *m);
+
+/*
+ * Appends an entry for public_key. The line goes out in a single write to a file opened
+ * for appending, so it is never interleaved with or split by another entry.
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure, in which case the change should be saved some other way.
+ */
+int journal_append(struct Journal *j, Journal_Op op, const uint8_t *public_key);
+
+/*
+ * Deletes the previously rotated journal and moves the current one into its place. Call
+ * right before taking the snapshot that will cover it, and only once the snapshot taken
+ * at the previous rotation is on disk.
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure, leaving the journal as it was.
+ */
+int journal_rotate(struct Journal *j);
+
+/* Deletes both journals, e.g. after a synchronous save of the whole profile. */
+void journal_discard(struct Journal *j);
+
+/* Closes the journal file. */
+void journal_close(struct Journal *j);
+
+#endif /* JOURNAL_H */
@@ -30,12 +30,11 @@
 #define TIMESTAMP_SIZE 64
 #define MAX_MESSAGE_SIZE 512
 
-static struct tm *get_wall_time(void)
+/* localtime_r() because every profile thread logs */
+static struct tm *get_wall_time(struct tm *timeinfo)
 {
-    struct tm *timeinfo;
     time_t t = get_time();
-    timeinfo = localtime((const time_t *) &t);
-    return timeinfo;
+    return localtime_r(&t, timeinfo);
 }
 
 void log_timestamp(const char *message, ...)
@@ -47,8 +46,9 @@ void log_timestamp(const char *message, ...)
     vsnprintf(format, sizeof(format), message, args);
     va_end(args);
 
+    struct tm tm;
     char ts[TIMESTAMP_SIZE];
-    strftime(ts, TIMESTAMP_SIZE,"[%H:%M:%S]", get_wall_time());
+    strftime(ts, TIMESTAMP_SIZE,"[%H:%M:%S]", get_wall_time(&tm));
 
     printf("%s %s\n", ts, format);
 }
@@ -62,8 +62,9 @@ void log_error_timestamp(int err, const char *message, ...)
     vsnprintf(format, sizeof(format), message, args);
     va_end(args);
 
+    struct tm tm;
     char ts[TIMESTAMP_SIZE];
-    strftime(ts, TIMESTAMP_SIZE,"[%H:%M:%S]", get_wall_time());
+    strftime(ts, TIMESTAMP_SIZE,"[%H:%M:%S]", get_wall_time(&tm));
 
     fprintf(stderr, "%s %s (error %d)\n", ts, format, err);
 }
@@ -81,8 +82,9 @@ void logs(const char *message, ...)
     vsnprintf(text, sizeof(text), message, args);
     va_end(args);
 
+    struct tm tm;
     char ts[TIMESTAMP_SIZE];
-    strftime(ts, TIMESTAMP_SIZE,"[%H:%M:%S]", get_wall_time());
+    strftime(ts, TIMESTAMP_SIZE,"[%H:%M:%S]", get_wall_time(&tm));
 
     size_t len = strlen(text);
     if (len < short_text_length) {
@@ -20,7 +20,12 @@
  *
  */
 
+#define _POSIX_C_SOURCE 200809L    /* O_CLOEXEC, posix_madvise() */
+
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -41,49 +46,91 @@ time_t get_time(void)
     return time(NULL);
 }
 
-char *hex_string_to_bin(const char *hex_string)
+off_t file_size(const char *path)
 {
-    size_t len = strlen(hex_string);
-    char *val = malloc(len);
+    struct stat st;
 
-    if (val == NULL) {
-        exit(EXIT_FAILURE);
+    if (stat(path, &st) == -1) {
+        return 0;
     }
 
-    for (size_t i = 0; i < len; ++i, hex_string += 2) {
-        sscanf(hex_string, "%2hhx", &val[i]);
-    }
+    return st.st_size;
+}
 
-    return val;
+bool file_exists(const char *path)
+{
+    struct stat s;
+    return stat(path, &s) == 0;
 }
-size_t hex_string_to_bin2(const char *hex_string, char *val)
+
+static uint8_t *read_all(int fd, size_t length)
 {
-    size_t len = strlen(hex_string);
+    uint8_t *data = malloc(length);
 
-    int i=0;
-    for (; i < len; ++i, hex_string += 2) {
-        sscanf(hex_string, "%2hhx", &val[i]);
+    if (data == NULL) {
+        return NULL;
     }
-    val[i] = '\0';
 
-    return len;
+    size_t done = 0;
+
+    while (done < length) {
+        ssize_t n = read(fd, data + done, length - done);
+
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            free(data);
+            return NULL;
+        }
+
+        done += n;
+    }
+
+    return data;
 }
 
-off_t file_size(const char *path)
+int file_map(struct File_Map *map, const char *path)
 {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1) {
+        return -1;
+    }
+
     struct stat st;
 
-    if (stat(path, &st) == -1) {
-        return 0;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return -1;
     }
 
-    return st.st_size;
+    map->length = st.st_size;
+    map->data = mmap(NULL, map->length, PROT_READ, MAP_PRIVATE, fd, 0);
+    map->mapped = map->data != MAP_FAILED;
+
+    if (map->mapped) {
+        posix_madvise(map->data, map->length, POSIX_MADV_SEQUENTIAL);
+    } else {
+        map->data = read_all(fd, map->length);
+    }
+
+    close(fd);
+
+    return map->data != NULL ? 0 : -1;
 }
 
-bool file_exists(const char *path)
+void file_unmap(struct File_Map *map)
 {
-    struct stat s;
-    return stat(path, &s) == 0;
+    if (map->mapped) {
+        munmap(map->data, map->length);
+    } else {
+        free(map->data);
+    }
+
+    map->data = NULL;
+    map->length = 0;
 }
 
 uint16_t copy_tox_str(char *msg, size_t size, const char *data, uint16_t length)
@@ -107,71 +154,76 @@ int char_find(int idx, const char *s, char ch)
     return i;
 }
 
-void get_elapsed_time_str(char *buf, int bufsize, uint64_t secs)
-{
-    long unsigned int minutes = (secs % 3600) / 60;
-    long unsigned int hours = (secs / 3600) % 24;
-    long unsigned int days = (secs / 3600) / 24;
-
-    snprintf(buf, bufsize, "%lud %luh %lum", days, hours, minutes);
-}
-
 /*
- * Searches plain text file pointed to by path for lines that match public_key.
- *
- * Returns 1 if a match is found.
- * Returns 0 if a match is not found.
- * Returns -1 on file operation failure.
- *
- * public_key must be a binary representation of a Tox public key.
+ * Finds the last run of ch in s[min, max). Puts the offset just after it in end and
+ * returns its length, or returns 0 if ch does not occur.
  */
-int file_contains_key(const char *public_key, const char *path)
+static size_t find_break(const char *s, size_t min, size_t max, char ch, size_t *end)
 {
-    FILE *fp = NULL;
-
-    struct stat s;
+    for (size_t i = max; i > min; --i) {
+        if (s[i - 1] == ch) {
+            *end = i;
+            size_t start = i - 1;
 
-    if (stat(path, &s) != 0) {
-        FILE *fp = fopen(path, "w");
+            while (start > min && s[start - 1] == ch) {
+                --start;
+            }
 
-        if (fp == NULL) {
-            fprintf(stderr, "Warning: failed to create '%s' file\n", path);
-            return -1;
+            return i - start;
         }
-
-        fprintf(stderr, "Warning: creating new '%s' file. Did you lose the old one?\n", path);
-        fclose(fp);
-        return 0;
     }
 
-    fp = fopen(path, "r");
+    return 0;
+}
 
-    if (fp == NULL) {
-        fprintf(stderr, "Warning: failed to read '%s' file\n", path);
-        return -1;
+size_t utf8_split(const char *s, size_t length, size_t max, size_t *next)
+{
+    if (length <= max) {
+        *next = length;
+        return length;
     }
 
-    char id[256];
+    size_t end;
+    char ch = '\n';
+    size_t run = find_break(s, max / 2, max, ch, &end);
 
-    while (fgets(id, sizeof(id), fp)) {
-        int len = strlen(id);
+    if (run == 0) {
+        ch = ' ';
+        run = find_break(s, max / 2, max, ch, &end);
+    }
 
-        if (--len < TOX_PUBLIC_KEY_SIZE) {
-            continue;
+    if (run > 0) {
+        size_t cut = end - run;
+
+        while (end < length && s[end] == ch) {
+            ++end;
         }
 
-        char *key_bin = hex_string_to_bin(id);
+        *next = end;
+        return cut;
+    }
 
-        if (memcmp(key_bin, public_key, TOX_PUBLIC_KEY_SIZE) == 0) {
-            free(key_bin);
-            fclose(fp);
-            return 1;
-        }
+    /* back off over continuation bytes; invalid input with no lead byte nearby is cut at max */
+    size_t cut = max;
 
-        free(key_bin);
+    while (cut > 0 && max - cut < 3 && ((uint8_t) s[cut] & 0xC0) == 0x80) {
+        --cut;
     }
 
-    fclose(fp);
-    return 0;
+    if (cut == 0 || ((uint8_t) s[cut] & 0xC0) == 0x80) {
+        cut = max;
+    }
+
+    *next = cut;
+    return cut;
+}
+
+void get_elapsed_time_str(char *buf, int bufsize, uint64_t secs)
+{
+    long unsigned int minutes = (secs % 3600) / 60;
+    long unsigned int hours = (secs / 3600) % 24;
+    long unsigned int days = (secs / 3600) / 24;
+
+    snprintf(buf, bufsize, "%lud %luh %lum", days, hours, minutes);
 }
 
@@ -41,16 +41,31 @@ bool timed_out(time_t timestamp, time_t curtime, uint64_t timeout);
 /* Returns current unix timestamp */
 time_t get_time(void);
 
-/* converts hexidecimal string to binary */
-char *hex_string_to_bin(const char *hex_string);
-size_t hex_string_to_bin2(const char *hex_string, char *val);
-
 /* returns file size or 0 on error */
 off_t file_size(const char *path);
 
 /* Return true if a file exists at `path`. */
 bool file_exists(const char *path);
 
+struct File_Map {
+    uint8_t  *data;
+    size_t   length;
+    bool     mapped;    // false if the file was read into the heap instead
+};
+
+/*
+ * Maps the file at path read-only for a single front to back pass. Files that can't
+ * be mapped are read into the heap instead.
+ *
+ * Returns 0 on success.
+ * Returns -1 if the file can't be opened or read, or is empty.
+ *
+ * Release the contents with file_unmap().
+ */
+int file_map(struct File_Map *map, const char *path);
+
+void file_unmap(struct File_Map *map);
+
 /* copies data to msg buffer.
    returns length of msg, which will be no larger than size-1 */
 uint16_t copy_tox_str(char *msg, size_t size, const char *data, uint16_t length);
@@ -59,19 +74,18 @@ uint16_t copy_tox_str(char *msg, size_t size, const char *data, uint16_t length)
    returns length of s if char not found */
 int char_find(int idx, const char *s, char ch);
 
-/* Converts seconds to string in format days hours minutes */
-void get_elapsed_time_str(char *buf, int bufsize, uint64_t secs);
-
 /*
- * Searches plain text file pointed to by path for lines that match public_key.
- *
- * Returns 1 if a match is found.
- * Returns 0 if a match is not found.
- * Returns -1 on file operation failure.
+ * Splits the UTF-8 text s of length bytes into parts of at most max bytes.
  *
- * public_key must be a binary representation of a Tox public key.
+ * Returns the length of the first part and puts the offset where the rest starts in
+ * next. A part ends before a newline in the second half of the allowed length if there
+ * is one, otherwise before a space, otherwise on a character boundary, so multi-byte
+ * characters are never cut. The newlines or spaces at the break are dropped.
  */
-int file_contains_key(const char *public_key, const char *path);
+size_t utf8_split(const char *s, size_t length, size_t max, size_t *next);
+
+/* Converts seconds to string in format days hours minutes */
+void get_elapsed_time_str(char *buf, int bufsize, uint64_t secs);
 
 #endif /* MISC_H */
 
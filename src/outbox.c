@@ -0,0 +1,476 @@
+/*  outbox.c
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L    /* clock_gettime() */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "outbox.h"
+#include "misc.h"
+#include "log.h"
+
+/* Token buckets count in thousandths so that refills of a few milliseconds are not lost */
+#define TOKEN 1000
+
+struct Outbox_Part {
+    struct Outbox_Part  *next;
+    uint64_t            queued_at;
+    uint64_t            seq;    // inbound spool sequence number, or zero
+    size_t              length;
+    char                data[];
+};
+
+struct Outbox_Target {
+    bool                active;
+    Outbox_Type         type;
+    uint32_t            number;
+
+    struct Outbox_Part  *head;
+    struct Outbox_Part  *tail;
+    size_t              count;
+
+    uint64_t            message_tokens;
+    uint64_t            byte_tokens;
+    uint64_t            last_refill;    // all times are CLOCK_MONOTONIC milliseconds
+    uint64_t            last_send;
+    uint64_t            retry_at;
+    bool                held;           // the target is gone or disconnected
+};
+
+/* Each thread that runs a Tox instance has an outbox of its own */
+static _Thread_local struct Outbox {
+    uint32_t              message_rate;
+    uint32_t              byte_rate;
+    outbox_lost_cb        *lost_cb;
+    uint64_t              seq;    // tag for parts queued from now on
+
+    struct Outbox_Target  targets[OUTBOX_MAX_TARGETS];
+} outbox = {
+    .message_rate = OUTBOX_DEFAULT_MESSAGE_RATE,
+    .byte_rate = OUTBOX_DEFAULT_BYTE_RATE,
+};
+
+typedef enum Send_Result {
+    SEND_OK,
+    SEND_RETRY,    // toxcore's send queue is full
+    SEND_LOST,     // the target is gone or disconnected
+    SEND_DROP,     // the message itself was rejected
+} Send_Result;
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t message_capacity(void)
+{
+    return (uint64_t) outbox.message_rate * TOKEN;
+}
+
+/* A bucket always holds enough for one full part, however low the rate */
+static uint64_t byte_capacity(void)
+{
+    return (uint64_t) MAX(outbox.byte_rate, TOX_MAX_MESSAGE_LENGTH) * TOKEN;
+}
+
+static struct Outbox_Target *target_find(Outbox_Type type, uint32_t number)
+{
+    for (size_t i = 0; i < OUTBOX_MAX_TARGETS; ++i) {
+        struct Outbox_Target *t = &outbox.targets[i];
+
+        if (t->active && t->type == type && t->number == number) {
+            return t;
+        }
+    }
+
+    return NULL;
+}
+
+static struct Outbox_Target *target_get(Outbox_Type type, uint32_t number)
+{
+    struct Outbox_Target *t = target_find(type, number);
+
+    if (t != NULL) {
+        return t;
+    }
+
+    for (size_t i = 0; i < OUTBOX_MAX_TARGETS; ++i) {
+        t = &outbox.targets[i];
+
+        if (!t->active) {
+            uint64_t now = now_ms();
+
+            *t = (struct Outbox_Target) {
+                .active = true,
+                .type = type,
+                .number = number,
+                .message_tokens = message_capacity(),
+                .byte_tokens = byte_capacity(),
+                .last_refill = now,
+                .last_send = now,
+            };
+
+            return t;
+        }
+    }
+
+    return NULL;
+}
+
+static void target_pop(struct Outbox_Target *t)
+{
+    struct Outbox_Part *part = t->head;
+    t->head = part->next;
+
+    if (t->head == NULL) {
+        t->tail = NULL;
+    }
+
+    --t->count;
+    free(part);
+}
+
+static void target_push(struct Outbox_Target *t, struct Outbox_Part *part)
+{
+    if (t->count >= OUTBOX_MAX_QUEUED) {
+        log_timestamp("Outbox for %s %u full, dropping oldest message",
+                      t->type == OUTBOX_GROUP ? "group" : "conference", t->number);
+        target_pop(t);
+    }
+
+    part->next = NULL;
+
+    if (t->tail != NULL) {
+        t->tail->next = part;
+    } else {
+        t->head = part;
+    }
+
+    t->tail = part;
+    ++t->count;
+}
+
+static void target_clear(struct Outbox_Target *t)
+{
+    while (t->head != NULL) {
+        target_pop(t);
+    }
+
+    t->active = false;
+}
+
+static void target_refill(struct Outbox_Target *t, uint64_t now)
+{
+    uint64_t elapsed = now - t->last_refill;
+    t->last_refill = now;
+
+    /* rate tokens per second is rate thousandths per millisecond */
+    t->message_tokens = MIN(t->message_tokens + elapsed * outbox.message_rate, message_capacity());
+    t->byte_tokens = MIN(t->byte_tokens + elapsed * outbox.byte_rate, byte_capacity());
+}
+
+static bool target_can_send(const struct Outbox_Target *t, size_t length)
+{
+    if (outbox.message_rate > 0 && t->message_tokens < TOKEN) {
+        return false;
+    }
+
+    if (outbox.byte_rate > 0 && t->byte_tokens < length * TOKEN) {
+        return false;
+    }
+
+    return true;
+}
+
+static Send_Result send_part(Tox *m, const struct Outbox_Target *t, const struct Outbox_Part *part)
+{
+    if (t->type == OUTBOX_GROUP) {
+        Tox_Err_Group_Send_Message err;
+        tox_group_send_message(m, t->number, TOX_MESSAGE_TYPE_NORMAL, (const uint8_t *) part->data, part->length, &err);
+
+        switch (err) {
+            case TOX_ERR_GROUP_SEND_MESSAGE_OK:
+                return SEND_OK;
+
+            case TOX_ERR_GROUP_SEND_MESSAGE_FAIL_SEND:
+                return SEND_RETRY;
+
+            case TOX_ERR_GROUP_SEND_MESSAGE_GROUP_NOT_FOUND:
+            case TOX_ERR_GROUP_SEND_MESSAGE_DISCONNECTED:
+                logs("failed to send msg to group: %s", tox_err_group_send_message_to_string(err));
+                return SEND_LOST;
+
+            default:
+                logs("failed to send msg to group: %s", tox_err_group_send_message_to_string(err));
+                return SEND_DROP;
+        }
+    }
+
+    Tox_Err_Conference_Send_Message err;
+    tox_conference_send_message(m, t->number, TOX_MESSAGE_TYPE_NORMAL, (const uint8_t *) part->data, part->length, &err);
+
+    switch (err) {
+        case TOX_ERR_CONFERENCE_SEND_MESSAGE_OK:
+            return SEND_OK;
+
+        case TOX_ERR_CONFERENCE_SEND_MESSAGE_FAIL_SEND:
+            return SEND_RETRY;
+
+        case TOX_ERR_CONFERENCE_SEND_MESSAGE_CONFERENCE_NOT_FOUND:
+        case TOX_ERR_CONFERENCE_SEND_MESSAGE_NO_CONNECTION:
+            log_timestamp("failed send conference msg: %s", tox_err_conference_send_message_to_string(err));
+            return SEND_LOST;
+
+        default:
+            log_timestamp("failed send conference msg: %s", tox_err_conference_send_message_to_string(err));
+            return SEND_DROP;
+    }
+}
+
+/* Drops messages that have waited too long; the queue is in arrival order, so they are at the head */
+static void target_expire(struct Outbox_Target *t, uint64_t now)
+{
+    size_t expired = 0;
+
+    while (t->head != NULL && now - t->head->queued_at > OUTBOX_MAX_AGE * 1000) {
+        target_pop(t);
+        ++expired;
+    }
+
+    if (expired > 0) {
+        log_timestamp("Outbox for %s %u dropped %zu stale messages",
+                      t->type == OUTBOX_GROUP ? "group" : "conference", t->number, expired);
+    }
+}
+
+static void target_flush(Tox *m, struct Outbox_Target *t, uint64_t now, void *userdata)
+{
+    target_refill(t, now);
+    target_expire(t, now);
+
+    if (now < t->retry_at) {
+        return;
+    }
+
+    while (t->head != NULL && target_can_send(t, t->head->length)) {
+        switch (send_part(m, t, t->head)) {
+            case SEND_OK: {
+                if (t->held) {
+                    log_timestamp("Outbox for %s %u is sending again, %zu messages queued",
+                                  t->type == OUTBOX_GROUP ? "group" : "conference", t->number, t->count - 1);
+                    t->held = false;
+                }
+
+                if (outbox.message_rate > 0) {
+                    t->message_tokens -= TOKEN;
+                }
+
+                if (outbox.byte_rate > 0) {
+                    t->byte_tokens -= t->head->length * TOKEN;
+                }
+
+                t->last_send = now;
+                target_pop(t);
+                break;
+            }
+
+            case SEND_RETRY: {
+                t->retry_at = now + OUTBOX_RETRY_MS;
+                return;
+            }
+
+            case SEND_LOST: {
+                t->retry_at = now + OUTBOX_LOST_RETRY_MS;
+
+                if (!t->held) {
+                    t->held = true;
+
+                    if (outbox.lost_cb != NULL) {
+                        outbox.lost_cb(m, t->type, t->number, userdata);
+                    }
+                }
+
+                return;
+            }
+
+            case SEND_DROP: {
+                target_pop(t);
+                break;
+            }
+        }
+    }
+}
+
+void outbox_init(uint32_t message_rate, uint32_t byte_rate, outbox_lost_cb *lost_cb)
+{
+    outbox.message_rate = message_rate;
+    outbox.byte_rate = byte_rate;
+    outbox.lost_cb = lost_cb;
+}
+
+void outbox_free(void)
+{
+    for (size_t i = 0; i < OUTBOX_MAX_TARGETS; ++i) {
+        target_clear(&outbox.targets[i]);
+    }
+}
+
+int outbox_queue(Outbox_Type type, uint32_t number, const char *text, size_t length)
+{
+    struct Outbox_Target *t = target_get(type, number);
+
+    if (t == NULL) {
+        log_timestamp("Too many outbox targets, dropping message");
+        return -1;
+    }
+
+    uint64_t now = now_ms();
+    size_t next;
+
+    for (size_t off = 0; off < length; off += next) {
+        size_t len = utf8_split(text + off, length - off, TOX_MAX_MESSAGE_LENGTH, &next);
+
+        if (len == 0) {
+            continue;
+        }
+
+        struct Outbox_Part *part = malloc(sizeof(struct Outbox_Part) + len);
+
+        if (part == NULL) {
+            log_error_timestamp(-1, "Failed to allocate outbox message");
+            return -1;
+        }
+
+        memcpy(part->data, text + off, len);
+        part->length = len;
+        part->queued_at = now;
+        part->seq = outbox.seq;
+        target_push(t, part);
+    }
+
+    return 0;
+}
+
+void outbox_set_seq(uint64_t seq)
+{
+    outbox.seq = seq;
+}
+
+void outbox_move(Outbox_Type type, uint32_t from, uint32_t to)
+{
+    if (from == to) {
+        return;
+    }
+
+    struct Outbox_Target *src = target_find(type, from);
+
+    if (src == NULL) {
+        return;
+    }
+
+    struct Outbox_Target *dst = target_find(type, to);
+
+    if (dst == NULL) {
+        src->number = to;
+        src->retry_at = 0;
+        src->held = false;
+        return;
+    }
+
+    while (src->head != NULL) {
+        struct Outbox_Part *part = src->head;
+        src->head = part->next;
+        target_push(dst, part);
+    }
+
+    src->tail = NULL;
+    src->count = 0;
+    src->active = false;
+}
+
+void outbox_resume(Outbox_Type type, uint32_t number)
+{
+    struct Outbox_Target *t = target_find(type, number);
+
+    if (t != NULL && t->held) {
+        t->retry_at = 0;
+    }
+}
+
+void outbox_flush(Tox *m, void *userdata)
+{
+    uint64_t now = now_ms();
+
+    for (size_t i = 0; i < OUTBOX_MAX_TARGETS; ++i) {
+        struct Outbox_Target *t = &outbox.targets[i];
+
+        if (!t->active) {
+            continue;
+        }
+
+        target_flush(m, t, now, userdata);
+
+        /* an idle target's bucket is full again after a second, so its slot can be reused */
+        if (t->head == NULL && now - t->last_send >= 1000) {
+            t->active = false;
+        }
+    }
+}
+
+size_t outbox_pending(void)
+{
+    size_t pending = 0;
+
+    for (size_t i = 0; i < OUTBOX_MAX_TARGETS; ++i) {
+        pending += outbox.targets[i].count;
+    }
+
+    return pending;
+}
+
+uint64_t outbox_oldest_seq(void)
+{
+    uint64_t oldest = 0;
+
+    /* outbox_move() can put older parts behind newer ones, so look at every part */
+    for (size_t i = 0; i < OUTBOX_MAX_TARGETS; ++i) {
+        const struct Outbox_Target *t = &outbox.targets[i];
+
+        if (!t->active) {
+            continue;
+        }
+
+        for (const struct Outbox_Part *part = t->head; part != NULL; part = part->next) {
+            if (part->seq != 0 && (oldest == 0 || part->seq < oldest)) {
+                oldest = part->seq;
+            }
+        }
+    }
+
+    return oldest;
+}
@@ -0,0 +1,122 @@
+/*  outbox.h
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef OUTBOX_H
+#define OUTBOX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <tox/tox.h>
+
+/*
+ * Outgoing NGC group and conference messages are queued per target and sent from the
+ * main loop by outbox_flush(). Each target has a token bucket that refills at a
+ * configured number of messages and bytes per second and holds at most one second of
+ * either, so bursts are smoothed instead of overrunning toxcore's send queue.
+ *
+ * A message that toxcore fails to send stays at the head of its queue and is retried
+ * after OUTBOX_RETRY_MS if the send queue was full. If the target is gone or
+ * disconnected, the lost callback is called and the target is held: its messages keep
+ * queueing, and are only retried every OUTBOX_LOST_RETRY_MS until outbox_resume() says
+ * the target is back, at which point the backlog goes out in order. Messages that have
+ * waited longer than OUTBOX_MAX_AGE seconds are discarded rather than sent late.
+ *
+ * Parts can be tagged with the spool sequence number of the inbound message they came
+ * from (see inbound.h). outbox_oldest_seq() reports the oldest one still queued, so the
+ * inbound spool is only committed past a message once all of its parts are gone.
+ *
+ * The outbox belongs to the calling thread, like the Tox instance it sends through.
+ */
+
+#define OUTBOX_DEFAULT_MESSAGE_RATE 5
+#define OUTBOX_DEFAULT_BYTE_RATE    (16 * 1024)
+
+#define OUTBOX_MAX_TARGETS   16
+#define OUTBOX_MAX_QUEUED    1024    // parts per target; the oldest is dropped beyond this
+#define OUTBOX_RETRY_MS      500
+#define OUTBOX_LOST_RETRY_MS 5000
+#define OUTBOX_MAX_AGE       600
+
+typedef enum Outbox_Type {
+    OUTBOX_GROUP,
+    OUTBOX_CONFERENCE,
+} Outbox_Type;
+
+/*
+ * Called when a target rejects a message because it no longer exists or is disconnected.
+ * userdata is what was passed to outbox_flush().
+ */
+typedef void outbox_lost_cb(Tox *m, Outbox_Type type, uint32_t number, void *userdata);
+
+/*
+ * Sets the send rate of every target. A rate of zero means unlimited.
+ * lost_cb may be NULL.
+ */
+void outbox_init(uint32_t message_rate, uint32_t byte_rate, outbox_lost_cb *lost_cb);
+
+/* Drops every queued message. */
+void outbox_free(void);
+
+/*
+ * Queues length bytes of text for target number of the given type, split into parts of
+ * at most TOX_MAX_MESSAGE_LENGTH with utf8_split().
+ *
+ * Returns 0 on success.
+ * Returns -1 if the message could not be queued.
+ */
+int outbox_queue(Outbox_Type type, uint32_t number, const char *text, size_t length);
+
+/*
+ * Tags the parts queued by every following outbox_queue() call with seq, until it is
+ * called again. Zero means untagged.
+ */
+void outbox_set_seq(uint64_t seq);
+
+/*
+ * Appends the messages queued for target from to those queued for target to, e.g. after
+ * rejoining a group gave it a new number.
+ */
+void outbox_move(Outbox_Type type, uint32_t from, uint32_t to);
+
+/*
+ * Releases a held target, e.g. from the group self join or conference connected
+ * callbacks, so that its backlog is sent by the next outbox_flush().
+ */
+void outbox_resume(Outbox_Type type, uint32_t number);
+
+/*
+ * Sends as many queued messages as the token buckets allow. Call from the loop that
+ * iterates m.
+ */
+void outbox_flush(Tox *m, void *userdata);
+
+/* Returns the number of message parts waiting to be sent. */
+size_t outbox_pending(void);
+
+/*
+ * Returns the lowest sequence number a queued part is tagged with, or zero if no tagged
+ * part is waiting. Parts leave the queue when they are sent, expire or are dropped.
+ */
+uint64_t outbox_oldest_seq(void);
+
+#endif /* OUTBOX_H */
@@ -0,0 +1,258 @@
+/*  snapshot.c
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "snapshot.h"
+#include "log.h"
+
+static struct Snapshots {
+    pthread_mutex_t  lock;
+    pthread_cond_t   cond;
+    struct Snapshot  *list;
+    pthread_t        thread;
+    bool             running;
+    bool             stopping;
+} snapshots = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* Syncs the directory that holds path, so a rename into it survives a crash */
+static void sync_parent_dir(const char *path)
+{
+    char dir[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+
+    if (slash == NULL) {
+        snprintf(dir, sizeof(dir), ".");
+    } else {
+        snprintf(dir, sizeof(dir), "%.*s", (int) (slash - path) + 1, path);
+    }
+
+    int fd = open(dir, O_RDONLY);
+
+    if (fd != -1) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+int snapshot_write_file(const char *path, const uint8_t *data, size_t length)
+{
+    char tmp_path[PATH_MAX];
+
+    if (path == NULL || snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= sizeof(tmp_path)) {
+        goto on_error;
+    }
+
+    FILE *fp = fopen(tmp_path, "wb");
+
+    if (fp == NULL) {
+        goto on_error;
+    }
+
+    if (fwrite(data, length, 1, fp) != 1 || fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+        fclose(fp);
+        remove(tmp_path);
+        goto on_error;
+    }
+
+    if (fclose(fp) != 0 || rename(tmp_path, path) != 0) {
+        remove(tmp_path);
+        goto on_error;
+    }
+
+    sync_parent_dir(path);
+    return 0;
+
+on_error:
+    log_error_timestamp(-1, "Warning: save_data failed");
+    return -1;
+}
+
+static struct Snapshot *find_pending(void)
+{
+    for (struct Snapshot *snap = snapshots.list; snap != NULL; snap = snap->next) {
+        if (snap->pending != -1) {
+            return snap;
+        }
+    }
+
+    return NULL;
+}
+
+static void *writer_thread(void *arg)
+{
+    (void) arg;
+
+    pthread_mutex_lock(&snapshots.lock);
+
+    while (true) {
+        struct Snapshot *snap = find_pending();
+
+        if (snap == NULL) {
+            if (snapshots.stopping) {
+                break;
+            }
+
+            pthread_cond_wait(&snapshots.cond, &snapshots.lock);
+            continue;
+        }
+
+        snap->writing = snap->pending;
+        snap->pending = -1;
+
+        const struct Snapshot_Buffer *buf = &snap->buffers[snap->writing];
+
+        pthread_mutex_unlock(&snapshots.lock);
+
+        bool written = snapshot_write_file(snap->path, buf->data, buf->length) == 0;
+
+        pthread_mutex_lock(&snapshots.lock);
+        snap->writing = -1;
+
+        if (written) {
+            snap->written = buf->seq;
+        }
+    }
+
+    pthread_mutex_unlock(&snapshots.lock);
+
+    return NULL;
+}
+
+int snapshot_init(void)
+{
+    snapshots.stopping = false;
+
+    if (pthread_create(&snapshots.thread, NULL, writer_thread, NULL) != 0) {
+        log_error_timestamp(-1, "Failed to create snapshot writer thread");
+        return -1;
+    }
+
+    snapshots.running = true;
+    return 0;
+}
+
+void snapshot_kill(void)
+{
+    if (!snapshots.running) {
+        return;
+    }
+
+    pthread_mutex_lock(&snapshots.lock);
+    snapshots.stopping = true;
+    pthread_cond_signal(&snapshots.cond);
+    pthread_mutex_unlock(&snapshots.lock);
+
+    pthread_join(snapshots.thread, NULL);
+    snapshots.running = false;
+}
+
+void snapshot_add(struct Snapshot *snap, const char *path)
+{
+    *snap = (struct Snapshot) {
+        .path = path,
+        .pending = -1,
+        .writing = -1,
+        .next = snapshots.list,
+    };
+
+    snapshots.list = snap;
+}
+
+void snapshot_free(struct Snapshot *snap)
+{
+    for (size_t i = 0; i < 2; ++i) {
+        free(snap->buffers[i].data);
+        snap->buffers[i] = (struct Snapshot_Buffer) {
+            0
+        };
+    }
+}
+
+int snapshot_save(struct Snapshot *snap, Tox *m)
+{
+    pthread_mutex_lock(&snapshots.lock);
+
+    /* take whichever buffer the writer does not have; a copy still waiting in it is out of date */
+    int idx = snap->writing == 0 ? 1 : 0;
+
+    if (snap->pending == idx) {
+        snap->pending = -1;
+    }
+
+    pthread_mutex_unlock(&snapshots.lock);
+
+    struct Snapshot_Buffer *buf = &snap->buffers[idx];
+    size_t length = tox_get_savedata_size(m);
+
+    if (length > buf->size) {
+        uint8_t *data = realloc(buf->data, length);
+
+        if (data == NULL) {
+            log_error_timestamp(-1, "Failed to allocate snapshot buffer");
+            return -1;
+        }
+
+        buf->data = data;
+        buf->size = length;
+    }
+
+    tox_get_savedata(m, buf->data);
+    buf->length = length;
+    buf->seq = ++snap->taken;
+
+    if (!snapshots.running) {
+        if (snapshot_write_file(snap->path, buf->data, buf->length) != 0) {
+            return -1;
+        }
+
+        snap->written = buf->seq;
+        return 0;
+    }
+
+    pthread_mutex_lock(&snapshots.lock);
+    snap->pending = idx;
+    pthread_cond_signal(&snapshots.cond);
+    pthread_mutex_unlock(&snapshots.lock);
+
+    return 0;
+}
+
+uint64_t snapshot_written(struct Snapshot *snap)
+{
+    pthread_mutex_lock(&snapshots.lock);
+    uint64_t written = snap->written;
+    pthread_mutex_unlock(&snapshots.lock);
+
+    return written;
+}
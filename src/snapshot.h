@@ -0,0 +1,103 @@
+/*  snapshot.h
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <tox/tox.h>
+
+/*
+ * Profile saves are split in two. snapshot_save() copies the savedata into one of the
+ * profile's two buffers on the Tox thread, which is all the Tox thread pays for, and a
+ * single writer thread writes the buffer out with snapshot_write_file() while the other
+ * buffer takes the next copy. If a copy is still waiting when the next one is made, the
+ * newer one replaces it, so the writer never falls behind by more than one save.
+ *
+ * The buffers are kept between saves and only grow, so saving a profile of a steady size
+ * does not allocate.
+ */
+
+struct Snapshot_Buffer {
+    uint8_t  *data;
+    size_t   size;      // allocated
+    size_t   length;    // used by the copy
+    uint64_t seq;       // the copy's number, see struct Snapshot
+};
+
+struct Snapshot {
+    const char              *path;
+    struct Snapshot_Buffer  buffers[2];
+    int                     pending;    // the buffer waiting for the writer, or -1
+    int                     writing;    // the buffer the writer has, or -1
+    uint64_t                taken;      // copies made so far; the latest copy's number
+    uint64_t                written;    // the number of the latest copy that is on disk
+
+    struct Snapshot         *next;
+};
+
+/*
+ * Starts the writer thread. Snapshots saved before this, or after it failed, are written
+ * on the calling thread.
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */
+int snapshot_init(void);
+
+/* Writes every pending snapshot, then stops the writer thread. */
+void snapshot_kill(void);
+
+/* Sets up snap to save to path. Must be called before the writer thread is started. */
+void snapshot_add(struct Snapshot *snap, const char *path);
+
+/* Frees snap's buffers. Call after snapshot_kill(). */
+void snapshot_free(struct Snapshot *snap);
+
+/*
+ * Copies m's savedata and hands it to the writer thread. Must be called from the thread
+ * that owns m.
+ *
+ * Returns 0 on success.
+ * Returns -1 if the copy could not be made.
+ */
+int snapshot_save(struct Snapshot *snap, Tox *m);
+
+/*
+ * Returns the number of the latest copy of snap that is on disk, so that a caller can tell
+ * whether what it saved with the copy numbered snap->taken has been written yet.
+ */
+uint64_t snapshot_written(struct Snapshot *snap);
+
+/*
+ * Writes data to a temporary file that is synced and then renamed over path, so a crash
+ * never leaves a half written file behind.
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure, leaving path as it was.
+ */
+int snapshot_write_file(const char *path, const uint8_t *data, size_t length);
+
+#endif /* SNAPSHOT_H */
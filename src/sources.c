@@ -0,0 +1,464 @@
+/*  sources.c
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE                /* pipe2() */
+#define _POSIX_C_SOURCE 200809L    /* clock_gettime(), O_CLOEXEC */
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <tox/tox.h>
+
+#include "sources.h"
+#include "inbound.h"
+#include "stream.h"
+#include "log.h"
+
+typedef enum Source_Kind {
+    SOURCE_FIFO,
+    SOURCE_EXEC,
+    SOURCE_UNIX,
+} Source_Kind;
+
+static const char *kind_names[] = { "fifo", "exec", "unix" };
+
+struct Source {
+    Source_Kind           kind;
+    char                  path[PATH_MAX];
+    char                  targets[SOURCE_MAX_TARGETS];
+
+    int                   fd;            // -1 while closed
+    pid_t                 pid;           // exec sources only
+    uint64_t              reopen_at;     // CLOCK_MONOTONIC milliseconds
+    struct Stream_Parser  parser;
+};
+
+static struct Sources {
+    struct Source  sources[SOURCES_MAX];
+    size_t         count;
+
+    int            wake_fds[2];    // written to by sources_kill() to stop the thread
+    pthread_t      thread;
+    bool           running;
+} sources = {
+    .wake_fds = { -1, -1 },
+};
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool is_number(const char *s)
+{
+    if (*s == '\0') {
+        return false;
+    }
+
+    for (; *s != '\0'; ++s) {
+        if (*s < '0' || *s > '9') {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool is_chat_id(const char *s)
+{
+    if (strlen(s) != TOX_GROUP_CHAT_ID_SIZE * 2) {
+        return false;
+    }
+
+    for (; *s != '\0'; ++s) {
+        if (!((*s >= '0' && *s <= '9') || (*s >= 'a' && *s <= 'f') || (*s >= 'A' && *s <= 'F'))) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Returns true if every comma separated target in targets is well formed. */
+static bool targets_valid(const char *targets)
+{
+    char buf[SOURCE_MAX_TARGETS];
+    snprintf(buf, sizeof(buf), "%s", targets);
+
+    char *save = NULL;
+
+    for (char *t = strtok_r(buf, ",", &save); t != NULL; t = strtok_r(NULL, ",", &save)) {
+        if (strcmp(t, "public") == 0 || strcmp(t, "conference") == 0) {
+            continue;
+        }
+
+        if (strncmp(t, "conference:", 11) == 0 && is_number(t + 11)) {
+            continue;
+        }
+
+        if (strncmp(t, "group:", 6) == 0 && is_chat_id(t + 6)) {
+            continue;
+        }
+
+        return false;
+    }
+
+    return true;
+}
+
+/* Hands every message to the main thread, addressed to the source's targets */
+static void cb_frame(void *userdata, const char *data, size_t length, bool last)
+{
+    (void) last;
+
+    const struct Source *src = userdata;
+
+    if (length == 0) {
+        log_timestamp("ignore empty msg");
+        return;
+    }
+
+    inbound_post("", src->targets, data, length);
+}
+
+static int exec_start(struct Source *src)
+{
+    int fds[2];
+
+    /* close-on-exec from the start: the bridge thread forks too, and must not inherit our end */
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        log_error_timestamp(errno, "Source pipe() failed");
+        return -1;
+    }
+
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        log_error_timestamp(errno, "Source fork() failed");
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execl("/bin/sh", "sh", "-c", src->path, (char *) NULL);
+        _exit(127);
+    }
+
+    close(fds[1]);
+
+    src->pid = pid;
+    src->fd = fds[0];
+    return 0;
+}
+
+static int unix_connect(struct Source *src)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    size_t len = strlen(src->path);
+
+    if (len >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+
+    memcpy(addr.sun_path, src->path, len + 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    src->fd = fd;
+    return 0;
+}
+
+static int source_open(struct Source *src)
+{
+    switch (src->kind) {
+        case SOURCE_FIFO: {
+            if (mkfifo(src->path, 0660) != 0 && errno != EEXIST) {
+                log_error_timestamp(errno, "Failed to create fifo %s", src->path);
+                return -1;
+            }
+
+            /* holding the write end too means the fifo never reports end of file between writers */
+            src->fd = open(src->path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+            break;
+        }
+
+        case SOURCE_EXEC: {
+            exec_start(src);
+            break;
+        }
+
+        case SOURCE_UNIX: {
+            unix_connect(src);
+            break;
+        }
+    }
+
+    if (src->fd == -1) {
+        return -1;
+    }
+
+    log_timestamp("Inbound source %s:%s is open", kind_names[src->kind], src->path);
+    return 0;
+}
+
+static void source_close(struct Source *src)
+{
+    stream_parser_finish(&src->parser);
+
+    if (src->fd != -1) {
+        close(src->fd);
+        src->fd = -1;
+    }
+
+    if (src->pid > 0) {
+        kill(src->pid, SIGTERM);
+        waitpid(src->pid, NULL, 0);
+        src->pid = -1;
+    }
+}
+
+/* Reads what src has to offer. Returns true if anything was read. */
+static bool source_read(struct Source *src)
+{
+    long n = stream_parser_read(&src->parser, src->fd);
+
+    if (n > 0) {
+        return true;
+    }
+
+    if (n == -1 && errno == EAGAIN) {
+        return false;
+    }
+
+    log_timestamp("Inbound source %s:%s closed", kind_names[src->kind], src->path);
+    source_close(src);
+    src->reopen_at = now_ms() + SOURCE_RESTART_DELAY;
+
+    /* the parser may have flushed a final message */
+    return true;
+}
+
+static void *sources_thread(void *arg)
+{
+    (void) arg;
+
+    while (true) {
+        struct pollfd fds[1 + SOURCES_MAX];
+        struct Source *polled[SOURCES_MAX];
+        nfds_t nfds = 1;
+        uint64_t now = now_ms();
+        int timeout = -1;
+
+        fds[0] = (struct pollfd) {
+            sources.wake_fds[0], POLLIN, 0
+        };
+
+        for (size_t i = 0; i < sources.count; ++i) {
+            struct Source *src = &sources.sources[i];
+
+            if (src->fd == -1 && src->reopen_at <= now && source_open(src) != 0) {
+                src->reopen_at = now + SOURCE_RESTART_DELAY;
+            }
+
+            if (src->fd == -1) {
+                int wait = src->reopen_at - now;
+                timeout = timeout == -1 || wait < timeout ? wait : timeout;
+                continue;
+            }
+
+            polled[nfds - 1] = src;
+            fds[nfds++] = (struct pollfd) {
+                src->fd, POLLIN, 0
+            };
+        }
+
+        if (poll(fds, nfds, timeout) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            log_error_timestamp(errno, "Inbound sources poll() failed");
+            break;
+        }
+
+        if (fds[0].revents != 0) {
+            break;
+        }
+
+        bool posted = false;
+
+        for (nfds_t i = 1; i < nfds; ++i) {
+            if (fds[i].revents != 0) {
+                posted |= source_read(polled[i - 1]);
+            }
+        }
+
+        /* one sync covers everything read from every source in this round */
+        if (posted) {
+            inbound_sync();
+        }
+    }
+
+    return NULL;
+}
+
+int sources_add(const char *spec)
+{
+    if (sources.count >= SOURCES_MAX) {
+        return -1;
+    }
+
+    const char *colon = strchr(spec, ':');
+
+    if (colon == NULL) {
+        return -1;
+    }
+
+    struct Source *src = &sources.sources[sources.count];
+    size_t i;
+
+    for (i = 0; i < sizeof(kind_names) / sizeof(kind_names[0]); ++i) {
+        if (strlen(kind_names[i]) == (size_t) (colon - spec) && strncmp(spec, kind_names[i], colon - spec) == 0) {
+            break;
+        }
+    }
+
+    if (i == sizeof(kind_names) / sizeof(kind_names[0])) {
+        return -1;
+    }
+
+    const char *path = colon + 1;
+    const char *eq = strrchr(path, '=');
+    size_t path_len = eq != NULL ? (size_t) (eq - path) : strlen(path);
+    const char *targets = eq != NULL ? eq + 1 : "";
+
+    if (path_len == 0 || path_len >= sizeof(src->path) || strlen(targets) >= sizeof(src->targets)
+            || !targets_valid(targets)) {
+        return -1;
+    }
+
+    *src = (struct Source) {
+        .kind = (Source_Kind) i,
+        .fd = -1,
+        .pid = -1,
+    };
+
+    memcpy(src->path, path, path_len);
+    src->path[path_len] = '\0';
+    snprintf(src->targets, sizeof(src->targets), "%s", targets);
+
+    ++sources.count;
+    return 0;
+}
+
+int sources_init(void)
+{
+    if (sources.count == 0) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < sources.count; ++i) {
+        struct Source *src = &sources.sources[i];
+
+        if (stream_parser_init(&src->parser, STREAM_MAX_FRAME, cb_frame, src) != 0) {
+            log_error_timestamp(-1, "Failed to allocate inbound source parser");
+            goto on_error;
+        }
+    }
+
+    if (pipe2(sources.wake_fds, O_CLOEXEC) != 0) {
+        log_error_timestamp(errno, "Inbound sources pipe() failed");
+        goto on_error;
+    }
+
+    if (pthread_create(&sources.thread, NULL, sources_thread, NULL) != 0) {
+        log_error_timestamp(-1, "Failed to create inbound sources thread");
+        goto on_error;
+    }
+
+    sources.running = true;
+    return 0;
+
+on_error:
+    sources_kill();
+    return -1;
+}
+
+void sources_kill(void)
+{
+    if (sources.running) {
+        if (write(sources.wake_fds[1], "", 1) != 1) {
+            log_error_timestamp(errno, "Failed to wake inbound sources thread");
+        }
+
+        pthread_join(sources.thread, NULL);
+        sources.running = false;
+    }
+
+    for (size_t i = 0; i < 2; ++i) {
+        if (sources.wake_fds[i] != -1) {
+            close(sources.wake_fds[i]);
+            sources.wake_fds[i] = -1;
+        }
+    }
+
+    for (size_t i = 0; i < sources.count; ++i) {
+        struct Source *src = &sources.sources[i];
+
+        if (src->parser.buf != NULL) {
+            source_close(src);
+            stream_parser_free(&src->parser);
+        }
+    }
+}
@@ -0,0 +1,75 @@
+/*  sources.h
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SOURCES_H
+#define SOURCES_H
+
+/*
+ * Inbound sources produce text in the gm_stream.sh format (see stream.h) and have
+ * every message posted to a set of targets. A source is described as
+ *
+ *   <kind>:<path>[=<targets>]
+ *
+ * where kind is one of
+ *
+ *   fifo   a named pipe at path, created if missing; writers may come and go
+ *   exec   the output of the shell command path, restarted whenever it exits
+ *   unix   a Unix domain stream socket at path, reconnected whenever it closes
+ *
+ * and targets is a comma separated list of
+ *
+ *   public        the public NGC group
+ *   conference    the default conference
+ *   conference:N  conference number N
+ *   group:ID      the NGC group with chat ID ID, in hex
+ *
+ * Without targets, messages go to the public group and the default conference.
+ *
+ * One thread polls every source, so adding sources does not add threads. Messages are
+ * handed to the main thread with inbound_post(), with the targets in the group field.
+ */
+
+#define SOURCES_MAX           16
+#define SOURCE_RESTART_DELAY  1000    // milliseconds before a closed source is reopened
+#define SOURCE_MAX_TARGETS    256     // length of the targets string
+
+/*
+ * Adds the source described by spec. Call before sources_init().
+ *
+ * Returns 0 on success.
+ * Returns -1 if spec is invalid or there are too many sources.
+ */
+int sources_add(const char *spec);
+
+/*
+ * Opens every source and starts the thread that polls them. Does nothing if no source
+ * was added.
+ *
+ * Returns 0 on success.
+ * Returns -1 if the thread could not be started.
+ */
+int sources_init(void);
+
+/* Stops the polling thread, terminates exec sources and closes everything. */
+void sources_kill(void);
+
+#endif /* SOURCES_H */
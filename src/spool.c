@@ -0,0 +1,565 @@
+/*  spool.c
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L    /* fdatasync(), O_CLOEXEC */
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "spool.h"
+#include "log.h"
+
+#define SPOOL_RECORD_HEADER_SIZE 16
+#define SPOOL_COMMITTED_FILE "committed"
+#define SPOOL_SEGMENT_NAME_LENGTH 20    // 16 hex digits plus ".seg"
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+static void crc_table_init(void)
+{
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+
+        for (int k = 0; k < 8; ++k) {
+            c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        }
+
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t length)
+{
+    crc = ~crc;
+
+    for (size_t i = 0; i < length; ++i) {
+        crc = crc_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+
+    return ~crc;
+}
+
+static uint32_t record_crc(uint64_t seq, const uint8_t *data, size_t length)
+{
+    return crc32_update(crc32_update(0, (const uint8_t *) &seq, sizeof(seq)), data, length);
+}
+
+static void segment_path(const struct Spool *sp, uint64_t first_seq, char *path, size_t size)
+{
+    snprintf(path, size, "%s/%016" PRIx64 ".seg", sp->dir, first_seq);
+}
+
+static int segment_cmp(const void *a, const void *b)
+{
+    const struct Spool_Segment *x = a;
+    const struct Spool_Segment *y = b;
+
+    return x->first_seq < y->first_seq ? -1 : x->first_seq > y->first_seq;
+}
+
+/* Reads the whole segment into a newly allocated buffer. Returns -1 on error. */
+static int segment_read(const struct Spool *sp, const struct Spool_Segment *seg, uint8_t **buf, size_t *length)
+{
+    char path[512];
+    segment_path(sp, seg->first_seq, path, sizeof(path));
+
+    int fd = open(path, O_RDONLY);
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    struct stat st;
+
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    *buf = malloc(st.st_size > 0 ? st.st_size : 1);
+    *length = 0;
+
+    if (*buf == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    while (*length < (size_t) st.st_size) {
+        ssize_t n = read(fd, *buf + *length, st.st_size - *length);
+
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            break;
+        }
+
+        *length += n;
+    }
+
+    close(fd);
+    return 0;
+}
+
+/*
+ * Walks the records of a segment, calling cb for those with a sequence number above
+ * min_seq and counting them in replayed. Stops at the first record that is torn, fails
+ * its checksum or is out of sequence.
+ *
+ * Returns the number of bytes of valid records.
+ */
+static size_t segment_scan(const uint8_t *buf, size_t length, struct Spool_Segment *seg, uint64_t min_seq,
+                           spool_replay_cb *cb, void *userdata, int *replayed)
+{
+    size_t pos = 0;
+    uint64_t expected = seg->first_seq;
+
+    seg->last_seq = 0;
+
+    while (length - pos >= SPOOL_RECORD_HEADER_SIZE) {
+        uint32_t rec_len;
+        uint32_t rec_crc;
+        uint64_t seq;
+
+        memcpy(&rec_len, buf + pos, sizeof(rec_len));
+        memcpy(&rec_crc, buf + pos + 4, sizeof(rec_crc));
+        memcpy(&seq, buf + pos + 8, sizeof(seq));
+
+        if (seq != expected || rec_len > SPOOL_MAX_RECORD_SIZE
+                || rec_len > length - pos - SPOOL_RECORD_HEADER_SIZE) {
+            break;
+        }
+
+        const uint8_t *data = buf + pos + SPOOL_RECORD_HEADER_SIZE;
+
+        if (record_crc(seq, data, rec_len) != rec_crc) {
+            break;
+        }
+
+        if (cb != NULL && seq > min_seq) {
+            cb(userdata, seq, data, rec_len);
+            ++*replayed;
+        }
+
+        seg->last_seq = seq;
+        pos += SPOOL_RECORD_HEADER_SIZE + rec_len;
+        ++expected;
+    }
+
+    return pos;
+}
+
+/* Creates a new empty segment starting at next_seq and makes it the active one. Call with sp locked. */
+static int segment_create(struct Spool *sp)
+{
+    struct Spool_Segment *segments = realloc(sp->segments, (sp->num_segments + 1) * sizeof(struct Spool_Segment));
+
+    if (segments == NULL) {
+        return -1;
+    }
+
+    sp->segments = segments;
+
+    char path[512];
+    segment_path(sp, sp->next_seq, path, sizeof(path));
+
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+
+    if (fd == -1) {
+        log_error_timestamp(errno, "Failed to create spool segment %s", path);
+        return -1;
+    }
+
+    if (sp->fd != -1) {
+        if (sp->dirty) {
+            fsync(sp->fd);
+        }
+
+        close(sp->fd);
+    }
+
+    /* make the new directory entry durable along with the records that will follow */
+    int dir_fd = open(sp->dir, O_RDONLY | O_CLOEXEC);
+
+    if (dir_fd != -1) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+
+    sp->fd = fd;
+    sp->segment_bytes = 0;
+    sp->segments[sp->num_segments++] = (struct Spool_Segment) {
+        sp->next_seq, 0
+    };
+    sp->dirty = true;
+
+    return 0;
+}
+
+/* Deletes segments, other than the active one, that only hold committed records. Call with sp locked. */
+static void segments_trim(struct Spool *sp)
+{
+    size_t n = 0;
+
+    while (n + 1 < sp->num_segments
+            && (sp->segments[n].last_seq == 0 || sp->segments[n].last_seq <= sp->committed_seq)) {
+        char path[512];
+        segment_path(sp, sp->segments[n].first_seq, path, sizeof(path));
+        unlink(path);
+        ++n;
+    }
+
+    if (n > 0) {
+        memmove(sp->segments, sp->segments + n, (sp->num_segments - n) * sizeof(struct Spool_Segment));
+        sp->num_segments -= n;
+    }
+}
+
+static void committed_load(struct Spool *sp)
+{
+    uint8_t buf[12];
+    uint64_t seq;
+    uint32_t crc;
+
+    sp->committed_seq = 0;
+
+    if (pread(sp->committed_fd, buf, sizeof(buf), 0) != sizeof(buf)) {
+        return;
+    }
+
+    memcpy(&seq, buf, sizeof(seq));
+    memcpy(&crc, buf + 8, sizeof(crc));
+
+    if (crc32_update(0, buf, sizeof(seq)) == crc) {
+        sp->committed_seq = seq;
+    } else {
+        log_timestamp("Spool %s: commit marker is corrupt, replaying everything", sp->dir);
+    }
+}
+
+static int segments_load(struct Spool *sp)
+{
+    DIR *d = opendir(sp->dir);
+
+    if (d == NULL) {
+        return -1;
+    }
+
+    struct dirent *ent;
+
+    while ((ent = readdir(d)) != NULL) {
+        char *end;
+        uint64_t first_seq = strtoull(ent->d_name, &end, 16);
+
+        if (strlen(ent->d_name) != SPOOL_SEGMENT_NAME_LENGTH || end != ent->d_name + 16
+                || strcmp(end, ".seg") != 0 || first_seq == 0) {
+            continue;
+        }
+
+        struct Spool_Segment *segments = realloc(sp->segments, (sp->num_segments + 1) * sizeof(struct Spool_Segment));
+
+        if (segments == NULL) {
+            closedir(d);
+            return -1;
+        }
+
+        sp->segments = segments;
+        sp->segments[sp->num_segments++] = (struct Spool_Segment) {
+            first_seq, 0
+        };
+    }
+
+    closedir(d);
+
+    if (sp->num_segments > 1) {
+        qsort(sp->segments, sp->num_segments, sizeof(struct Spool_Segment), segment_cmp);
+    }
+
+    for (size_t i = 0; i < sp->num_segments; ++i) {
+        struct Spool_Segment *seg = &sp->segments[i];
+        uint8_t *buf;
+        size_t length;
+
+        if (segment_read(sp, seg, &buf, &length) != 0) {
+            return -1;
+        }
+
+        size_t valid = segment_scan(buf, length, seg, 0, NULL, NULL, NULL);
+        free(buf);
+
+        if (valid < length) {
+            log_timestamp("Spool %s: discarding %zu bytes of damaged records in segment %016" PRIx64,
+                          sp->dir, length - valid, seg->first_seq);
+
+            char path[512];
+            segment_path(sp, seg->first_seq, path, sizeof(path));
+
+            if (truncate(path, valid) != 0) {
+                return -1;
+            }
+        }
+
+        if (seg->last_seq >= sp->next_seq) {
+            sp->next_seq = seg->last_seq + 1;
+        }
+    }
+
+    return 0;
+}
+
+int spool_open(struct Spool *sp, const char *dir)
+{
+    pthread_once(&crc_table_once, crc_table_init);
+
+    memset(sp, 0, sizeof(struct Spool));
+    snprintf(sp->dir, sizeof(sp->dir), "%s", dir);
+    sp->fd = -1;
+    sp->committed_fd = -1;
+    sp->next_seq = 1;
+    pthread_mutex_init(&sp->lock, NULL);
+
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+        log_error_timestamp(errno, "Failed to create spool directory %s", dir);
+        return -1;
+    }
+
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", dir, SPOOL_COMMITTED_FILE);
+
+    sp->committed_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+
+    if (sp->committed_fd == -1) {
+        log_error_timestamp(errno, "Failed to open %s", path);
+        return -1;
+    }
+
+    committed_load(sp);
+
+    if (segments_load(sp) != 0) {
+        log_error_timestamp(errno, "Failed to load spool %s", dir);
+        spool_close(sp);
+        return -1;
+    }
+
+    if (sp->committed_seq >= sp->next_seq) {
+        sp->next_seq = sp->committed_seq + 1;
+    }
+
+    /* keep appending to the newest segment only if it is empty; otherwise start a fresh one */
+    struct Spool_Segment *last = sp->num_segments > 0 ? &sp->segments[sp->num_segments - 1] : NULL;
+
+    if (last != NULL && last->last_seq == 0 && last->first_seq == sp->next_seq) {
+        segment_path(sp, last->first_seq, path, sizeof(path));
+        sp->fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    } else if (segment_create(sp) != 0) {
+        spool_close(sp);
+        return -1;
+    }
+
+    if (sp->fd == -1) {
+        spool_close(sp);
+        return -1;
+    }
+
+    segments_trim(sp);
+    return 0;
+}
+
+void spool_close(struct Spool *sp)
+{
+    spool_sync(sp);
+
+    if (sp->fd != -1) {
+        close(sp->fd);
+        sp->fd = -1;
+    }
+
+    if (sp->committed_fd != -1) {
+        close(sp->committed_fd);
+        sp->committed_fd = -1;
+    }
+
+    free(sp->segments);
+    sp->segments = NULL;
+    sp->num_segments = 0;
+}
+
+int spool_replay(struct Spool *sp, spool_replay_cb *cb, void *userdata)
+{
+    int count = 0;
+
+    for (size_t i = 0; i < sp->num_segments; ++i) {
+        struct Spool_Segment *seg = &sp->segments[i];
+
+        if (seg->last_seq == 0 || seg->last_seq <= sp->committed_seq) {
+            continue;
+        }
+
+        uint8_t *buf;
+        size_t length;
+
+        if (segment_read(sp, seg, &buf, &length) != 0) {
+            return -1;
+        }
+
+        segment_scan(buf, length, seg, sp->committed_seq, cb, userdata, &count);
+        free(buf);
+    }
+
+    return count;
+}
+
+uint64_t spool_append(struct Spool *sp, const void *data, size_t length)
+{
+    if (length > SPOOL_MAX_RECORD_SIZE) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&sp->lock);
+
+    if (sp->segment_bytes >= SPOOL_SEGMENT_SIZE && segment_create(sp) != 0) {
+        pthread_mutex_unlock(&sp->lock);
+        return 0;
+    }
+
+    if (sp->fd == -1) {
+        pthread_mutex_unlock(&sp->lock);
+        return 0;
+    }
+
+    uint64_t seq = sp->next_seq;
+    uint32_t rec_len = length;
+    uint32_t rec_crc = record_crc(seq, data, length);
+    uint8_t header[SPOOL_RECORD_HEADER_SIZE];
+
+    memcpy(header, &rec_len, sizeof(rec_len));
+    memcpy(header + 4, &rec_crc, sizeof(rec_crc));
+    memcpy(header + 8, &seq, sizeof(seq));
+
+    struct iovec iov[2] = {
+        { header, sizeof(header) },
+        { (void *) data, length },
+    };
+
+    ssize_t n;
+
+    do {
+        n = writev(sp->fd, iov, 2);
+    } while (n == -1 && errno == EINTR);
+
+    if (n != (ssize_t) (sizeof(header) + length)) {
+        log_error_timestamp(errno, "Spool %s: append failed", sp->dir);
+
+        /* don't leave a torn record in front of the next one */
+        if (n > 0 && ftruncate(sp->fd, sp->segment_bytes) != 0) {
+            close(sp->fd);
+            sp->fd = -1;
+        }
+
+        pthread_mutex_unlock(&sp->lock);
+        return 0;
+    }
+
+    sp->segment_bytes += n;
+    sp->segments[sp->num_segments - 1].last_seq = seq;
+    sp->next_seq = seq + 1;
+    sp->dirty = true;
+
+    pthread_mutex_unlock(&sp->lock);
+
+    return seq;
+}
+
+int spool_sync(struct Spool *sp)
+{
+    pthread_mutex_lock(&sp->lock);
+
+    if (!sp->dirty || sp->fd == -1) {
+        pthread_mutex_unlock(&sp->lock);
+        return 0;
+    }
+
+    /* the active segment may be rotated while we wait for the disk, so sync a duplicate */
+    int fd = dup(sp->fd);
+    int committed_fd = dup(sp->committed_fd);
+    sp->dirty = false;
+
+    pthread_mutex_unlock(&sp->lock);
+
+    int ret = 0;
+
+    if (fd == -1 || committed_fd == -1 || fdatasync(fd) != 0 || fdatasync(committed_fd) != 0) {
+        log_error_timestamp(errno, "Spool %s: sync failed", sp->dir);
+
+        pthread_mutex_lock(&sp->lock);
+        sp->dirty = true;
+        pthread_mutex_unlock(&sp->lock);
+
+        ret = -1;
+    }
+
+    if (fd != -1) {
+        close(fd);
+    }
+
+    if (committed_fd != -1) {
+        close(committed_fd);
+    }
+
+    return ret;
+}
+
+void spool_commit(struct Spool *sp, uint64_t seq)
+{
+    pthread_mutex_lock(&sp->lock);
+
+    if (seq <= sp->committed_seq) {
+        pthread_mutex_unlock(&sp->lock);
+        return;
+    }
+
+    uint8_t buf[12];
+    memcpy(buf, &seq, sizeof(seq));
+    uint32_t crc = crc32_update(0, buf, sizeof(seq));
+    memcpy(buf + 8, &crc, sizeof(crc));
+
+    if (pwrite(sp->committed_fd, buf, sizeof(buf), 0) != sizeof(buf)) {
+        log_error_timestamp(errno, "Spool %s: failed to write commit marker", sp->dir);
+    }
+
+    sp->committed_seq = seq;
+    sp->dirty = true;
+    segments_trim(sp);
+
+    pthread_mutex_unlock(&sp->lock);
+}
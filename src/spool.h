@@ -0,0 +1,119 @@
+/*  spool.h
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A spool is a directory holding an append-only log of records, split into segment
+ * files named after the sequence number of their first record (%016llx.seg). Every
+ * record is a 16 byte header followed by its payload:
+ *
+ *   uint32_t  payload length
+ *   uint32_t  CRC-32 of the sequence number and payload
+ *   uint64_t  sequence number, starting at 1 and increasing by one per record
+ *
+ * The file "committed" holds the sequence number of the last record that has been
+ * fully processed, followed by its CRC-32. Records up to it are never replayed, and
+ * segments that only hold such records are deleted.
+ *
+ * Appends are not flushed to disk individually. spool_sync() makes every record
+ * appended so far durable with one fsync(), so a burst of records costs a single
+ * flush. After a crash, records appended after the last sync may be lost and
+ * records processed after the last commit marker reached the disk are replayed
+ * again, so consumers must tolerate duplicates.
+ */
+
+#define SPOOL_SEGMENT_SIZE (4 * 1024 * 1024)
+#define SPOOL_MAX_RECORD_SIZE (1024 * 1024)
+
+struct Spool_Segment {
+    uint64_t  first_seq;
+    uint64_t  last_seq;     // zero while the segment is empty
+};
+
+struct Spool {
+    char                  dir[256];
+    int                   fd;               // active segment, opened for appending
+    int                   committed_fd;
+    size_t                segment_bytes;    // size of the active segment
+    uint64_t              next_seq;
+    uint64_t              committed_seq;
+    bool                  dirty;            // appends or a commit since the last sync
+
+    struct Spool_Segment  *segments;        // oldest first; the last one is active
+    size_t                num_segments;
+
+    pthread_mutex_t       lock;
+};
+
+typedef void spool_replay_cb(void *userdata, uint64_t seq, const uint8_t *data, size_t length);
+
+/*
+ * Opens the spool in dir, creating the directory if needed. A torn record at the end
+ * of the newest segment, left by a crash during an append, is cut off.
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */
+int spool_open(struct Spool *sp, const char *dir);
+
+/* Syncs and closes sp. */
+void spool_close(struct Spool *sp);
+
+/*
+ * Calls cb, in order, for every record that was appended but never committed.
+ * Replay stops at the first record that fails its checksum.
+ *
+ * Returns the number of records replayed, or -1 on a read error.
+ */
+int spool_replay(struct Spool *sp, spool_replay_cb *cb, void *userdata);
+
+/*
+ * Appends a record. The record is not durable until the next spool_sync().
+ *
+ * Returns the sequence number of the record on success.
+ * Returns 0 on failure.
+ */
+uint64_t spool_append(struct Spool *sp, const void *data, size_t length);
+
+/*
+ * Flushes every record appended so far, and the commit marker, to disk.
+ * The spool is not locked while waiting for the disk.
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */
+int spool_sync(struct Spool *sp);
+
+/*
+ * Marks every record up to and including seq as processed. Segments that only hold
+ * processed records are deleted.
+ */
+void spool_commit(struct Spool *sp, uint64_t seq);
+
+#endif /* SPOOL_H */
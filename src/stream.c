@@ -0,0 +1,244 @@
+/*  stream.c
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L    /* clock_gettime() */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "misc.h"
+#include "stream.h"
+
+static const char sentinel[] = STREAM_SENTINEL;
+
+/*
+ * KMP failure function of the sentinel: the length of the longest proper prefix of
+ * sentinel[0..i] that is also a suffix of it.
+ */
+static const uint8_t sentinel_fail[STREAM_SENTINEL_LENGTH] = {
+    0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1,
+};
+
+_Static_assert(STREAM_SENTINEL_LENGTH == 14, "sentinel_fail must match STREAM_SENTINEL");
+
+/* Advances the sentinel matcher by one byte */
+static inline size_t sentinel_step(size_t match, char c)
+{
+    while (match > 0 && sentinel[match] != c) {
+        match = sentinel_fail[match - 1];
+    }
+
+    return sentinel[match] == c ? match + 1 : 0;
+}
+
+static void emit(struct Stream_Parser *p, size_t start, size_t end, bool last)
+{
+    if (last) {
+        ++p->frames;
+    } else {
+        ++p->chunks;
+    }
+
+    p->bytes += end - start;
+    p->cb(p->userdata, p->buf + start, end - start, last);
+}
+
+/* Runs the bytes read since the last call through the matcher, handing over every complete message. */
+static void scan(struct Stream_Parser *p)
+{
+    while (p->scanned < p->len) {
+        /* the sentinel starts with a newline, so nothing else can begin a match */
+        if (p->match == 0) {
+            const char *nl = memchr(p->buf + p->scanned, '\n', p->len - p->scanned);
+
+            if (nl == NULL) {
+                p->scanned = p->len;
+                break;
+            }
+
+            p->scanned = nl - p->buf;
+        }
+
+        p->match = sentinel_step(p->match, p->buf[p->scanned++]);
+
+        if (p->match == STREAM_SENTINEL_LENGTH) {
+            emit(p, p->start, p->scanned - STREAM_SENTINEL_LENGTH, true);
+            p->start = p->scanned;
+            p->match = 0;
+        }
+    }
+}
+
+/*
+ * Makes room at the end of a full buffer: drops the messages already handed over, or if
+ * the buffer holds nothing but one long message, hands over its first chunk. Compacting
+ * only when full means every byte is moved a bounded number of times.
+ */
+static void make_room(struct Stream_Parser *p)
+{
+    if (p->len < p->size) {
+        return;
+    }
+
+    if (p->start == 0) {
+        /* the last match bytes may still turn out to be the sentinel, so they are never part of a chunk */
+        size_t next;
+        size_t end = utf8_split(p->buf, p->len - p->match, p->max_frame, &next);
+
+        emit(p, 0, end, false);
+        p->start = next;
+    }
+
+    memmove(p->buf, p->buf + p->start, p->len - p->start);
+    p->len -= p->start;
+    p->scanned -= p->start;
+    p->start = 0;
+}
+
+int stream_parser_init(struct Stream_Parser *p, size_t max_frame, stream_frame_cb *cb, void *userdata)
+{
+    memset(p, 0, sizeof(struct Stream_Parser));
+
+    /* room for a whole frame plus a partly matched sentinel after it */
+    p->size = max_frame + STREAM_SENTINEL_LENGTH;
+    p->buf = malloc(p->size);
+
+    if (p->buf == NULL) {
+        return -1;
+    }
+
+    p->max_frame = max_frame;
+    p->cb = cb;
+    p->userdata = userdata;
+
+    return 0;
+}
+
+void stream_parser_free(struct Stream_Parser *p)
+{
+    free(p->buf);
+    p->buf = NULL;
+}
+
+void stream_parser_feed(struct Stream_Parser *p, const char *data, size_t len)
+{
+    while (len > 0) {
+        make_room(p);
+
+        size_t n = p->size - p->len;
+
+        if (n > len) {
+            n = len;
+        }
+
+        memcpy(p->buf + p->len, data, n);
+        p->len += n;
+        data += n;
+        len -= n;
+
+        scan(p);
+    }
+}
+
+long stream_parser_read(struct Stream_Parser *p, int fd)
+{
+    make_room(p);
+
+    ssize_t n;
+
+    do {
+        n = read(fd, p->buf + p->len, p->size - p->len);
+    } while (n == -1 && errno == EINTR);
+
+    if (n > 0) {
+        p->len += n;
+        scan(p);
+    }
+
+    return n;
+}
+
+void stream_parser_finish(struct Stream_Parser *p)
+{
+    if (p->len > p->start) {
+        emit(p, p->start, p->len, true);
+    }
+
+    p->len = 0;
+    p->scanned = 0;
+    p->start = 0;
+    p->match = 0;
+}
+
+static void benchmark_frame(void *userdata, const char *data, size_t length, bool last)
+{
+    (void) userdata;
+    (void) data;
+    (void) length;
+    (void) last;
+}
+
+int stream_benchmark(const char *path, size_t max_frame)
+{
+    int fd = open(path, O_RDONLY);
+
+    if (fd == -1) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    struct Stream_Parser p;
+
+    if (stream_parser_init(&p, max_frame, benchmark_frame, NULL) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    struct timespec t0;
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    long n;
+
+    while ((n = stream_parser_read(&p, fd)) > 0) {
+        ;
+    }
+
+    stream_parser_finish(&p);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    close(fd);
+
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    printf("%llu messages, %llu extra chunks, %llu bytes of text in %.3f s (%.1f MB/s)\n",
+           (unsigned long long) p.frames, (unsigned long long) p.chunks, (unsigned long long) p.bytes,
+           secs, secs > 0 ? p.bytes / secs / 1e6 : 0.0);
+
+    stream_parser_free(&p);
+
+    return n == 0 ? 0 : -1;
+}
@@ -0,0 +1,101 @@
+/*  stream.h
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Incremental parser for the gm_stream.sh output format: messages are separated by a
+ * blank line followed by a line holding only EOF_FOR_TOX, so every message is
+ * terminated by STREAM_SENTINEL. The sentinel is not part of the message.
+ *
+ * Input is read straight into the parser's buffer and scanned once, so the cost is
+ * linear in the size of the stream. A message longer than max_frame bytes is handed
+ * over in chunks, split with utf8_split() so no character is cut in half.
+ */
+
+#define STREAM_SENTINEL "\n\nEOF_FOR_TOX\n"
+#define STREAM_SENTINEL_LENGTH (sizeof(STREAM_SENTINEL) - 1)
+
+/* Largest message handed over in one piece */
+#define STREAM_MAX_FRAME (64 * 1024)
+
+/*
+ * Called for every message or chunk. data is not null terminated. last is false for
+ * every chunk of a long message except the final one.
+ */
+typedef void stream_frame_cb(void *userdata, const char *data, size_t length, bool last);
+
+struct Stream_Parser {
+    char             *buf;
+    size_t           size;
+    size_t           start;      // offset in buf of the message being assembled
+    size_t           len;        // bytes in buf
+    size_t           scanned;    // bytes of buf already run through the matcher
+    size_t           match;      // sentinel bytes matched at the end of the scanned bytes
+    size_t           max_frame;
+
+    stream_frame_cb  *cb;
+    void             *userdata;
+
+    uint64_t         frames;
+    uint64_t         chunks;     // pieces of messages longer than max_frame
+    uint64_t         bytes;
+};
+
+/*
+ * Initialises p to hand messages of up to max_frame bytes to cb.
+ *
+ * Returns 0 on success.
+ * Returns -1 on allocation failure.
+ */
+int stream_parser_init(struct Stream_Parser *p, size_t max_frame, stream_frame_cb *cb, void *userdata);
+
+void stream_parser_free(struct Stream_Parser *p);
+
+/* Feeds len bytes of data to p. */
+void stream_parser_feed(struct Stream_Parser *p, const char *data, size_t len);
+
+/*
+ * Reads once from fd into p and handles whatever was read.
+ *
+ * Returns the number of bytes read, 0 at end of file, or -1 on error.
+ */
+long stream_parser_read(struct Stream_Parser *p, int fd);
+
+/* Hands over any unterminated message left at the end of the stream. */
+void stream_parser_finish(struct Stream_Parser *p);
+
+/*
+ * Parses the captured stream in path, handing over messages of up to max_frame bytes,
+ * and prints message counts and throughput.
+ *
+ * Returns 0 on success.
+ * Returns -1 if the file cannot be read.
+ */
+int stream_benchmark(const char *path, size_t max_frame);
+
+#endif /* STREAM_H */
@@ -0,0 +1,383 @@
+/*  timers.c
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L    /* clock_gettime() */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "timers.h"
+#include "misc.h"
+
+#define WHEEL_BITS   6
+#define WHEEL_SIZE   (1 << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+
+/* Timers further away than this wait in the last slot of the top level */
+#define WHEEL_RANGE  ((uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS))
+
+struct Timer {
+    uint32_t      id;            // 0 if the slot is free
+    uint32_t      generation;
+    uint64_t      due;           // all times are ticks since timers_init()
+    uint64_t      expires;       // due plus this firing's jitter
+    uint32_t      period;        // 0 for one-shot timers
+    uint32_t      jitter;
+    timer_cb      *cb;
+    void          *userdata;
+
+    struct Timer  *next;
+    struct Timer  **pprev;       // the pointer that points at this timer
+};
+
+/* Each thread that runs a Tox instance has a wheel of its own */
+static _Thread_local struct Timers {
+    uint64_t      start;         // CLOCK_MONOTONIC milliseconds of tick 0
+    uint64_t      tick;          // every tick up to and including this one has been run
+    size_t        count;
+    uint32_t      seed;
+
+    struct Timer  *wheel[WHEEL_LEVELS][WHEEL_SIZE];
+    struct Timer  timers[TIMERS_MAX];
+} timers;
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Returns the first tick that is at least delay_ms from now */
+static uint64_t tick_after(uint32_t delay_ms)
+{
+    return (now_ms() - timers.start + delay_ms + TIMERS_TICK_MS - 1) / TIMERS_TICK_MS;
+}
+
+static uint32_t random_ticks(uint32_t max_ms)
+{
+    if (max_ms == 0) {
+        return 0;
+    }
+
+    /* xorshift32; the jitter only has to differ between timers, not be unpredictable */
+    timers.seed ^= timers.seed << 13;
+    timers.seed ^= timers.seed >> 17;
+    timers.seed ^= timers.seed << 5;
+
+    return timers.seed % (max_ms / TIMERS_TICK_MS + 1);
+}
+
+static void list_push(struct Timer **head, struct Timer *t)
+{
+    t->next = *head;
+
+    if (t->next != NULL) {
+        t->next->pprev = &t->next;
+    }
+
+    *head = t;
+    t->pprev = head;
+}
+
+static void list_unlink(struct Timer *t)
+{
+    if (t->pprev == NULL) {
+        return;
+    }
+
+    *t->pprev = t->next;
+
+    if (t->next != NULL) {
+        t->next->pprev = t->pprev;
+    }
+
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+/* Puts t in the slot for its expiry, measured from base, the next tick to be run */
+static void wheel_place(struct Timer *t, uint64_t base)
+{
+    uint64_t expires = MAX(t->expires, base);
+    uint64_t delta = MIN(expires - base, WHEEL_RANGE - 1);
+    expires = base + delta;
+
+    size_t level = 0;
+
+    while (level < WHEEL_LEVELS - 1 && delta >= (uint64_t) 1 << (WHEEL_BITS * (level + 1))) {
+        ++level;
+    }
+
+    list_push(&timers.wheel[level][(expires >> (WHEEL_BITS * level)) & WHEEL_MASK], t);
+}
+
+/* Moves the timers of a higher level slot that has come round down to where they belong */
+static void wheel_cascade(size_t level, uint64_t base)
+{
+    struct Timer **slot = &timers.wheel[level][(base >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    struct Timer *t = *slot;
+    *slot = NULL;
+
+    while (t != NULL) {
+        struct Timer *next = t->next;
+        wheel_place(t, base);
+        t = next;
+    }
+}
+
+static struct Timer *timer_find(uint32_t id)
+{
+    if (id == 0) {
+        return NULL;
+    }
+
+    struct Timer *t = &timers.timers[id % TIMERS_MAX];
+
+    return t->id == id ? t : NULL;
+}
+
+static void timer_release(struct Timer *t)
+{
+    list_unlink(t);
+    t->id = 0;
+    t->cb = NULL;
+    t->userdata = NULL;
+    --timers.count;
+}
+
+/* Returns the tick the next timer is due on, or UINT64_MAX if there is none */
+static uint64_t next_tick(void)
+{
+    uint64_t next = UINT64_MAX;
+
+    /* a level 0 slot only holds timers due on the tick it is run */
+    for (uint64_t i = 1; i <= WHEEL_SIZE; ++i) {
+        if (timers.wheel[0][(timers.tick + i) & WHEEL_MASK] != NULL) {
+            next = timers.tick + i;
+            break;
+        }
+    }
+
+    /*
+     * No timer in a higher level slot is due before the tick that slot is cascaded on,
+     * and the slots come round in order, so the scan stops at the first slot that cannot
+     * hold anything earlier than what has been found.
+     */
+    for (size_t level = 1; level < WHEEL_LEVELS; ++level) {
+        uint64_t pos = timers.tick >> (WHEEL_BITS * level);
+
+        for (uint64_t i = 1; i <= WHEEL_SIZE; ++i) {
+            if ((pos + i) << (WHEEL_BITS * level) >= next) {
+                break;
+            }
+
+            const struct Timer *t = timers.wheel[level][(pos + i) & WHEEL_MASK];
+
+            for (; t != NULL; t = t->next) {
+                next = MIN(next, t->expires);
+            }
+        }
+    }
+
+    return next;
+}
+
+/*
+ * Moves the wheel straight to tick now - 1 when nothing is due before now, instead of
+ * stepping through every tick in between, e.g. after the machine was suspended.
+ */
+static void wheel_skip(uint64_t now)
+{
+    if (now - timers.tick <= WHEEL_SIZE || next_tick() < now) {
+        return;
+    }
+
+    for (size_t level = 0; level < WHEEL_LEVELS; ++level) {
+        for (size_t i = 0; i < WHEEL_SIZE; ++i) {
+            timers.wheel[level][i] = NULL;
+        }
+    }
+
+    timers.tick = now - 1;
+
+    for (size_t i = 0; i < TIMERS_MAX; ++i) {
+        struct Timer *t = &timers.timers[i];
+
+        if (t->id != 0) {
+            t->next = NULL;
+            t->pprev = NULL;
+            wheel_place(t, timers.tick + 1);
+        }
+    }
+}
+
+void timers_init(void)
+{
+    timers.start = now_ms();
+    timers.tick = 0;
+    timers.seed = (uint32_t) timers.start | 1;
+}
+
+void timers_free(void)
+{
+    for (size_t i = 0; i < TIMERS_MAX; ++i) {
+        if (timers.timers[i].id != 0) {
+            timer_release(&timers.timers[i]);
+        }
+    }
+}
+
+uint32_t timer_periodic(uint32_t delay_ms, uint32_t period_ms, uint32_t jitter_ms, timer_cb *cb, void *userdata)
+{
+    for (uint32_t i = 0; i < TIMERS_MAX; ++i) {
+        struct Timer *t = &timers.timers[i];
+
+        if (t->id != 0) {
+            continue;
+        }
+
+        uint32_t id;
+
+        do {
+            id = ++t->generation * TIMERS_MAX + i;
+        } while (id == 0);
+
+        t->id = id;
+        t->due = tick_after(delay_ms);
+        t->expires = t->due + random_ticks(jitter_ms);
+        t->period = period_ms == 0 ? 0 : MAX(period_ms / TIMERS_TICK_MS, 1);
+        t->jitter = jitter_ms;
+        t->cb = cb;
+        t->userdata = userdata;
+
+        wheel_place(t, timers.tick + 1);
+        ++timers.count;
+
+        return id;
+    }
+
+    return 0;
+}
+
+uint32_t timer_add(uint32_t delay_ms, timer_cb *cb, void *userdata)
+{
+    return timer_periodic(delay_ms, 0, 0, cb, userdata);
+}
+
+void timer_delay(uint32_t id, uint32_t delay_ms)
+{
+    struct Timer *t = timer_find(id);
+
+    if (t == NULL) {
+        return;
+    }
+
+    list_unlink(t);
+    t->due = tick_after(delay_ms);
+    t->expires = t->due + random_ticks(t->jitter);
+    wheel_place(t, timers.tick + 1);
+}
+
+void timer_cancel(uint32_t id)
+{
+    struct Timer *t = timer_find(id);
+
+    if (t != NULL) {
+        timer_release(t);
+    }
+}
+
+void timers_run(void)
+{
+    uint64_t now = (now_ms() - timers.start) / TIMERS_TICK_MS;
+
+    if (timers.count == 0) {
+        timers.tick = MAX(timers.tick, now);
+        return;
+    }
+
+    wheel_skip(now);
+
+    while (timers.tick < now) {
+        uint64_t base = timers.tick + 1;
+
+        for (size_t level = 1; level < WHEEL_LEVELS; ++level) {
+            if ((base & (((uint64_t) 1 << (WHEEL_BITS * level)) - 1)) != 0) {
+                break;
+            }
+
+            wheel_cascade(level, base);
+        }
+
+        /* the slot is taken off the wheel first, so timers added by callbacks land in a later turn */
+        struct Timer *expired = NULL;
+        struct Timer **slot = &timers.wheel[0][base & WHEEL_MASK];
+
+        if (*slot != NULL) {
+            expired = *slot;
+            expired->pprev = &expired;
+            *slot = NULL;
+        }
+
+        timers.tick = base;
+
+        while (expired != NULL) {
+            struct Timer *t = expired;
+            timer_cb *cb = t->cb;
+            void *userdata = t->userdata;
+
+            list_unlink(t);
+
+            if (t->period == 0) {
+                timer_release(t);
+            } else {
+                /* keep to the original schedule, but skip firings that were missed altogether */
+                t->due += t->period;
+
+                if (t->due <= base) {
+                    t->due = base + t->period;
+                }
+
+                t->expires = t->due + random_ticks(t->jitter);
+                wheel_place(t, base + 1);
+            }
+
+            cb(userdata);
+        }
+    }
+}
+
+uint32_t timers_next(void)
+{
+    if (timers.count == 0) {
+        return TIMERS_NONE;
+    }
+
+    uint64_t next_ms = timers.start + next_tick() * TIMERS_TICK_MS;
+    uint64_t now = now_ms();
+
+    return next_ms <= now ? 0 : (uint32_t) MIN(next_ms - now, TIMERS_NONE - 1);
+}
@@ -0,0 +1,95 @@
+/*  timers.h
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef TIMERS_H
+#define TIMERS_H
+
+#include <stdint.h>
+
+/*
+ * One-shot and periodic timers for the main loop, kept in a hierarchical timing wheel:
+ * four levels of 64 slots, each slot of a level spanning a whole turn of the level
+ * below. Adding and cancelling a timer is constant time, and a timer only moves down a
+ * level when the wheel below it comes round, so long periods cost next to nothing.
+ *
+ * Timers have TIMERS_TICK_MS resolution and never fire early. timers_next() tells the
+ * main loop how long it may sleep, and timers_run() calls whatever has come due.
+ *
+ * The wheel belongs to the calling thread: every thread that runs a Tox instance has
+ * its own, and everything must be called from that thread.
+ */
+
+#define TIMERS_MAX      32
+#define TIMERS_TICK_MS  10
+
+#define TIMERS_NONE     UINT32_MAX    // returned by timers_next() when nothing is scheduled
+
+typedef void timer_cb(void *userdata);
+
+/* Starts the clock of the calling thread's wheel. Call before adding timers. */
+void timers_init(void);
+
+/* Cancels every timer. */
+void timers_free(void);
+
+/*
+ * Calls cb once, delay_ms milliseconds from now.
+ *
+ * Returns the ID of the timer, which is never 0.
+ * Returns 0 if there are too many timers.
+ */
+uint32_t timer_add(uint32_t delay_ms, timer_cb *cb, void *userdata);
+
+/*
+ * Calls cb delay_ms milliseconds from now, and every period_ms milliseconds after that
+ * until it is cancelled. Each firing is put back by a random amount of up to jitter_ms,
+ * so tasks with the same period do not all run in the same iteration.
+ *
+ * A period_ms of 0 makes a one-shot timer, which is what timer_add() is.
+ *
+ * Returns the ID of the timer, which is never 0.
+ * Returns 0 if there are too many timers.
+ */
+uint32_t timer_periodic(uint32_t delay_ms, uint32_t period_ms, uint32_t jitter_ms, timer_cb *cb, void *userdata);
+
+/*
+ * Moves the next firing of timer id to delay_ms milliseconds from now. A periodic timer
+ * carries on with its period from there. Does nothing if the timer no longer exists.
+ */
+void timer_delay(uint32_t id, uint32_t delay_ms);
+
+/*
+ * Cancels timer id. Safe to call from a timer callback, including the timer's own, and
+ * with the ID of a one-shot timer that has already fired.
+ */
+void timer_cancel(uint32_t id);
+
+/* Calls the callback of every timer that has come due. */
+void timers_run(void);
+
+/*
+ * Returns the number of milliseconds until the next timer comes due, 0 if one already
+ * has, or TIMERS_NONE if no timer is scheduled.
+ */
+uint32_t timers_next(void);
+
+#endif /* TIMERS_H */
@@ -29,12 +29,25 @@
 #include <limits.h>
 #include <signal.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <stdarg.h>
 
 #include <tox/tox.h>
 #include <tox/toxav.h>
 
+#include "acl.h"
+#include "bridge.h"
+#include "bridge_socket.h"
+#include "event_loop.h"
+#include "inbound.h"
+#include "hex.h"
 #include "misc.h"
+#include "outbox.h"
+#include "snapshot.h"
+#include "sources.h"
+#include "stream.h"
+#include "timers.h"
+#include "workers.h"
 #include "commands.h"
 #include "toxbot.h"
 #include "groupchats.h"
@@ -54,14 +67,32 @@
 /* How often we attempt to bootstrap when not presently connected to the network */
 #define BOOTSTRAP_INTERVAL 20
 
+/* How often we try to rejoin the public group while we are out of it */
+#define REJOIN_INTERVAL 15
+
+/* How long save_data_later() collects changes before the profile is written out */
+#define SAVE_DELAY 5
+
+/* How often the friend journal is folded into a full save, and after how many entries at the latest */
+#define JOURNAL_COMPACT_INTERVAL (60 * 60)
+#define JOURNAL_MAX_ENTRIES 1024
+
+/* Up to how many milliseconds the purges are put back, so they rarely share an iteration */
+#define TIMER_JITTER 5000
+
+/* How long we give toxcore to leave the public group before accepting an invite to it */
+#define JOIN_SETTLE_MS 1000
+
+/* How far apart queued group joins are made, so they do not all go out in one iteration */
+#define JOIN_SPACING_MS 500
+
 #define MAX_PORT_RANGE 65535
 
 /* Name of data file prior to version 0.1.1 */
 #define DATA_FILE_PRE_0_1_1 "toxbot_save"
 
-volatile sig_atomic_t FLAG_EXIT = false;    /* set on SIGINT */
-
-struct Tox_Bot Tox_Bot;
+volatile sig_atomic_t FLAG_EXIT = false;    /* set on SIGINT or SIGTERM */
+static volatile sig_atomic_t exit_signal;    /* the signal that set FLAG_EXIT */
 
 static struct Options {
     TOX_PROXY_TYPE    proxy_type;
@@ -70,78 +101,153 @@ static struct Options {
     bool      disable_udp;
     bool      disable_lan;
     bool      force_ipv4;
+    size_t    bridge_queue_size;
+    Bridge_Overflow bridge_overflow;
+    char      bridge_socket[256];
+    bool      bridge_scripts;
+    uint32_t  send_rate;
+    uint32_t  send_byte_rate;
+    const char *profiles[MAX_PROFILES];    // save files; the first is the primary profile
+    size_t    num_profiles;
 } Options;
 
-static void init_toxbot_state(void)
+/*
+ * The primary profile runs on the main thread along with the bridge and inbound sources;
+ * every other profile has a thread of its own.
+ */
+static struct Profiles {
+    struct Tox_Bot  bots[MAX_PROFILES];
+    pthread_t       threads[MAX_PROFILES];    // unused for the primary profile
+    size_t          count;
+    size_t          started;                  // threads[1] up to threads[started - 1] are running
+} Profiles;
+
+static void init_toxbot_state(struct Tox_Bot *bot)
 {
-    Tox_Bot.start_time = get_time();
-    Tox_Bot.last_connected = get_time();
-    Tox_Bot.default_groupnum = 0;
-    Tox_Bot.chats_idx = 0;
-    Tox_Bot.num_online_friends = 0;
+    bot->start_time = get_time();
+    bot->last_connected = get_time();
+    bot->default_groupnum = 0;
+    bot->chats_idx = 0;
+    bot->num_online_friends = 0;
 
     /* 1 year default; anything lower should be explicitly set until we have a config file */
-    Tox_Bot.inactive_limit = 31536000;
+    bot->inactive_limit = 31536000;
+
+    // add by liqsliu
+    bot->public_group_num = bot->last_connected;
+    bot->my_num = UINT32_MAX;
+    bot->joined_group = false;
 }
 
-static void catch_SIGINT(int sig)
+static void catch_exit_signal(int sig)
 {
+    exit_signal = sig;
     FLAG_EXIT = true;
 }
 
-static void exit_toxbot(Tox *m)
+static void join_queue_free(struct Tox_Bot *bot);
+
+static void exit_toxbot(void)
 {
-    save_data(m, DATA_FILE);
-    tox_kill(m);
+    workers_kill();
+    snapshot_kill();
+
+    for (size_t i = 0; i < Profiles.count; ++i) {
+        struct Tox_Bot *bot = &Profiles.bots[i];
+
+        workers_dispatch(&bot->results);
+        join_queue_free(bot);
+
+        /* written here and now, whether or not a save_data_later() is still pending */
+        if (save_data(bot->m, bot->data_file) == 0) {
+            journal_discard(&bot->journal);
+        } else {
+            journal_close(&bot->journal);
+        }
+
+        snapshot_free(&bot->snapshot);
+        tox_kill(bot->m);
+        acl_friends_free(&bot->friends);
+    }
+
+    acl_free();
+    sources_kill();
+    bridge_kill();
+    bridge_socket_kill();
+    event_loop_free();
+    inbound_free();
+    outbox_free();
+    timers_free();
+
+    /* the restart script tells a restart (SIGTERM) from a clean stop by our exit status */
+    if (exit_signal == SIGTERM) {
+        signal(SIGTERM, SIG_DFL);
+        raise(SIGTERM);
+    }
+
     exit(EXIT_SUCCESS);
 }
 
 // add by liqsliu
 #include <pthread.h>
 bool gm_lock=false;
-/** uint32_t PUBLIC_GROUP_NUM = UINT32_MAX; */
-uint32_t PUBLIC_GROUP_NUM=0;
-uint32_t MY_NUM=UINT32_MAX;
-bool joined_group=false;
 /* #include <curl/curl.h> */
 
+/* Messages still queued for the old public group number follow it to the new one */
+static void set_public_group(struct Tox_Bot *bot, uint32_t gn)
+{
+    outbox_move(OUTBOX_GROUP, bot->public_group_num, gn);
+    bot->public_group_num = gn;
+}
+
+/* The public group rejected a message because it is gone or disconnected: rejoin it */
+static void cb_outbox_lost(Tox *m, Outbox_Type type, uint32_t number, void *userdata)
+{
+    struct Tox_Bot *bot = userdata;
+
+    if (type == OUTBOX_GROUP && number == bot->public_group_num) {
+        bot->joined_group = false;
+    }
+}
+
 
 // add by liqsliu
 
 /* Returns true if friendnumber's Tox ID is in the masterkeys list. */
-bool friend_is_master(Tox *m, uint32_t friendnumber)
+bool friend_is_master(struct Tox_Bot *bot, uint32_t friendnumber)
 {
-    char public_key[TOX_PUBLIC_KEY_SIZE];
-
-    if (tox_friend_get_public_key(m, friendnumber, (uint8_t *) public_key, NULL) == 0) {
+    if (!acl_friend_is_cached(&bot->friends, friendnumber)
+            && acl_friend_add(&bot->friends, bot->m, friendnumber) != 0) {
         return false;
     }
 
-    return file_contains_key(public_key, MASTERLIST_FILE) == 1;
+    return acl_friend_is_master(&bot->friends, friendnumber);
 }
 
 /* Returns true if public_key is in the blockedkeys list. */
 static bool public_key_is_blocked(const char *public_key)
 {
-    return file_contains_key(public_key, BLOCKLIST_FILE) == 1;
+    return acl_is_blocked((const uint8_t *) public_key);
 }
 
 /* START CALLBACKS */
 static void cb_self_connection_change(Tox *m, TOX_CONNECTION connection_status, void *userdata)
 {
+    struct Tox_Bot *bot = userdata;
+
     switch (connection_status) {
         case TOX_CONNECTION_NONE:
             log_timestamp("Connection lost");
-            Tox_Bot.last_bootstrap = get_time(); // usually we don't need to manually bootstrap if connection lost
+            timer_delay(bot->bootstrap_timer, BOOTSTRAP_INTERVAL * 1000); // usually we don't need to manually bootstrap if connection lost
             break;
 
         case TOX_CONNECTION_TCP:
-            Tox_Bot.last_connected = get_time();
+            bot->last_connected = get_time();
             log_timestamp("Connection established (TCP)");
             break;
 
         case TOX_CONNECTION_UDP:
-            Tox_Bot.last_connected = get_time();
+            bot->last_connected = get_time();
             log_timestamp("Connection established (UDP)");
             break;
     }
@@ -149,7 +255,9 @@ static void cb_self_connection_change(Tox *m, TOX_CONNECTION connection_status,
 
 static void cb_friend_connection_change(Tox *m, uint32_t friendnumber, TOX_CONNECTION connection_status, void *userdata)
 {
-    Tox_Bot.num_online_friends = 0;
+    struct Tox_Bot *bot = userdata;
+
+    bot->num_online_friends = 0;
 
     size_t i, size = tox_self_get_friend_list_size(m);
 
@@ -162,45 +270,84 @@ static void cb_friend_connection_change(Tox *m, uint32_t friendnumber, TOX_CONNE
 
     for (i = 0; i < size; ++i) {
         if (tox_friend_get_connection_status(m, list[i], NULL) != TOX_CONNECTION_NONE) {
-            ++Tox_Bot.num_online_friends;
+            ++bot->num_online_friends;
         }
     }
 }
 
+/*
+ * Folds the friend journal into a full save. The journal taken aside by the previous
+ * compaction is only dropped once the save made then is on disk; until then we wait.
+ */
+static void journal_compact(struct Tox_Bot *bot)
+{
+    if (bot->journal.entries == 0 || snapshot_written(&bot->snapshot) < bot->journal_seq) {
+        return;
+    }
+
+    if (journal_rotate(&bot->journal) != 0) {
+        return;
+    }
+
+    snapshot_save(&bot->snapshot, bot->m);
+    bot->journal_seq = bot->snapshot.taken;
+}
+
+/* Records a friend list change, falling back to a full save if the journal can't take it */
+static void journal_friend(struct Tox_Bot *bot, Journal_Op op, const uint8_t *public_key)
+{
+    if (journal_append(&bot->journal, op, public_key) != 0) {
+        save_data_later(bot);
+        return;
+    }
+
+    if (bot->journal.entries >= JOURNAL_MAX_ENTRIES) {
+        journal_compact(bot);
+    }
+}
+
 static void cb_friend_request(Tox *m, const uint8_t *public_key, const uint8_t *data, size_t length,
                               void *userdata)
 {
+    struct Tox_Bot *bot = userdata;
+
     if (public_key_is_blocked((char *) public_key)) {
         return;
     }
 
     TOX_ERR_FRIEND_ADD err;
-    tox_friend_add_norequest(m, public_key, &err);
+    uint32_t friendnumber = tox_friend_add_norequest(m, public_key, &err);
 
     if (err != TOX_ERR_FRIEND_ADD_OK) {
         log_error_timestamp(err, "tox_friend_add_norequest failed");
     } else {
+        acl_friend_add(&bot->friends, m, friendnumber);
+        journal_friend(bot, JOURNAL_FRIEND_ADD, public_key);
         log_timestamp("Accepted friend request");
     }
-
-    save_data(m, DATA_FILE);
 }
 
 static void cb_friend_message(Tox *m, uint32_t friendnumber, TOX_MESSAGE_TYPE type, const uint8_t *string,
                               size_t length, void *userdata)
 {
+    struct Tox_Bot *bot = userdata;
+
     if (type != TOX_MESSAGE_TYPE_NORMAL) {
         return;
     }
 
-    char public_key[TOX_PUBLIC_KEY_SIZE];
-
-    if (tox_friend_get_public_key(m, friendnumber, (uint8_t *) public_key, NULL) == 0) {
+    if (!acl_friend_is_cached(&bot->friends, friendnumber) && acl_friend_add(&bot->friends, m, friendnumber) != 0) {
         return;
     }
 
-    if (public_key_is_blocked(public_key)) {
-        tox_friend_delete(m, friendnumber, NULL);
+    if (acl_friend_is_blocked(&bot->friends, friendnumber)) {
+        uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+
+        if (tox_friend_get_public_key(m, friendnumber, public_key, NULL) && tox_friend_delete(m, friendnumber, NULL)) {
+            journal_friend(bot, JOURNAL_FRIEND_DELETE, public_key);
+        }
+
+        acl_friend_remove(&bot->friends, friendnumber);
         return;
     }
 
@@ -215,7 +362,7 @@ static void cb_friend_message(Tox *m, uint32_t friendnumber, TOX_MESSAGE_TYPE ty
     }
 
     /** if (length && execute(m, friendnumber, message, length) == -1) { */
-    if (execute(m, friendnumber, message, length) == -1) {
+    if (execute(bot, friendnumber, message, length) == -1) {
         const char *outmsg="？";
         tox_friend_send_message(m, friendnumber, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
     }
@@ -224,7 +371,9 @@ static void cb_friend_message(Tox *m, uint32_t friendnumber, TOX_MESSAGE_TYPE ty
 static void cb_group_invite(Tox *m, uint32_t friendnumber, TOX_CONFERENCE_TYPE type,
                             const uint8_t *cookie, size_t length, void *userdata)
 {
-    if (!friend_is_master(m, friendnumber)) {
+    struct Tox_Bot *bot = userdata;
+
+    if (!friend_is_master(bot, friendnumber)) {
         return;
     }
 
@@ -250,7 +399,7 @@ static void cb_group_invite(Tox *m, uint32_t friendnumber, TOX_CONFERENCE_TYPE t
         }
     }
 
-    if (group_add(groupnum, type, NULL) == -1) {
+    if (group_add(bot, groupnum, type, NULL) == -1) {
         log_error_timestamp(-1, "Invite from %s failed (group_add failed)", name);
         tox_conference_delete(m, groupnum, NULL);
         return;
@@ -266,17 +415,19 @@ on_error:
 static void cb_group_titlechange(Tox *m, uint32_t groupnumber, uint32_t peernumber, const uint8_t *title,
                                  size_t length, void *userdata)
 {
+    struct Tox_Bot *bot = userdata;
+
     char message[TOX_MAX_MESSAGE_LENGTH];
     length = copy_tox_str(message, sizeof(message), (const char *) title, length);
 
-    int idx = group_index(groupnumber);
+    int idx = group_index(bot, groupnumber);
 
     if (idx == -1) {
         return;
     }
 
-    memcpy(Tox_Bot.g_chats[idx].title, message, length + 1);
-    Tox_Bot.g_chats[idx].title_len = length;
+    memcpy(bot->g_chats[idx].title, message, length + 1);
+    bot->g_chats[idx].title_len = length;
 }
 // add by liqsliu
 /* static void *my_daemon(void *mv) */
@@ -304,54 +455,28 @@ static void cb_group_titlechange(Tox *m, uint32_t groupnumber, uint32_t peernumb
 /*     log_timestamp("线程终止"); */
 /*     return 0; */
 /* } */
-void sendg(Tox *m, char *gmsg, size_t len)
+void sendg(struct Tox_Bot *bot, char *gmsg, size_t len)
 {
     /** log_timestamp("check...send msg to group: %s", gmsg); */
-    /** if (PUBLIC_GROUP_NUM != UINT32_MAX) */
-    if (joined_group == true) {
-        /* log_timestamp("send msg to public group: %d", PUBLIC_GROUP_NUM); */
-        logs("send msg to public group: %d: %s", PUBLIC_GROUP_NUM, gmsg);
-        Tox_Err_Group_Send_Message err2;
-        /** if (tox_group_send_message(m, PUBLIC_GROUP_NUM, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *)gmsg, len, &err2) != true) */
-        tox_group_send_message(m, PUBLIC_GROUP_NUM, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *)gmsg, len, &err2);
-        if (err2 != TOX_ERR_GROUP_SEND_MESSAGE_OK) {
-            /* log_timestamp("failed to send msg to group: %s", tox_err_group_send_message_to_string(err2)); */
-            logs("failed to send msg to group: %s", tox_err_group_send_message_to_string(err2));
-         /** rejoin_public_group(m, PUBLIC_GROUP_NUM); */
-         /** PUBLIC_GROUP_NUM = UINT32_MAX; */
-            joined_group = false;
-        } else {
-            log_timestamp("sent to group");
-        }
-
-    } else {
-        log_timestamp("not in the public group");
-    }
+    /* queued even while rejoining; outbox_move() carries the queue over to the new group number */
+    logs("send msg to public group: %d: %.*s", bot->public_group_num, (int) len, gmsg);
+    outbox_queue(OUTBOX_GROUP, bot->public_group_num, gmsg, len);
 }
-void sendgp(Tox *m, char *gmsg, size_t len)
+void sendgp(struct Tox_Bot *bot, char *gmsg, size_t len)
 {
-    printf("sendgp...\n");
-    /* if (PUBLIC_GROUP_NUM == 0) { */
     /* log_timestamp("send msg to conference: %d", Tox_Bot.default_groupnum); */
     /* logs(gmsg); */
-    logs("send msg to conference: %d: %s", Tox_Bot.default_groupnum, gmsg);
-    TOX_ERR_CONFERENCE_SEND_MESSAGE err;
-    /* tox_conference_send_message(m, 0, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *)gmsg, strlen(gmsg), &err); */
-    tox_conference_send_message(m, Tox_Bot.default_groupnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *)gmsg, len, &err);
-    if (err != TOX_ERR_CONFERENCE_SEND_MESSAGE_OK) {
-       log_timestamp("failed send conference msg: %s", tox_err_conference_send_message_to_string(err));
-    } else {
-        log_timestamp("sent to conference");
-    }
+    logs("send msg to conference: %d: %.*s", bot->default_groupnum, (int) len, gmsg);
+    outbox_queue(OUTBOX_CONFERENCE, bot->default_groupnum, gmsg, len);
 }
-static void send_msg_from_mt_to_tox(Tox *m, char *gmsg, size_t len)
+static void send_msg_from_mt_to_tox(struct Tox_Bot *bot, char *gmsg, size_t len)
 {
     if (len >= 1)
     {
-        sendg(m, gmsg, len);
-        sendgp(m, gmsg, len);
+        sendg(bot, gmsg, len);
+        sendgp(bot, gmsg, len);
     } else {
-        log_timestamp("ignore empty msg: %s", gmsg);
+        log_timestamp("ignore empty msg");
     }
 }
 
@@ -363,17 +488,16 @@ static void print_chat_id(Tox *m, uint32_t gn)
     /** bool res = tox_group_self_get_public_key(m, gn, (uint8_t *)public_key, NULL); */
     bool res = tox_group_get_chat_id(m, gn, (uint8_t *)public_key, NULL);
     log_timestamp("get chat_id res: %x", res);
-    log_timestamp("%d %X", sizeof(public_key), public_key);
-    for (int i=0; i<sizeof(public_key); i++)
-    {
-        printf("%hhX", public_key[i]);
-    }
-    printf("\n");
+    char chat_id[TOX_GROUP_CHAT_ID_SIZE * 2 + 1];
+    hex_encode(chat_id, (uint8_t *) public_key, sizeof(public_key));
+    printf("%s\n", chat_id);
 
 }
 
-int rejoin_public_group(Tox *m, Tox_Group_Number gn)
+int rejoin_public_group(struct Tox_Bot *bot, Tox_Group_Number gn)
 {
+    Tox *m = bot->m;
+
     if(tox_group_is_connected(m, gn, NULL) == true)
     {
         log_timestamp("connected, really?");
@@ -391,7 +515,7 @@ int rejoin_public_group(Tox *m, Tox_Group_Number gn)
             print_chat_id(m, gn);
             log_timestamp("现在群数量: %d", tox_group_get_number_groups(m));
         } else {
-            joined_group = false;
+            bot->joined_group = false;
             log_timestamp("2failed，group number: %d", gn);
             log_timestamp("现在群数量: %d", tox_group_get_number_groups(m));
             return -1;
@@ -400,14 +524,17 @@ int rejoin_public_group(Tox *m, Tox_Group_Number gn)
     log_timestamp("rejoined ok");
     return 0;
 }
-int join_public_group_by_chat_id(Tox *m, char *chat_id)
+int join_public_group_by_chat_id(struct Tox_Bot *bot, char *chat_id)
 {
-    if (strlen(chat_id) < 16) {
+    Tox *m = bot->m;
+    uint8_t key_bin[TOX_GROUP_CHAT_ID_SIZE];
+
+    if (hex_decode_str(key_bin, chat_id, sizeof(key_bin)) != 0) {
         log_timestamp("wrong chat_id: %s", chat_id);
         return -1;
     }
     if (strcmp(chat_id, CHAT_ID) == 0) {
-        joined_group = true;
+        bot->joined_group = true;
     }
     /** log_timestamp("开始加入: %s", CHAT_ID); */
     log_timestamp("开始加入: %s", chat_id);
@@ -418,10 +545,6 @@ int join_public_group_by_chat_id(Tox *m, char *chat_id)
     /** if (PUBLIC_GROUP_NUM + 10 > get_time()) */
     /** log_timestamp("开始加入: %d", PUBLIC_GROUP_NUM); */
     /** log_timestamp("%s", (uint8_t *)CHAT_ID); */
-    /* char *key_bin = hex_string_to_bin(chat_id); */
-    /** char key_bin[TOX_GROUP_CHAT_ID_SIZE*2+1]; */
-    char key_bin[65];
-    hex_string_to_bin2(chat_id, key_bin);
     /* log_timestamp("%s", key_bin); */
     /** PUBLIC_GROUP_NUM = tox_group_join(m, (uint8_t *)CHAT_ID, (uint8_t *)name, strlen(name), NULL, 0, NULL); */
     Tox_Err_Group_Join err;
@@ -438,20 +561,20 @@ int join_public_group_by_chat_id(Tox *m, char *chat_id)
     /** } */
     uint32_t res = tox_group_join(m, (uint8_t *)key_bin, (uint8_t *)BOT_NAME, strlen(BOT_NAME), NULL, 0, &err);
     if (strcmp(chat_id, CHAT_ID) == 0) {
-        PUBLIC_GROUP_NUM = res;
+        set_public_group(bot, res);
     }
     if (res == UINT32_MAX || err != TOX_ERR_GROUP_JOIN_OK)
     {
         if (strcmp(chat_id, CHAT_ID) == 0) {
-            joined_group = false;
+            bot->joined_group = false;
         }
         /** log_timestamp("加入失败，group number: %d", PUBLIC_GROUP_NUM); */
         log_timestamp("加入失败，public group number: %d, %s", res, tox_err_group_join_to_string(err));
         /** PUBLIC_GROUP_NUM = get_time(); */
-        if (MY_NUM != UINT32_MAX) {
+        if (bot->my_num != UINT32_MAX) {
             char outmsg[TOX_MAX_MESSAGE_LENGTH];
             snprintf(outmsg, TOX_MAX_MESSAGE_LENGTH-1, "加入失败，public group number: %d, E: %s", res, tox_err_group_join_to_string(err));
-            tox_friend_send_message(m, MY_NUM, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+            tox_friend_send_message(m, bot->my_num, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
         }
         return -1;
     } else {
@@ -463,9 +586,155 @@ int join_public_group_by_chat_id(Tox *m, char *chat_id)
     return 0;
 }
 
-int join_public_group(Tox *m)
+/*
+ * Group joins and invite accepts are queued and made one at a time from a timer, so a
+ * callback never has to wait for toxcore, and a long group_chat_ids file does not join
+ * everything in one burst. An invite to the public group first leaves it, then comes
+ * back JOIN_SETTLE_MS later to accept.
+ */
+typedef enum Join_Kind {
+    JOIN_CHAT_ID,
+    JOIN_INVITE,
+} Join_Kind;
+
+struct Group_Join {
+    struct Group_Join  *next;
+    Join_Kind          kind;
+    char               chat_id[TOX_GROUP_CHAT_ID_SIZE * 2 + 1];
+    uint32_t           friend_number;    // the rest is for invites only
+    bool               left;             // the public group has been left
+    size_t             length;
+    uint8_t            invite_data[];
+};
+
+static void timer_join(void *userdata);
+
+static void join_schedule(struct Tox_Bot *bot, uint32_t delay_ms)
+{
+    if (bot->join_timer == 0) {
+        bot->join_timer = timer_add(delay_ms, timer_join, bot);
+    }
+}
+
+/* Invites from a master go ahead of queued chat ID joins, behind any invites already waiting */
+static void join_queue(struct Tox_Bot *bot, struct Group_Join *join)
+{
+    struct Group_Join **tail = &bot->joins;
+
+    while (*tail != NULL && (join->kind != JOIN_INVITE || (*tail)->kind == JOIN_INVITE)) {
+        tail = &(*tail)->next;
+    }
+
+    join->next = *tail;
+    *tail = join;
+
+    join_schedule(bot, 0);
+}
+
+static bool join_is_queued(const struct Tox_Bot *bot, Join_Kind kind)
+{
+    for (const struct Group_Join *join = bot->joins; join != NULL; join = join->next) {
+        if (join->kind == kind) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void join_queue_chat_id(struct Tox_Bot *bot, const char *chat_id)
 {
-    join_public_group_by_chat_id(m, CHAT_ID);
+    struct Group_Join *join = calloc(1, sizeof(struct Group_Join));
+
+    if (join == NULL) {
+        log_error_timestamp(-1, "Failed to allocate group join");
+        return;
+    }
+
+    join->kind = JOIN_CHAT_ID;
+    snprintf(join->chat_id, sizeof(join->chat_id), "%s", chat_id);
+    join_queue(bot, join);
+}
+
+static void join_queue_free(struct Tox_Bot *bot)
+{
+    while (bot->joins != NULL) {
+        struct Group_Join *join = bot->joins;
+        bot->joins = join->next;
+        free(join);
+    }
+
+    /* the timer, if any, goes with the wheel of the thread that ran the profile */
+    bot->join_timer = 0;
+}
+
+static void invite_accept(struct Tox_Bot *bot, const struct Group_Join *join)
+{
+    Tox *m = bot->m;
+
+    Tox_Err_Group_Invite_Accept err;
+    set_public_group(bot, tox_group_invite_accept(m, join->friend_number, join->invite_data, join->length, (uint8_t *)BOT_NAME, strlen(BOT_NAME), NULL, 0, &err));
+    if (bot->public_group_num == UINT32_MAX)
+    {
+        log_timestamp("加入失败，group number: %d, %s", bot->public_group_num, tox_err_group_invite_accept_to_string(err));
+        bot->joined_group = false;
+    
+    } else
+    {
+        log_timestamp("已加入public group，group number: %d", bot->public_group_num);
+        rejoin_public_group(bot, bot->public_group_num);
+    }
+}
+
+static void timer_join(void *userdata)
+{
+    struct Tox_Bot *bot = userdata;
+    Tox *m = bot->m;
+
+    bot->join_timer = 0;
+
+    struct Group_Join *join = bot->joins;
+
+    if (join == NULL) {
+        return;
+    }
+
+    if (join->kind == JOIN_INVITE && !join->left) {
+        join->left = true;
+
+        if(tox_group_is_connected(m, bot->public_group_num, NULL) == true)
+        {
+            bool res = tox_group_disconnect(m, bot->public_group_num, NULL);
+            log_timestamp("尝试断开: %d", res);
+            join_schedule(bot, JOIN_SETTLE_MS);
+            return;
+        }
+    }
+
+    bot->joins = join->next;
+
+    if (join->kind == JOIN_INVITE) {
+        invite_accept(bot, join);
+    } else {
+        join_public_group_by_chat_id(bot, join->chat_id);
+    }
+
+    free(join);
+
+    if (bot->joins != NULL) {
+        join_schedule(bot, JOIN_SPACING_MS);
+    }
+}
+
+/* Joins the public group now, and queues the groups listed in group_chat_ids */
+int join_public_group(struct Tox_Bot *bot)
+{
+    join_public_group_by_chat_id(bot, CHAT_ID);
+
+    /* still working through the list from last time */
+    if (join_is_queued(bot, JOIN_CHAT_ID)) {
+        return 0;
+    }
 
     char *path="group_chat_ids";
     FILE *fp = fopen(path, "r");
@@ -497,9 +766,9 @@ int join_public_group(Tox *m)
         if (strlen(chat_id) == 0) {
             continue;
         }
-        join_public_group_by_chat_id(m, chat_id);
+        join_queue_chat_id(bot, chat_id);
     }
-    pclose(fp);
+    fclose(fp);
 
     /** log_timestamp("开始加入: %s", CHAT_ID2); */
     /** [> log_timestamp("%s", (uint8_t *)CHAT_ID2); <] */
@@ -521,42 +790,50 @@ int join_public_group(Tox *m)
     return 0;
 }
 
+/* Messages queued while we were out of the group go out now, in order */
+static void cb_group_self_join(Tox *m, Tox_Group_Number group_number, void *user_data)
+{
+    log_timestamp("joined group %d, %zu messages waiting", group_number, outbox_pending());
+    outbox_resume(OUTBOX_GROUP, group_number);
+}
+
+static void cb_conference_connected(Tox *m, Tox_Conference_Number conference_number, void *user_data)
+{
+    log_timestamp("conference %d connected", conference_number);
+    outbox_resume(OUTBOX_CONFERENCE, conference_number);
+}
+
 static void cb_group_invite2(
     Tox *m, Tox_Friend_Number friend_number,
     const uint8_t invite_data[], size_t invite_data_length,
     const uint8_t group_name[], size_t group_name_length,
     void *user_data)
 {
+    struct Tox_Bot *bot = user_data;
+
     log_timestamp("收到邀请: %d", friend_number);
-    if (!friend_is_master(m, friend_number)) {
+    if (!friend_is_master(bot, friend_number)) {
         log_timestamp("invite is not from master: %d", friend_number);
         return;
     }
-    log_timestamp("开始加入: %d", PUBLIC_GROUP_NUM);
-    log_timestamp("开始加入: %d %d", PUBLIC_GROUP_NUM, friend_number);
+    log_timestamp("开始加入: %d", bot->public_group_num);
+    log_timestamp("开始加入: %d %d", bot->public_group_num, friend_number);
     /** log_timestamp("开始加入: %d %s", PUBLIC_GROUP_NUM, friend_number); */
     /** PUBLIC_GROUP_NUM = tox_group_invite_accept(m, friend_number, invite_data, invite_data_length, (uint8_t *)BOT_NAME, strlen(BOT_NAME), NULL, 0, NULL); */
     /** log_timestamp("group number: %d", PUBLIC_GROUP_NUM); */
     /** return; */
-    if(tox_group_is_connected(m, PUBLIC_GROUP_NUM, NULL) == true)
-    {
-        bool res = tox_group_disconnect(m, PUBLIC_GROUP_NUM, NULL);
-        log_timestamp("尝试断开: %d", res);
-        sleep(1);
-    }
-    Tox_Err_Group_Invite_Accept err;
-    PUBLIC_GROUP_NUM = tox_group_invite_accept(m, friend_number, invite_data, invite_data_length, (uint8_t *)BOT_NAME, strlen(BOT_NAME), NULL, 0, &err);
-    if (PUBLIC_GROUP_NUM == UINT32_MAX)
-    {
-        log_timestamp("加入失败，group number: %d, %s", PUBLIC_GROUP_NUM, tox_err_group_invite_accept_to_string(err));
-        joined_group = false;
-    
-    } else
-    {
-        log_timestamp("已加入public group，group number: %d", PUBLIC_GROUP_NUM);
-        rejoin_public_group(m, PUBLIC_GROUP_NUM);
+    struct Group_Join *join = calloc(1, sizeof(struct Group_Join) + invite_data_length);
+
+    if (join == NULL) {
+        log_error_timestamp(-1, "Failed to allocate group join");
+        return;
     }
 
+    join->kind = JOIN_INVITE;
+    join->friend_number = friend_number;
+    join->length = invite_data_length;
+    memcpy(join->invite_data, invite_data, invite_data_length);
+    join_queue(bot, join);
 }
 
 
@@ -565,13 +842,15 @@ static void cb_conference_message(
     Tox *m, Tox_Conference_Number conference_number, Tox_Conference_Peer_Number peer_number,
     Tox_Message_Type type, const uint8_t message[], size_t length, void *user_data)
 {
+    struct Tox_Bot *bot = user_data;
+
     /* log_timestamp("conference msg: %d %d %s", conference_number, peer_number, message); */
     char text[TOX_MAX_MESSAGE_LENGTH];
     length = copy_tox_str(text, sizeof(text), (const char *) message, length);
     text[length] = '\0';
     log_timestamp("conference msg: %d %d %s", conference_number, peer_number, text);
     /** int idx = group_index(peer_number); //得到的是发信人在群成员列表的位置*/
-    int idx = group_index(conference_number);
+    int idx = group_index(bot, conference_number);
     if (idx == -1) {
         return;
     }
@@ -599,20 +878,14 @@ static void cb_conference_message(
         logs("群消息: %s [%s]: %s", title, name, text);
         if (strcmp(name, "bot") != 0)
         {
-            char smsg[2048] = SM_SH_PATH;
-            /** char smsg[2048] = "bash /run/user/1000/bot/sm.sh \"$(cat <<EOF\n"; */
-            strcat(smsg, name);
-            strcat(smsg, "\nEOF\n)\" \"$(cat <<EOF\n");
-            strcat(smsg, (char *)text);
-            strcat(smsg, "\nEOF\n)\"");
-            system(smsg);
-            printf("sm.sh ok\n");
+            char smsg[2048];
+            bridge_send(name, title, text);
             smsg[0] = '\0';
             strcat(smsg, "**T ");
             strcat(smsg, name);
             strcat(smsg, ":** ");
             strcat(smsg, (char *)text);
-            sendg(m, smsg, strlen(smsg));
+            sendg(bot, smsg, strlen(smsg));
         }
     } else {
         logs("忽略来自其他群的消息: %d %s [%s]: %s", idx, title, name, text);
@@ -622,6 +895,8 @@ static void cb_group_message(
     Tox *m, Tox_Group_Number group_number, Tox_Group_Peer_Number peer_id, Tox_Message_Type message_type,
     const uint8_t message[], size_t message_length, Tox_Group_Message_Id message_id, void *user_data)
 {
+    struct Tox_Bot *bot = user_data;
+
     char text[TOX_MAX_MESSAGE_LENGTH];
     message_length = copy_tox_str(text, sizeof(text), (const char *) message, message_length);
     text[message_length] = '\0';
@@ -636,25 +911,20 @@ static void cb_group_message(
     len = tox_group_get_name_size(m, group_number, NULL);
     title[len] = '\0';
 
-    if (group_number == PUBLIC_GROUP_NUM)
+    if (group_number == bot->public_group_num)
     {
         /* log_timestamp("ngc群消息: %s [%s]: %s", title, name, text); */
         logs("ngc群消息: %s [%s]: %s", title, name, text);
         if (strcmp(name, "bot") != 0)
         {
-            char smsg[2048] = SM_SH_PATH;
-            /** char smsg[2048] = "bash /run/user/1000/bot/sm.sh \"$(cat <<EOF\n"; */
-            strcat(smsg, name);
-            strcat(smsg, "\nEOF\n)\" \"$(cat <<EOF\n");
-            strcat(smsg, (char *)text);
-            strcat(smsg, "\nEOF\n)\"");
-            system(smsg);
+            char smsg[2048];
+            bridge_send(name, title, text);
             smsg[0] = '\0';
             strcat(smsg, "**T ");
             strcat(smsg, name);
             strcat(smsg, ":** ");
             strcat(smsg, (char *)text);
-            sendgp(m, smsg, strlen(smsg));
+            sendgp(bot, smsg, strlen(smsg));
         }
     } else {
         logs("忽略来自其他ngc群的消息: %d %s [%s]: %s", group_number, title, name, text);
@@ -663,86 +933,99 @@ static void cb_group_message(
 
 
 
-static void *my_daemon(void *mv)
+/* Returns the number of the NGC group whose chat ID is the hex string chat_id, or UINT32_MAX */
+static uint32_t find_group_by_chat_id(Tox *m, const char *chat_id)
 {
-    while(PUBLIC_GROUP_NUM == Tox_Bot.last_connected)
-    {
-        sleep(1);
-        log_timestamp("等待tox初始化完成");
-    }
-    Tox *m = (Tox *)mv;
-    FILE *fd;
-    char gmsg[TOX_MAX_MESSAGE_LENGTH];
-    char gmsgtmp[TOX_MAX_MESSAGE_LENGTH];
-    size_t len1, len;
-    log_timestamp("my daemon is running...");
-    while(1)
-    {
-        /** fd_gm = popen("/run/user/1000/bot/gm_stream.sh", "r"); */
-        fd = popen(GM_SH_PATH, "r");
-        if (fd == NULL)
-        {
-            log_timestamp("不能执行gm.sh");
-            return 0;
+    uint8_t key_bin[TOX_GROUP_CHAT_ID_SIZE];
+
+    if (hex_decode_str(key_bin, chat_id, sizeof(key_bin)) != 0) {
+        return UINT32_MAX;
+    }
+
+    uint32_t n = tox_group_get_number_groups(m);
+
+    for (uint32_t i = 0; i < n; ++i) {
+        uint8_t id[TOX_GROUP_CHAT_ID_SIZE];
+
+        if (tox_group_get_chat_id(m, i, id, NULL) && memcmp(id, key_bin, sizeof(id)) == 0) {
+            return i;
         }
-        log_timestamp("gm.sh is running...");
-        gmsg[0] = '\0';
-        gmsgtmp[0] = '\0';
-        len1 = strlen(gmsgtmp);
-        len = strlen(gmsg);
-        while(1)
-        {
-            if (fgets(gmsg, TOX_MAX_MESSAGE_LENGTH, fd) == NULL)
-            {
-                log_timestamp("got msg:");
-                logs(gmsg);
-                log_timestamp("shell exit");
-                break;
-            }
-            log_timestamp("got msg:");
-            logs(gmsg);
-            len = strlen(gmsg);
-            if (len1 > 0) {
-                if (strcmp(gmsg, "EOF_FOR_TOX\n") == 0) {
-                    log_timestamp("found EOF");
-                    if (len1 > 1) {
-                        if (gmsgtmp[len1-1] == '\n' && gmsgtmp[len1-2] == '\n') {
-                            gmsgtmp[len1-2] = '\0';
-                            log_timestamp("send last line:");
-                            logs(gmsgtmp);
-                            send_msg_from_mt_to_tox(m, gmsgtmp, len1-2);
-                            /** if (len1 != 2) { */
-                            /** } else { */
-                            /**     log_timestamp("ignore empty msg"); */
-                            /** } */
-                            gmsgtmp[0] = '\0';
-                            len1 = 0;
-                            continue;
-                        }
-                    }
-                }
-                if (len1+len > TOX_MAX_MESSAGE_LENGTH) {
-                    send_msg_from_mt_to_tox(m, gmsgtmp, len1);
-                    gmsgtmp[0] = '\0';
-                    len1 = 0;
-                }
+    }
+
+    return UINT32_MAX;
+}
+
+/*
+ * Queues text for every target in the comma separated list targets (see sources.h). An
+ * empty list means the public group and the default conference.
+ */
+static void send_to_targets(struct Tox_Bot *bot, const char *targets, char *text, size_t length)
+{
+    if (targets[0] == '\0') {
+        send_msg_from_mt_to_tox(bot, text, length);
+        return;
+    }
+
+    char buf[SOURCE_MAX_TARGETS];
+    snprintf(buf, sizeof(buf), "%s", targets);
+
+    char *save = NULL;
+
+    for (char *t = strtok_r(buf, ",", &save); t != NULL; t = strtok_r(NULL, ",", &save)) {
+        if (strcmp(t, "public") == 0) {
+            sendg(bot, text, length);
+        } else if (strcmp(t, "conference") == 0) {
+            sendgp(bot, text, length);
+        } else if (strncmp(t, "conference:", 11) == 0) {
+            outbox_queue(OUTBOX_CONFERENCE, strtoul(t + 11, NULL, 10), text, length);
+        } else if (strncmp(t, "group:", 6) == 0) {
+            uint32_t gn = find_group_by_chat_id(bot->m, t + 6);
+
+            if (gn == UINT32_MAX) {
+                log_timestamp("not in group %s", t + 6);
+                continue;
             }
-            strcat(gmsgtmp, gmsg);
-            len1 = strlen(gmsgtmp);
-            /** gmsg[0] = '\0'; */
-        }
-        if (len1 > 0) {
-            /** send_msg_from_mt_to_tox(m, gmsg, strlen(gmsg)); */
-            send_msg_from_mt_to_tox(m, gmsgtmp, len1);
+
+            outbox_queue(OUTBOX_GROUP, gn, text, length);
+        } else {
+            log_timestamp("unknown message target: %s", t);
         }
-        pclose(fd);
-        log_timestamp("shell终止");
-        sleep(1);
     }
-    log_timestamp("线程终止");
-    return 0;
 }
 
+/* Posts a message from a bridge peer or inbound source to its targets in the primary profile */
+static void cb_bridge_inbound(void *userdata, uint64_t seq, const char *sender, const char *group, const char *text,
+                              size_t length)
+{
+    struct Tox_Bot *bot = userdata;
+
+    /* the spool record is only committed once every part queued for it has left the outbox */
+    outbox_set_seq(seq);
+
+    if (sender[0] == '\0') {
+        send_to_targets(bot, group, (char *) text, length);
+        outbox_set_seq(0);
+        return;
+    }
+
+    size_t sender_len = strlen(sender);
+    char *msg = malloc(sender_len + 2 + length + 1);
+
+    if (msg == NULL) {
+        outbox_set_seq(0);
+        return;
+    }
+
+    memcpy(msg, sender, sender_len);
+    memcpy(msg + sender_len, ": ", 2);
+    memcpy(msg + sender_len + 2, text, length + 1);
+
+    send_to_targets(bot, group, msg, sender_len + 2 + length);
+    outbox_set_seq(0);
+    free(msg);
+}
+
+
 
 /* static void get_msg_from_mt(Tox *m) */
 /* { */
@@ -812,46 +1095,48 @@ static void *my_daemon(void *mv)
 
 int save_data(Tox *m, const char *path)
 {
-    if (path == NULL) {
-        goto on_error;
-    }
-
-    FILE *fp = fopen(path, "wb");
+    size_t data_len = tox_get_savedata_size(m);
+    uint8_t *data = malloc(data_len);
 
-    if (fp == NULL) {
+    if (data == NULL) {
+        log_error_timestamp(-1, "Warning: save_data failed");
         return -1;
     }
 
-    size_t data_len = tox_get_savedata_size(m);
-    char *data = malloc(data_len);
+    tox_get_savedata(m, data);
 
-    if (data == NULL) {
-        goto on_error;
-    }
+    int ret = snapshot_write_file(path, data, data_len);
+
+    free(data);
+    return ret;
+}
 
-    tox_get_savedata(m, (uint8_t *) data);
+static void timer_save(void *userdata)
+{
+    struct Tox_Bot *bot = userdata;
 
-    if (fwrite(data, data_len, 1, fp) != 1) {
-        free(data);
-        fclose(fp);
-        goto on_error;
+    bot->save_timer = 0;
+    snapshot_save(&bot->snapshot, bot->m);
+}
+
+void save_data_later(struct Tox_Bot *bot)
+{
+    if (bot->save_timer != 0) {
+        return;
     }
 
-    free(data);
-    fclose(fp);
-    return 0;
+    bot->save_timer = timer_add(SAVE_DELAY * 1000, timer_save, bot);
 
-on_error:
-    log_error_timestamp(-1, "Warning: save_data failed");
-    return -1;
+    if (bot->save_timer == 0) {
+        snapshot_save(&bot->snapshot, bot->m);
+    }
 }
 
-static Tox *load_tox(struct Tox_Options *options, char *path)
+static Tox *load_tox(struct Tox_Options *options, const char *path)
 {
-    FILE *fp = fopen(path, "rb");
     Tox *m = NULL;
 
-    if (fp == NULL) {
+    if (!file_exists(path)) {
         TOX_ERR_NEW err;
         m = tox_new(options, &err);
 
@@ -864,40 +1149,37 @@ static Tox *load_tox(struct Tox_Options *options, char *path)
         return m;
     }
 
-    off_t data_len = file_size(path);
-
-    if (data_len == 0) {
-        fprintf(stderr, "tox_new failed: toxbot save file is empty\n");
-        fclose(fp);
-        return NULL;
-    }
-
-    char data[data_len];
+    /* mapped rather than copied, so a large profile neither lands on the stack nor is read twice */
+    struct File_Map map;
 
-    if (fread(data, sizeof(data), 1, fp) != 1) {
-        fclose(fp);
+    if (file_map(&map, path) != 0) {
+        fprintf(stderr, "tox_new failed: toxbot save file is empty or unreadable\n");
         return NULL;
     }
 
     TOX_ERR_NEW err;
     options->savedata_type = TOX_SAVEDATA_TYPE_TOX_SAVE;
-    options->savedata_data = (uint8_t *) data;
-    options->savedata_length = data_len;
+    options->savedata_data = map.data;
+    options->savedata_length = map.length;
 
     m = tox_new(options, &err);
 
+    options->savedata_data = NULL;
+    options->savedata_length = 0;
+    file_unmap(&map);
+
     if (err != TOX_ERR_NEW_OK) {
         fprintf(stderr, "tox_new failed2 with error %d\n", err);
         printf("TOX_ERR_NEW_PORT_ALLOC: %d\n", TOX_ERR_NEW_PORT_ALLOC);
         return NULL;
     }
 
-    fclose(fp);
     return m;
 }
 
-static void load_conferences(Tox *m)
+static void load_conferences(struct Tox_Bot *bot)
 {
+    Tox *m = bot->m;
     size_t num_chats = tox_conference_get_chatlist_size(m);
 
     if (num_chats == 0) {
@@ -924,7 +1206,7 @@ static void load_conferences(Tox *m)
             continue;
         }
 
-        if (group_add(groupnumber, type, NULL) != 0) {
+        if (group_add(bot, groupnumber, type, NULL) != 0) {
             fprintf(stderr, "Failed to autoload group %d\n", groupnumber);
             tox_conference_delete(m, groupnumber, NULL);
             continue;
@@ -938,11 +1220,26 @@ static void print_usage(void)
 {
     printf("usage: toxbot [OPTION] ...\n");
     printf("    -4, --ipv4              Force IPv4\n");
+    printf("    -B, --bridge-scripts    Also bridge through %s and %s\n", SM_WORKER_PATH, GM_SH_PATH);
+    printf("    -b, --compile-blocklist Compile %s into %s and exit\n", BLOCKLIST_FILE, BLOCKLIST_BIN_FILE);
+    printf("    -F, --parse-stream      Parse a captured %s stream from a file, print throughput and exit\n",
+           GM_SH_PATH);
     printf("    -h, --help              Show this message and exit\n");
+    printf("    -I, --inbound-source    Post messages from <fifo|exec|unix>:<path>[=<targets>] (repeatable)\n");
     printf("    -L, --no-lan            Disable LAN\n");
+    printf("    -o, --bridge-overflow   Full bridge queue policy: block, drop-oldest (default) or drop-newest\n");
     printf("    -P, --HTTP-proxy        Use HTTP proxy. Requires: [IP] [port]\n");
     printf("    -p, --SOCKS5-proxy      Use SOCKS proxy. Requires: [IP] [port]\n");
+    printf("    -r, --send-rate         Messages per second sent to each group, 0 for no limit (default %d)\n",
+           OUTBOX_DEFAULT_MESSAGE_RATE);
+    printf("    -R, --send-byte-rate    Bytes per second sent to each group, 0 for no limit (default %d)\n",
+           OUTBOX_DEFAULT_BYTE_RATE);
+    printf("    -s, --bridge-socket     Path of the bridge socket (default %s)\n", BRIDGE_SOCKET_PATH);
+    printf("    -q, --bridge-queue      Maximum number of undelivered bridge messages (default %d)\n",
+           BRIDGE_DEFAULT_QUEUE_SIZE);
     printf("    -t, --force-tcp         Force connections through TCP relays (DHT disabled)\n");
+    printf("    -x, --profile           Also run the profile saved in <file> (repeatable, up to %d profiles)\n",
+           MAX_PROFILES);
 }
 
 static void set_default_options(void)
@@ -953,6 +1250,13 @@ static void set_default_options(void)
 
     /* set any non-zero defaults here*/
     Options.proxy_type = TOX_PROXY_TYPE_NONE;
+    Options.bridge_queue_size = BRIDGE_DEFAULT_QUEUE_SIZE;
+    Options.bridge_overflow = BRIDGE_OVERFLOW_DROP_OLDEST;
+    Options.send_rate = OUTBOX_DEFAULT_MESSAGE_RATE;
+    Options.send_byte_rate = OUTBOX_DEFAULT_BYTE_RATE;
+    snprintf(Options.bridge_socket, sizeof(Options.bridge_socket), "%s", BRIDGE_SOCKET_PATH);
+    Options.profiles[0] = DATA_FILE;
+    Options.num_profiles = 1;
 }
 
 static void parse_args(int argc, char *argv[])
@@ -961,15 +1265,25 @@ static void parse_args(int argc, char *argv[])
 
     static struct option long_opts[] = {
         {"ipv4", no_argument, 0, '4'},
+        {"bridge-scripts", no_argument, 0, 'B'},
+        {"compile-blocklist", no_argument, 0, 'b'},
         {"help", no_argument, 0, 'h'},
+        {"parse-stream", required_argument, 0, 'F'},
+        {"inbound-source", required_argument, 0, 'I'},
         {"no-lan", no_argument, 0, 'L'},
+        {"bridge-overflow", required_argument, 0, 'o'},
+        {"bridge-queue", required_argument, 0, 'q'},
+        {"send-rate", required_argument, 0, 'r'},
+        {"send-byte-rate", required_argument, 0, 'R'},
+        {"bridge-socket", required_argument, 0, 's'},
         {"SOCKS5-proxy", required_argument, 0, 'p'},
         {"HTTP-proxy", required_argument, 0, 'P'},
         {"force-tcp", no_argument, 0, 't'},
+        {"profile", required_argument, 0, 'x'},
         {NULL, no_argument, NULL, 0},
     };
 
-    const char *options_string = "4hLtp:P:";
+    const char *options_string = "4BbhLtF:I:o:q:r:R:s:p:P:x:";
     int opt = 0;
     int indexptr = 0;
 
@@ -981,12 +1295,92 @@ static void parse_args(int argc, char *argv[])
                 break;
             }
 
+            case 'B': {
+                Options.bridge_scripts = true;
+
+                if (sources_add("exec:" GM_SH_PATH) != 0) {
+                    fprintf(stderr, "Too many inbound sources\n");
+                    exit(EXIT_FAILURE);
+                }
+
+                printf("Option set: Bridging through scripts\n");
+                break;
+            }
+
+            case 'b': {
+                exit(acl_compile_blocklist() == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+            }
+
+            case 'F': {
+                exit(stream_benchmark(optarg, STREAM_MAX_FRAME) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+            }
+
+            case 'I': {
+                if (sources_add(optarg) != 0) {
+                    fprintf(stderr, "Invalid inbound source: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+
+                printf("Option set: Inbound source %s\n", optarg);
+                break;
+            }
+
             case 'L': {
                 Options.disable_lan = true;
                 printf("Option set: LAN disabled\n");
                 break;
             }
 
+            case 'o': {
+                if (bridge_overflow_from_string(optarg, &Options.bridge_overflow) != 0) {
+                    fprintf(stderr, "Invalid bridge overflow policy: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+
+                printf("Option set: Bridge overflow policy %s\n", optarg);
+                break;
+            }
+
+            case 'q': {
+                long int size = strtol(optarg, NULL, 10);
+
+                if (size <= 0) {
+                    fprintf(stderr, "Invalid bridge queue size: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+
+                Options.bridge_queue_size = size;
+                printf("Option set: Bridge queue size %ld\n", size);
+                break;
+            }
+
+            case 'r':
+            case 'R': {
+                char *end;
+                long int rate = strtol(optarg, &end, 10);
+
+                if (rate < 0 || rate > UINT32_MAX || *end != '\0') {
+                    fprintf(stderr, "Invalid send rate: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+
+                if (opt == 'r') {
+                    Options.send_rate = rate;
+                    printf("Option set: Send rate %ld messages/s\n", rate);
+                } else {
+                    Options.send_byte_rate = rate;
+                    printf("Option set: Send rate %ld bytes/s\n", rate);
+                }
+
+                break;
+            }
+
+            case 's': {
+                snprintf(Options.bridge_socket, sizeof(Options.bridge_socket), "%s", optarg);
+                printf("Option set: Bridge socket %s\n", optarg);
+                break;
+            }
+
             case 'p': {
                 Options.proxy_type = TOX_PROXY_TYPE_SOCKS5;
             }
@@ -1035,6 +1429,17 @@ static void parse_args(int argc, char *argv[])
                 break;
             }
 
+            case 'x': {
+                if (Options.num_profiles >= MAX_PROFILES) {
+                    fprintf(stderr, "Too many profiles\n");
+                    exit(EXIT_FAILURE);
+                }
+
+                Options.profiles[Options.num_profiles++] = optarg;
+                printf("Option set: Profile %s\n", optarg);
+                break;
+            }
+
             case 'h':
 
             // Intentional fallthrough
@@ -1062,7 +1467,7 @@ static void init_tox_options(struct Tox_Options *tox_opts)
     }
 }
 
-static Tox *init_tox(void)
+static Tox *init_tox(const char *path)
 {
     Tox_Err_Options_New err;
     struct Tox_Options *tox_opts = tox_options_new(&err);
@@ -1074,7 +1479,7 @@ static Tox *init_tox(void)
 
     init_tox_options(tox_opts);
 
-    Tox *m = load_tox(tox_opts, DATA_FILE);
+    Tox *m = load_tox(tox_opts, path);
 
     tox_options_free(tox_opts);
 
@@ -1093,6 +1498,8 @@ static Tox *init_tox(void)
     tox_callback_conference_message(m, cb_conference_message);
     tox_callback_group_message(m, cb_group_message);
     tox_callback_group_invite(m, cb_group_invite2);
+    tox_callback_group_self_join(m, cb_group_self_join);
+    tox_callback_conference_connected(m, cb_conference_connected);
     // add by liqsliu
 
 
@@ -1144,22 +1551,25 @@ static struct toxNodes {
 static void bootstrap_DHT(Tox *m)
 {
     for (int i = 0; nodes[i].ip; ++i) {
-        char *key = hex_string_to_bin(nodes[i].key);
+        uint8_t key[TOX_PUBLIC_KEY_SIZE];
+
+        if (hex_decode_str(key, nodes[i].key, sizeof(key)) != 0) {
+            fprintf(stderr, "Invalid bootstrap node key: %s %d\n", nodes[i].ip, nodes[i].port);
+            continue;
+        }
 
         TOX_ERR_BOOTSTRAP err;
-        tox_bootstrap(m, nodes[i].ip, nodes[i].port, (uint8_t *) key, &err);
+        tox_bootstrap(m, nodes[i].ip, nodes[i].port, key, &err);
 
         if (err != TOX_ERR_BOOTSTRAP_OK) {
             fprintf(stderr, "Failed to bootstrap DHT: %s %d (error %d)\n", nodes[i].ip, nodes[i].port, err);
         }
 
-        tox_add_tcp_relay(m, nodes[i].ip, nodes[i].port, (uint8_t *) key, &err);
+        tox_add_tcp_relay(m, nodes[i].ip, nodes[i].port, key, &err);
 
         if (err != TOX_ERR_BOOTSTRAP_OK) {
             fprintf(stderr, "Failed to add TCP relay: %s %d (error %d)\n", nodes[i].ip, nodes[i].port, err);
         }
-
-        free(key);
     }
 }
 
@@ -1169,16 +1579,11 @@ static void print_profile_info(Tox *m)
     printf("Toxcore version %d.%d.%d\n", tox_version_major(), tox_version_minor(), tox_version_patch());
     printf("Tox ID: ");
 
-    char address[TOX_ADDRESS_SIZE];
-    tox_self_get_address(m, (uint8_t *) address);
-
-    for (int i = 0; i < TOX_ADDRESS_SIZE; ++i) {
-        char d[3];
-        snprintf(d, sizeof(d), "%02X", address[i] & 0xff);
-        printf("%s", d);
-    }
-
-    printf("\n");
+    uint8_t address[TOX_ADDRESS_SIZE];
+    char address_hex[TOX_ADDRESS_SIZE * 2 + 1];
+    tox_self_get_address(m, address);
+    hex_encode(address_hex, address, sizeof(address));
+    printf("%s\n", address_hex);
 
     char name[TOX_MAX_NAME_LENGTH];
     size_t len = tox_self_get_name_size(m);
@@ -1193,8 +1598,9 @@ static void print_profile_info(Tox *m)
     printf("Active groups: %lu\n", num_chats);
 }
 
-static void purge_inactive_friends(Tox *m)
+static void purge_inactive_friends(struct Tox_Bot *bot)
 {
+    Tox *m = bot->m;
     size_t numfriends = tox_self_get_friend_list_size(m);
 
     if (numfriends == 0) {
@@ -1218,32 +1624,40 @@ static void purge_inactive_friends(Tox *m)
             continue;
         }
 
-        if (get_time() - last_online > Tox_Bot.inactive_limit) {
-            tox_friend_delete(m, friendnum, NULL);
+        if (get_time() - last_online > bot->inactive_limit) {
+            uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+
+            if (tox_friend_get_public_key(m, friendnum, public_key, NULL) && tox_friend_delete(m, friendnum, NULL)) {
+                journal_friend(bot, JOURNAL_FRIEND_DELETE, public_key);
+            }
+
+            acl_friend_remove(&bot->friends, friendnum);
         }
     }
 }
 
-static void purge_empty_groups(Tox *m)
+static void purge_empty_groups(struct Tox_Bot *bot)
 {
-    for (uint32_t i = 0; i < Tox_Bot.chats_idx; ++i) {
-        if (!Tox_Bot.g_chats[i].active) {
+    Tox *m = bot->m;
+
+    for (uint32_t i = 0; i < bot->chats_idx; ++i) {
+        if (!bot->g_chats[i].active) {
             continue;
         }
         // add by liqsliu
-        if (Tox_Bot.g_chats[i].groupnum == 0)
+        if (bot->g_chats[i].groupnum == 0)
             continue;
         // add by liqsliu
 
         TOX_ERR_CONFERENCE_PEER_QUERY err;
-        uint32_t num_peers = tox_conference_peer_count(m, Tox_Bot.g_chats[i].groupnum, &err);
+        uint32_t num_peers = tox_conference_peer_count(m, bot->g_chats[i].groupnum, &err);
 
         if (err != TOX_ERR_CONFERENCE_PEER_QUERY_OK || num_peers <= 1) {
-            log_timestamp("Deleting empty group %d", Tox_Bot.g_chats[i].groupnum);
-            tox_conference_delete(m, Tox_Bot.g_chats[i].groupnum, NULL);
-            group_leave(i);
+            log_timestamp("Deleting empty group %d", bot->g_chats[i].groupnum);
+            tox_conference_delete(m, bot->g_chats[i].groupnum, NULL);
+            group_leave(bot, i);
 
-            if (i >= Tox_Bot.chats_idx) {   // group_leave modifies chats_idx
+            if (i >= bot->chats_idx) {   // group_leave modifies chats_idx
                 return;
             }
         }
@@ -1255,23 +1669,91 @@ static void purge_empty_groups(Tox *m)
  * Empty groups are purged on an interval, but only if we have a stable connection
  * to the Tox network.
  */
-static bool check_group_purge(time_t last_group_purge, time_t cur_time, TOX_CONNECTION connection_status)
+static bool check_group_purge(const struct Tox_Bot *bot, TOX_CONNECTION connection_status)
 {
-    if (!timed_out(last_group_purge, cur_time, GROUP_PURGE_INTERVAL)) {
-        return false;
-    }
-
     if (connection_status == TOX_CONNECTION_NONE) {
         return false;
     }
 
-    if (!timed_out(Tox_Bot.last_connected, cur_time, GROUP_PURGE_CONNECT_TIMEOUT)) {
+    if (!timed_out(bot->last_connected, get_time(), GROUP_PURGE_CONNECT_TIMEOUT)) {
         return false;
     }
 
     return true;
 }
 
+/* START TIMERS */
+static void timer_bootstrap(void *userdata)
+{
+    struct Tox_Bot *bot = userdata;
+
+    if (tox_self_get_connection_status(bot->m) == TOX_CONNECTION_NONE) {
+        log_timestamp("Bootstrapping to network...");
+        bootstrap_DHT(bot->m);
+        bot->last_bootstrap = get_time();
+    }
+}
+
+static void timer_friend_purge(void *userdata)
+{
+    struct Tox_Bot *bot = userdata;
+
+    if (tox_self_get_connection_status(bot->m) != TOX_CONNECTION_NONE) {
+        purge_inactive_friends(bot);
+    }
+}
+
+static void timer_journal_compact(void *userdata)
+{
+    journal_compact(userdata);
+}
+
+static void timer_group_purge(void *userdata)
+{
+    struct Tox_Bot *bot = userdata;
+
+    if (check_group_purge(bot, tox_self_get_connection_status(bot->m))) {
+        purge_empty_groups(bot);
+    }
+}
+
+static void timer_acl_reload(void *userdata)
+{
+    (void) userdata;
+
+    acl_reload_if_changed();
+}
+
+// add by liqsliu
+static void timer_rejoin(void *userdata)
+{
+    struct Tox_Bot *bot = userdata;
+
+    if (bot->joined_group == false && bot->public_group_num != bot->last_connected) {
+        join_public_group(bot);
+    }
+}
+// add by liqsliu
+
+/* Starts the calling thread's timers for bot */
+static void init_timers(struct Tox_Bot *bot)
+{
+    timers_init();
+
+    bot->bootstrap_timer = timer_periodic(0, BOOTSTRAP_INTERVAL * 1000, 0, timer_bootstrap, bot);
+    timer_periodic(FRIEND_PURGE_INTERVAL * 1000, FRIEND_PURGE_INTERVAL * 1000, TIMER_JITTER, timer_friend_purge, bot);
+    timer_periodic(GROUP_PURGE_INTERVAL * 1000, GROUP_PURGE_INTERVAL * 1000, TIMER_JITTER, timer_group_purge, bot);
+    timer_periodic(REJOIN_INTERVAL * 1000, REJOIN_INTERVAL * 1000, 0, timer_rejoin, bot);
+    timer_periodic(JOURNAL_COMPACT_INTERVAL * 1000, JOURNAL_COMPACT_INTERVAL * 1000, TIMER_JITTER,
+                   timer_journal_compact, bot);
+
+    /* the key lists are shared, so only the primary profile reloads them */
+    if (bot == &Profiles.bots[0]) {
+        timer_periodic(ACL_RELOAD_INTERVAL * 1000, ACL_RELOAD_INTERVAL * 1000, 0, timer_acl_reload, NULL);
+    }
+}
+/* END TIMERS */
+
 /* Attempts to rename legacy toxbot save file to new name
  *
  * Return 0 on successful rename, or if legacy file does not exist.
@@ -1298,9 +1780,84 @@ static int legacy_data_file_rename(void)
     return 0;
 }
 
+/*
+ * Loads the profile saved in path into bot. wake is called when a command that ran on a
+ * worker is ready to reply.
+ */
+static int init_profile(struct Tox_Bot *bot, const char *path, void (*wake)(void))
+{
+    *bot = (struct Tox_Bot) {
+        .data_file = path,
+    };
+
+    workers_results_init(&bot->results, wake);
+    snapshot_add(&bot->snapshot, path);
+
+    if (journal_init(&bot->journal, path) != 0) {
+        return -1;
+    }
+
+    bot->m = init_tox(path);
+
+    if (bot->m == NULL) {
+        return -1;
+    }
+
+    size_t replayed = journal_replay(&bot->journal, bot->m);
+
+    /*
+     * What was replayed is on disk nowhere but in the journals, so they may not be rotated
+     * away until a save that covers it has been written. The writer thread is not running
+     * yet, so this one is written before we go on.
+     */
+    if (replayed > 0) {
+        log_timestamp("Replayed %zu friend list changes from %s", replayed, bot->journal.path);
+        snapshot_save(&bot->snapshot, bot->m);
+        bot->journal_seq = bot->snapshot.taken;
+    }
+
+    init_toxbot_state(bot);
+    acl_friends_load(&bot->friends, bot->m);
+    load_conferences(bot);
+    print_profile_info(bot->m);
+
+    return 0;
+}
+
+/*
+ * Runs an extra profile until we exit. It has its own timers and outbox, and shares the
+ * bridge and key lists with the primary profile; messages from the bridge socket and
+ * inbound sources only go to the primary profile.
+ */
+static void *profile_thread(void *arg)
+{
+    struct Tox_Bot *bot = arg;
+    Tox *m = bot->m;
+
+    outbox_init(Options.send_rate, Options.send_byte_rate, cb_outbox_lost);
+    init_timers(bot);
+
+    while (!FLAG_EXIT) {
+        timers_run();
+
+        tox_iterate(m, bot);
+        workers_dispatch(&bot->results);
+        outbox_flush(m, bot);
+
+        usleep(MIN(tox_iteration_interval(m), timers_next()) * 1000);
+    }
+
+    outbox_free();
+    timers_free();
+
+    return NULL;
+}
+
 int main(int argc, char **argv)
 {
-    signal(SIGINT, catch_SIGINT);
+    signal(SIGINT, catch_exit_signal);
+    signal(SIGTERM, catch_exit_signal);    /* so that a restart still saves the profiles */
+    signal(SIGPIPE, SIG_IGN);    /* a dead bridge worker is detected by write() failing */
     umask(S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
 
     int ret = legacy_data_file_rename() ;
@@ -1312,77 +1869,89 @@ int main(int argc, char **argv)
 
     parse_args(argc, argv);
 
-    Tox *m = init_tox();
+    if (acl_init() != 0) {
+        fprintf(stderr, "Warning: failed to load key lists\n");
+    }
+
+    /* the extra profiles' loops never sleep longer than tox asks, so they need no wakeup */
+    for (size_t i = 0; i < Options.num_profiles; ++i) {
+        if (init_profile(&Profiles.bots[i], Options.profiles[i], i == 0 ? event_loop_wake : NULL) != 0) {
+            fprintf(stderr, "Failed to load profile %s\n", Options.profiles[i]);
+            exit(EXIT_FAILURE);
+        }
 
-    if (m == NULL) {
-        exit(EXIT_FAILURE);
+        ++Profiles.count;
+    }
+
+    struct Tox_Bot *bot = &Profiles.bots[0];
+    Tox *m = bot->m;
+
+    if (event_loop_init() != 0) {
+        fprintf(stderr, "Warning: failed to create event loop, bridge socket disabled\n");
     }
 
-    init_toxbot_state();
-    load_conferences(m);
-    print_profile_info(m);
+    if (bridge_socket_init(Options.bridge_socket) != 0) {
+        fprintf(stderr, "Warning: failed to open bridge socket %s\n", Options.bridge_socket);
+    }
+
+    inbound_init(INBOUND_SPOOL_DIR);
+
+    if (bridge_init(Options.bridge_queue_size, Options.bridge_overflow, Options.bridge_scripts,
+                    BRIDGE_SPOOL_DIR) != 0) {
+        fprintf(stderr, "Warning: failed to start bridge worker\n");
+    }
 
-    time_t cur_time = get_time();
+    outbox_init(Options.send_rate, Options.send_byte_rate, cb_outbox_lost);
 
-    uint64_t last_friend_purge = cur_time;
-    uint64_t last_group_purge = cur_time;
+    init_timers(bot);
 
 // add by liqsliu
-    uint64_t last_join = cur_time;
-    PUBLIC_GROUP_NUM = Tox_Bot.last_connected;
-    pthread_t pthreads[1];
-    int rc = pthread_create(&pthreads[0], NULL, my_daemon, (void *)m);
-    if (rc != 0)
-    {
+    if (sources_init() != 0) {
         log_timestamp("无法创建线程");
     }
     commands_init();
 // add by liqsliu
 
-    while (!FLAG_EXIT) {
-        TOX_CONNECTION connection_status = tox_self_get_connection_status(m);
+    if (workers_init(WORKERS_DEFAULT) != 0) {
+        fprintf(stderr, "Warning: failed to start worker threads, commands will block\n");
+    }
 
-        if (connection_status == TOX_CONNECTION_NONE
-                && timed_out(Tox_Bot.last_bootstrap, cur_time, BOOTSTRAP_INTERVAL)) {
-            log_timestamp("Bootstrapping to network...");
-            bootstrap_DHT(m);
-            Tox_Bot.last_bootstrap = cur_time;
-        }
+    if (snapshot_init() != 0) {
+        fprintf(stderr, "Warning: failed to start snapshot writer, saves will block\n");
+    }
 
-        if (connection_status != TOX_CONNECTION_NONE && timed_out(last_friend_purge, cur_time, FRIEND_PURGE_INTERVAL)) {
-            purge_inactive_friends(m);
-            save_data(m, DATA_FILE);
-            last_friend_purge = cur_time;
-        }
+    for (Profiles.started = 1; Profiles.started < Profiles.count; ++Profiles.started) {
+        struct Tox_Bot *extra = &Profiles.bots[Profiles.started];
 
-        if (check_group_purge(last_group_purge, cur_time, connection_status)) {
-            purge_empty_groups(m);
-            last_group_purge = cur_time;
+        if (pthread_create(&Profiles.threads[Profiles.started], NULL, profile_thread, extra) != 0) {
+            log_error_timestamp(-1, "Failed to start profile %s", extra->data_file);
+            FLAG_EXIT = true;
+            break;
         }
+    }
 
-        tox_iterate(m, NULL);
+    while (!FLAG_EXIT) {
+        timers_run();
 
+        tox_iterate(m, bot);
 
-        usleep(tox_iteration_interval(m) * 1000);
+        /* sleep until tox or the next maintenance task is due, whichever comes first */
+        event_loop_set_timer(MIN(tox_iteration_interval(m), timers_next()));
 
-        cur_time = get_time();
-// add by liqsliu
-/** get_msg_from_mt(m); */
-        if (joined_group == true)
-        {
-            last_join = cur_time;
-        } else if (PUBLIC_GROUP_NUM == Tox_Bot.last_connected) {
-            last_join = cur_time;
-        } else if (cur_time - last_join > 15) {
-            /** PUBLIC_GROUP_NUM == 0; */
-            join_public_group(m);
-            last_join = cur_time;
-        }
-// add by liqsliu
+        /* bridge messages go out as soon as they arrive; tox is iterated again when the timer expires */
+        do {
+            inbound_dispatch(cb_bridge_inbound, bot);
+            workers_dispatch(&bot->results);
+            outbox_flush(m, bot);
+            inbound_commit(outbox_oldest_seq());
+        } while (!event_loop_wait() && !FLAG_EXIT);
+    }
 
+    for (size_t i = 1; i < Profiles.started; ++i) {
+        pthread_join(Profiles.threads[i], NULL);
     }
 
-    exit_toxbot(m);
+    exit_toxbot();
 
     return 0;
 }
@@ -25,29 +25,69 @@
 
 #include <stdint.h>
 #include <tox/tox.h>
+#include "acl.h"
 #include "groupchats.h"
+#include "journal.h"
+#include "snapshot.h"
+#include "workers.h"
 
 #define MAX_NUM_GROUPS 256
 
+/* How many Tox profiles one process can run, each on a thread of its own */
+#define MAX_PROFILES 16
+
+struct Group_Join;
+
 #define DATA_FILE        "toxbot.tox"
 #define MASTERLIST_FILE  "masterkeys"
 #define BLOCKLIST_FILE   "blockedkeys"
+#define BLOCKLIST_BIN_FILE "blockedkeys.bin"
 
+/*
+ * Everything that belongs to one Tox profile. It is the userdata of every toxcore,
+ * timer and outbox callback, and is only touched by the thread that runs the profile.
+ */
 struct Tox_Bot {
+    Tox        *m;
+    const char *data_file;  // the profile's save file
     time_t     start_time;  // time toxbot was started
     time_t     last_connected;  // time we last connected to the network
     time_t     last_bootstrap;  // last time we tried to bootstrap
+    uint32_t   bootstrap_timer;  // the timer that bootstraps while we are not connected
     uint64_t   inactive_limit;  // how often we purge inactive contacts
     int        default_groupnum;  // the group that invite commands with no ID default to
     int        num_online_friends;
     int        chats_idx;
 
     struct Group_Chat *g_chats;
+    struct Acl_Friends friends;
+    struct Work_Results results;    // commands that ran on a worker, waiting to reply
+    uint32_t   save_timer;  // the pending save_data_later(), 0 if the profile is saved
+    struct Snapshot snapshot;
+    struct Journal journal;    // friend list changes since the last compaction
+    uint64_t   journal_seq;    // the snapshot that covers the rotated journal
+
+    // add by liqsliu
+    uint32_t   public_group_num;
+    uint32_t   my_num;
+    bool       joined_group;
+    struct Group_Join *joins;    // group joins and invites waiting their turn
+    uint32_t   join_timer;    // the timer that makes the next of them, 0 if none is pending
 };
 
 int load_Masters(const char *path);
+/*
+ * Writes m's savedata to path. The data goes to a temporary file that is synced and
+ * then renamed over path, so a crash never leaves a half written profile behind.
+ */
 int save_data(Tox *m, const char *path);
-bool friend_is_master(Tox *m, uint32_t friendnumber);
+
+/*
+ * Saves bot's profile SAVE_DELAY seconds from now, along with anything else that changes
+ * in the meantime. Use for every change that does not have to be on disk right away.
+ */
+void save_data_later(struct Tox_Bot *bot);
+bool friend_is_master(struct Tox_Bot *bot, uint32_t friendnumber);
 
 // add by liqsliu
 #define BOT_NAME "bot"
@@ -57,12 +97,15 @@ bool friend_is_master(Tox *m, uint32_t friendnumber);
 // #define CHAT_ID_TRIFA "154b3973bd0e66304fd6179a8a54759073649e09e6e368f0334fc6ed666ab762"
 
 #define SH_PATH "/run/user/1000/bot"
-#define SM_SH_PATH "bash /run/user/1000/bot/sm.sh \"$(cat <<EOF\n"
+#define BRIDGE_SOCKET_PATH SH_PATH "/toxbot.sock"
+#define BRIDGE_SPOOL_DIR "bridge_spool"
+#define INBOUND_SPOOL_DIR "inbound_spool"
+#define SM_WORKER_PATH "bash /run/user/1000/bot/sm_worker.sh"
 #define GM_SH_PATH "bash /run/user/1000/bot/gm_stream.sh"
 
-int rejoin_public_group(Tox *m, Tox_Group_Number gn);
-int join_public_group(Tox *m);
-int join_public_group_by_chat_id(Tox *m, char *chat_id);
+int rejoin_public_group(struct Tox_Bot *bot, Tox_Group_Number gn);
+int join_public_group(struct Tox_Bot *bot);
+int join_public_group_by_chat_id(struct Tox_Bot *bot, char *chat_id);
 // add by liqsliu
 
 #endif /* TOXBOT_H */
@@ -0,0 +1,219 @@
+/*  workers.c
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "workers.h"
+#include "log.h"
+
+struct Work {
+    struct Work          *next;
+    work_cb              *work;
+    work_cb              *finish;
+    void                 *arg;
+    struct Work_Results  *results;
+};
+
+static struct Workers {
+    pthread_mutex_t  lock;
+    pthread_cond_t   cond;
+    struct Work      *head;
+    struct Work      *tail;
+    bool             stopping;
+
+    pthread_t        threads[WORKERS_MAX];
+    size_t           count;
+} workers = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void results_post(struct Work *job)
+{
+    struct Work_Results *results = job->results;
+
+    job->next = NULL;
+
+    pthread_mutex_lock(&results->lock);
+
+    if (results->tail != NULL) {
+        results->tail->next = job;
+    } else {
+        results->head = job;
+    }
+
+    results->tail = job;
+
+    pthread_mutex_unlock(&results->lock);
+
+    if (results->wake != NULL) {
+        results->wake();
+    }
+}
+
+static void *worker_thread(void *arg)
+{
+    (void) arg;
+
+    pthread_mutex_lock(&workers.lock);
+
+    while (true) {
+        while (workers.head == NULL && !workers.stopping) {
+            pthread_cond_wait(&workers.cond, &workers.lock);
+        }
+
+        /* the queue is drained before stopping, so no job is left without its finish */
+        struct Work *job = workers.head;
+
+        if (job == NULL) {
+            break;
+        }
+
+        workers.head = job->next;
+
+        if (workers.head == NULL) {
+            workers.tail = NULL;
+        }
+
+        pthread_mutex_unlock(&workers.lock);
+
+        if (job->work != NULL) {
+            job->work(job->arg);
+        }
+
+        results_post(job);
+
+        pthread_mutex_lock(&workers.lock);
+    }
+
+    pthread_mutex_unlock(&workers.lock);
+
+    return NULL;
+}
+
+int workers_init(size_t count)
+{
+    if (count > WORKERS_MAX) {
+        count = WORKERS_MAX;
+    }
+
+    workers.stopping = false;
+
+    while (workers.count < count) {
+        if (pthread_create(&workers.threads[workers.count], NULL, worker_thread, NULL) != 0) {
+            log_error_timestamp(-1, "Failed to create worker thread");
+            return workers.count > 0 ? 0 : -1;
+        }
+
+        ++workers.count;
+    }
+
+    return 0;
+}
+
+void workers_kill(void)
+{
+    pthread_mutex_lock(&workers.lock);
+    workers.stopping = true;
+    pthread_cond_broadcast(&workers.cond);
+    pthread_mutex_unlock(&workers.lock);
+
+    for (size_t i = 0; i < workers.count; ++i) {
+        pthread_join(workers.threads[i], NULL);
+    }
+
+    workers.count = 0;
+}
+
+void workers_results_init(struct Work_Results *results, void (*wake)(void))
+{
+    pthread_mutex_init(&results->lock, NULL);
+    results->head = NULL;
+    results->tail = NULL;
+    results->wake = wake;
+}
+
+int workers_queue(struct Work_Results *results, work_cb *work, work_cb *finish, void *arg)
+{
+    struct Work *job = malloc(sizeof(struct Work));
+
+    if (job == NULL) {
+        log_error_timestamp(-1, "Failed to allocate work");
+        return -1;
+    }
+
+    *job = (struct Work) {
+        .work = work,
+        .finish = finish,
+        .arg = arg,
+        .results = results,
+    };
+
+    pthread_mutex_lock(&workers.lock);
+
+    if (workers.count == 0) {
+        pthread_mutex_unlock(&workers.lock);
+
+        /* no pool: do the work here, but still finish from the loop like everything else */
+        if (work != NULL) {
+            work(arg);
+        }
+
+        results_post(job);
+        return 0;
+    }
+
+    if (workers.tail != NULL) {
+        workers.tail->next = job;
+    } else {
+        workers.head = job;
+    }
+
+    workers.tail = job;
+
+    pthread_cond_signal(&workers.cond);
+    pthread_mutex_unlock(&workers.lock);
+
+    return 0;
+}
+
+void workers_dispatch(struct Work_Results *results)
+{
+    pthread_mutex_lock(&results->lock);
+
+    struct Work *job = results->head;
+    results->head = NULL;
+    results->tail = NULL;
+
+    pthread_mutex_unlock(&results->lock);
+
+    while (job != NULL) {
+        struct Work *next = job->next;
+
+        job->finish(job->arg);
+        free(job);
+
+        job = next;
+    }
+}
@@ -0,0 +1,84 @@
+/*  workers.h
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+/*
+ * A small pool of threads for work that blocks on file I/O, such as commands that read
+ * or write files, so it never holds up tox_iterate(). A job runs in two halves: work()
+ * on a worker, which must not call toxcore, then finish() on the thread that owns the
+ * Tox instance, which sends the replies and changes whatever state the job affects.
+ *
+ * Each thread that runs a Tox instance has a Work_Results that finished jobs are posted
+ * to, and calls workers_dispatch() on it from its loop.
+ */
+
+#define WORKERS_DEFAULT 2
+#define WORKERS_MAX     8
+
+typedef void work_cb(void *arg);
+
+struct Work;
+
+struct Work_Results {
+    pthread_mutex_t  lock;
+    struct Work      *head;
+    struct Work      *tail;
+    void             (*wake)(void);    // called when a job is posted, may be NULL
+};
+
+/*
+ * Starts count worker threads. Jobs queued before this, or after it failed, run on the
+ * calling thread.
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */
+int workers_init(size_t count);
+
+/* Lets the workers finish every queued job, then stops them. */
+void workers_kill(void);
+
+/* wake is called from the worker whenever a job is posted to results; it may be NULL. */
+void workers_results_init(struct Work_Results *results, void (*wake)(void));
+
+/*
+ * Queues a job. work(arg) runs on a worker, then finish(arg) is called by
+ * workers_dispatch(results). finish owns arg and must free it. work may be NULL.
+ *
+ * Returns 0 on success.
+ * Returns -1 if the job could not be queued, in which case neither callback is called.
+ */
+int workers_queue(struct Work_Results *results, work_cb *work, work_cb *finish, void *arg);
+
+/*
+ * Calls finish for every job that has been posted to results, in the order they
+ * finished. Must only be called from the thread that owns the Tox instance.
+ */
+void workers_dispatch(struct Work_Results *results);
+
+#endif /* WORKERS_H */